@@ -6,154 +6,7237 @@
  */
 
 #include <tcl.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <ctype.h>
 #include <string.h>
 #include <limits.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <zlib.h>
 #include <libwebsockets.h>
 
+// The TLS options of listen tune the SSL_CTX of libwebsockets, so they
+// need the OpenSSL headers.  configure defines this as 1 when it finds
+// them.
+#ifndef TCLWEBSOCKETS_OPENSSL
+#define TCLWEBSOCKETS_OPENSSL 0
+#endif
+
+#if TCLWEBSOCKETS_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+#endif
+
 
 #undef TCL_STORAGE_CLASS
 #define TCL_STORAGE_CLASS DLLEXPORT
 
+EXTERN int Tclwebsockets_Init(Tcl_Interp *interp);
+
+
+
+// Names of the handler events, indexed by libwebsocket_callback_reasons.
+static const char *handler_event_names[] = {
+  "established",                 // LWS_CALLBACK_ESTABLISHED,
+  "client-connection-error",     // LWS_CALLBACK_CLIENT_CONNECTION_ERROR,
+  "client-established",          // LWS_CALLBACK_CLIENT_ESTABLISHED,
+  "closed",                      // LWS_CALLBACK_CLOSED,
+  "receive",                     // LWS_CALLBACK_RECEIVE,
+  "client-receive",              // LWS_CALLBACK_CLIENT_RECEIVE,
+  "client-receive-pong",         // LWS_CALLBACK_CLIENT_RECEIVE_PONG,
+  "client-writeable",            // LWS_CALLBACK_CLIENT_WRITEABLE,
+  "server-writeable",            // LWS_CALLBACK_SERVER_WRITEABLE,
+  "http",                        // LWS_CALLBACK_HTTP,
+  "broadcast",                   // LWS_CALLBACK_BROADCAST,
+  "filter-network-connection",   // LWS_CALLBACK_FILTER_NETWORK_CONNECTION,
+  "filter-protocol-connection",  // LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION,
+  "receive-batch",               // EVENT_RECEIVE_BATCH, raised by us.
+  "timeout",                     // EVENT_TIMEOUT, raised by us.
+  "drained"                      // EVENT_DRAINED, raised by us.
+};
+
+#define NUM_HANDLER_EVENTS (sizeof(handler_event_names) / sizeof(handler_event_names[0]))
+
+// Events past the libwebsockets reasons, which are not raised by it.
+#define EVENT_RECEIVE_BATCH 13
+#define EVENT_TIMEOUT 14
+#define EVENT_DRAINED 15
+#define NUM_CALLBACK_EVENTS EVENT_RECEIVE_BATCH
+
+
+// Statistics for $ctx stats and $wsi stats.  configure --disable-stats
+// defines this as 0, which compiles the counters and the STATS_ macros
+// out altogether.
+#ifndef TCLWEBSOCKETS_STATS
+#define TCLWEBSOCKETS_STATS 1
+#endif
+
+#if TCLWEBSOCKETS_STATS
+
+// Handler run times are counted in a histogram of power-of-two buckets
+// of ticks: CPU cycles where the time stamp counter can be read, else
+// nanoseconds.
+#define HANDLER_TIME_BUCKETS 48
+
+struct context_stats {
+  Tcl_WideInt connections;              // accepted connections that completed the handshake.
+  Tcl_WideInt client_connections;       // outbound connections that completed the handshake.
+  Tcl_WideInt connect_errors;           // outbound connections that failed.
+  Tcl_WideInt closes;
+  Tcl_WideInt open_connections;
+  Tcl_WideInt messages_in;
+  Tcl_WideInt bytes_in;
+  Tcl_WideInt messages_out;
+  Tcl_WideInt bytes_out;
+  Tcl_WideInt write_calls;              // calls to libwebsocket_write(), one send() each.
+  Tcl_WideInt write_errors;             // libwebsocket_write() failed.
+  Tcl_WideInt queue_full;               // writes refused or recipients skipped at -highwater.
+  Tcl_WideInt broadcasts;
+  Tcl_WideInt handler_errors;           // handlers that raised an error.
+  Tcl_WideInt messages_too_large;       // connections closed for exceeding -maxmessage.
+  Tcl_WideInt pings;                    // sent for -pinginterval.
+  Tcl_WideInt timeouts;                 // connections closed for -idletimeout.
+  Tcl_WideInt refused_maxconnections;   // connections refused by the admission checks,
+  Tcl_WideInt refused_connectrate;
+  Tcl_WideInt refused_filter;           // and by a filter handler.
+  Tcl_WideInt closed_messagerate;       // connections closed for exceeding -messagerate.
+  Tcl_WideInt json_parsed;              // messages parsed for -format json,
+  Tcl_WideInt json_parse_ticks;         // and the time it took.
+  Tcl_WideInt json_errors;              // messages that were not JSON.
+  Tcl_WideInt json_written;             // values written by writejson,
+  Tcl_WideInt json_write_ticks;         // and the time it took.
+  Tcl_WideInt events[NUM_HANDLER_EVENTS];   // handler events dispatched, by reason.
+  Tcl_WideInt handler_ticks;            // time spent in handlers.
+  Tcl_WideInt handler_time[HANDLER_TIME_BUCKETS];
+  size_t peak_queued;                   // largest outbound queue of any connection.
+};
+
+struct session_stats {
+  Tcl_WideInt messages_in;
+  Tcl_WideInt bytes_in;
+  Tcl_WideInt messages_out;
+  Tcl_WideInt bytes_out;
+  Tcl_WideInt write_calls;
+  Tcl_WideInt write_errors;
+  Tcl_WideInt queue_full;
+  Tcl_WideInt events;
+  Tcl_WideInt handler_ticks;
+  size_t peak_queued;
+};
+
+#define STATS_INCR(owner, field) ((owner)->stats.field++)
+#define STATS_ADD(owner, field, n) ((owner)->stats.field += (n))
+#define STATS_MAX(owner, field, n) do { if ((n) > (owner)->stats.field) (owner)->stats.field = (n); } while (0)
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STATS_TICK_UNIT "cycles"
+static inline Tcl_WideUInt
+tclwebsockets_ticks(void)
+{
+  unsigned int lo, hi;
+  __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((Tcl_WideUInt) hi << 32) | lo;
+}
+#else
+#define STATS_TICK_UNIT "ns"
+static Tcl_WideUInt
+tclwebsockets_ticks(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (Tcl_WideUInt) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+#else
+
+#define STATS_INCR(owner, field)
+#define STATS_ADD(owner, field, n)
+#define STATS_MAX(owner, field, n)
+
+#endif /* TCLWEBSOCKETS_STATS */
+
+
+// Per-interpreter state, attached as assoc data.
+struct interp_data_struct {
+  int handlerEpoch;                     // linked to ::websockets::handlerEpoch
+  struct websocket_session_struct *current_session;  // whose handler is running.
+  Tcl_HashTable handles;                // connection name -> struct connection_handle
+  unsigned long nextConnectionIndex;    // for websocketN names.
+  unsigned long nextContextIndex;       // for lwscontextN names.
+  Tcl_HashTable clientContexts;         // handler name -> context created by websockets::connect
+};
+
+
+// Resolves a connection name to its session.  Tcl_Objs of the
+// connectionHandleType cache a pointer to this record, which outlives the
+// session (it is reference counted) so that a cached handle of a closed
+// connection can be detected.
+struct connection_handle {
+  struct websocket_session_struct *session;   // NULL once the connection closed.
+  struct interp_data_struct *interpdata;
+  Tcl_HashEntry *entry;                 // in interpdata->handles, NULL once closed.
+  int refcount;
+};
+
+
+// Resolved handler definition for one protocol of a context.  The lambdas
+// are pinned here so that events never need to consult the Tcl arrays,
+// until websockets::handler bumps the epoch by redefining something.
+struct handler_dispatch_struct {
+  const char *handler_name;             // pointer into protocol definition.
+  int epoch;                            // handlerEpoch when last resolved.
+  Tcl_Obj *lambdas[NUM_HANDLER_EVENTS]; // NULL if there is no handler for the event.
+  int numargs[NUM_HANDLER_EVENTS];      // number of arguments the user declared.
+  Tcl_Obj **statevar_names;             // names of the statevars.
+  int num_statevars;
+  int streaming;                        // receive gets each chunk, not whole messages.
+  int json;                             // text messages are parsed as JSON (-format json).
+  int coroutine;                        // established runs as a coroutine (-coroutine).
+  int batch_maxcount;                   // > 0 if messages go to receive-batch.
+  Tcl_WideInt batch_maxdelay_ns;        // 0 to deliver them at the end of each service pass.
+};
+
+
+// Buffers handed out by the pool of a context are preceded by this
+// header.  Sizes are rounded up to a power of two between 32 bytes and
+// 64KB, which covers the frames and queue entries of typical traffic and
+// the reassembly buffers of all but large messages; bigger requests go
+// straight to ckalloc().
+struct pool_block {
+  struct pool_block *next;              // while on a free list.
+  int size_class;                       // -1 if not pooled.
+  size_t size;                          // usable bytes.
+};
+
+#define POOL_MIN_SHIFT 5
+#define POOL_MAX_SHIFT 16
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+// Free buffers kept per context, in bytes; the rest go back to ckfree().
+#define POOL_KEEP_BYTES (4 * 1024 * 1024)
+
+struct buffer_pool {
+  struct pool_block *free[POOL_CLASSES];
+  int num_free[POOL_CLASSES];
+  int in_use[POOL_CLASSES];
+  size_t free_bytes;
+  int oversize_in_use;
+  Tcl_WideInt hits;                     // allocations served from a free list,
+  Tcl_WideInt misses;                   // from ckalloc() in a pooled size class,
+  Tcl_WideInt oversize;                 // and from ckalloc() because of their size.
+};
+
+
+// Link of a session in the timing wheel.  Every slot is a circular list
+// with a sentinel, so a session can be unlinked without knowing which
+// list it is on.
+struct wheel_link {
+  struct wheel_link *prev;
+  struct wheel_link *next;
+};
+
+// A hashed timing wheel that drives -pinginterval and -idletimeout for
+// all the sessions of a context.  A session is linked into the slot of
+// the tick when it next needs attention, and only the sessions of the
+// slots that have come due are looked at; traffic merely records the
+// time, and a session whose deadline moved is put back further ahead.
+#define WHEEL_SLOTS 256
+#define WHEEL_MIN_TICK_MS 10
+#define WHEEL_MAX_TICK_MS 1000
+
+struct timing_wheel {
+  struct wheel_link slots[WHEEL_SLOTS];
+  Tcl_WideInt tick_ns;
+  Tcl_WideInt current;                  // next tick to process.
+  int count;                            // sessions linked.
+  Tcl_TimerToken timer;
+};
+
+
+// A token bucket: up to burst tokens, refilled at rate per second.
+struct rate_limit {
+  double rate;                          // 0 for no limit.
+  double burst;
+};
+
+// What the admission checks remember about a peer address.  Entries are
+// kept while the address has connections, or while one of its buckets
+// has not refilled.
+struct peer_entry {
+  unsigned char addr[16];               // IPv6, or IPv4-mapped.
+  int connections;                      // established sessions from it.
+  double connect_tokens;
+  double message_tokens;
+  Tcl_WideInt connect_time;             // when the buckets were last refilled.
+  Tcl_WideInt message_time;
+};
+
+// Open addressing with linear probing, keyed by address.  Idle entries
+// are dropped whenever the table is rehashed.
+#define PEER_TABLE_MIN_SIZE 64
+
+struct peer_table {
+  struct peer_entry **slots;            // NULL unless a rate limit is set.
+  int size;                             // a power of two.
+  int count;
+};
+
+// A file under -docroot, kept in memory as a complete response: the
+// headers followed by the contents.
+struct cache_entry {
+  struct cache_entry *prev, *next;      // least recently served last.
+  Tcl_HashEntry *hentry;                // keyed by the request path.
+  char *response;
+  size_t length;
+  time_t mtime;                         // of the file it was read from.
+  off_t size;
+  Tcl_WideInt checked;                  // when the file was last stat()ed.
+};
+
+#define FILE_CACHE_DEFAULT_BYTES (16 * 1024 * 1024)
+
+// Cached files are stat()ed again at most this often.
+#define FILE_CACHE_RECHECK_NS 1000000000LL
+
+// HTTP responses go out in a single write, so files bigger than this
+// are not cached but sent from disk by libwebsockets_serve_http_file().
+// It stays below the default net.core.wmem_max, which caps how far
+// SO_SNDBUF can be grown for one.
+#define HTTP_SEND_LIMIT (128 * 1024)
+
+struct file_cache {
+  char *docroot;                        // NULL without -docroot.
+  Tcl_HashTable entries;
+  struct cache_entry *head, *tail;
+  size_t bytes;
+  size_t limit;                         // files above a quarter of it are not kept.
+  Tcl_WideInt hits;
+  Tcl_WideInt misses;                   // files read, or sent from disk.
+  Tcl_WideInt handled;                  // requests passed to the http event.
+};
+
+#if TCLWEBSOCKETS_OPENSSL
+
+// A session ticket key, in the order of a line of the -ticketkeys file:
+// the name tickets are tagged with, the HMAC secret and the AES key.
+struct tls_ticket_key {
+  unsigned char name[16];
+  unsigned char hmac_key[16];
+  unsigned char aes_key[16];
+};
+
+#define TLS_MAX_TICKET_KEYS 8
+
+// The -ticketkeys file is stat()ed again at most this often.
+#define TLS_KEYFILE_RECHECK_NS 1000000000LL
+
+// The TLS settings and counters of a listener created with -ssl.  The
+// settings are applied to the SSL_CTX of libwebsockets while the
+// context is being created.
+struct tls_state {
+  SSL_CTX *ssl_ctx;                     // NULL until libwebsockets hands it over.
+  long cache_size;                      // -sessioncache, or -1 for the OpenSSL default.
+  long cache_timeout;                   // -sessiontimeout in seconds, or 0 for the default.
+  char *ciphers;                        // NULL for the defaults.
+  char *curves;
+  unsigned char *alpn;                  // -alpn in wire format, or NULL.
+  unsigned int alpn_len;
+  char *keyfile;                        // -ticketkeys, or NULL for keys made by OpenSSL.
+  struct tls_ticket_key keys[TLS_MAX_TICKET_KEYS];   // keys[0] issues tickets, all are accepted.
+  int num_keys;
+  time_t keyfile_mtime;
+  ino_t keyfile_ino;
+  Tcl_WideInt keyfile_checked;
+  char error[256];                      // why the SSL_CTX could not be set up.
+  Tcl_WideInt handshakes;
+  Tcl_WideInt resumed;                  // handshakes that resumed a session.
+  Tcl_WideInt tickets_issued;
+  Tcl_WideInt tickets_unknown;          // presented with a key no longer in the file.
+  Tcl_WideInt key_reloads;
+};
+
+#endif /* TCLWEBSOCKETS_OPENSSL */
+
+
+struct context_userdata_struct {
+  Tcl_Interp *interp;
+  Tcl_Command cmdToken;
+  struct libwebsocket_context *context;
+  struct libwebsocket_protocols *protocols;
+  struct handler_dispatch_struct *dispatch;   // parallel to protocols
+  int num_protocols;
+  struct interp_data_struct *interpdata;
+  Tcl_Obj *applyObj;                    // "apply", used to invoke handler lambdas.
+
+  int use_eventloop;                    // sockets are serviced by Tcl file handlers.
+  int listen_fd;                        // first socket added during creation, or -1.
+  int drain_fd;                         // write end of the pipe put in its place by drain, or -1.
+  int create_commands;                  // give each connection its own command.
+  Tcl_HashTable pollfds;                // fd -> struct pollfd_entry (only if use_eventloop)
+
+  size_t highwater;                     // writes are refused once this much is queued.
+  size_t lowwater;                      // drained fires when a throttled queue gets below this.
+  size_t maxmessage;                    // larger incoming messages close the connection.
+  int has_extensions;                   // libwebsockets may negotiate an extension.
+  int use_ssl;                          // accepted connections are TLS.
+  struct libwebsocket *handshake_wsi;   // connection whose handshake the filter last saw,
+  int handshake_raw_frames;             // and whether it may have raw_frames set.
+
+  int callback_depth;                   // > 0 while libwebsockets is calling into us.
+  struct websocket_session_struct *pending_close;  // closes deferred until servicing returns.
+
+  struct websocket_session_struct *sessions;  // every accepted session.
+  Tcl_HashEntry *client_entry;          // in interpdata->clientContexts, if created by connect.
+  Tcl_HashTable topics;                 // topic name -> struct topic_struct
+
+  struct compression_struct *compression;   // NULL unless created with -compression.
+  struct buffer_pool pool;              // frames, queue entries and reassembly buffers.
+
+  struct websocket_session_struct *batches;   // sessions with messages waiting for receive-batch.
+  struct websocket_session_struct *flushing;  // taken off batches by flush_batches, not yet looked at.
+  Tcl_TimerToken batch_timer;           // fires when the next batch is due, or NULL.
+
+  Tcl_WideInt ping_interval_ns;         // silence after which a ping is sent, 0 for never.
+  Tcl_WideInt idle_timeout_ns;          // time without a message before closing, 0 for never.
+  struct timing_wheel *wheel;           // NULL unless either is set.
+
+  int max_connections;                  // handshakes beyond this are refused, 0 for no limit.
+  int num_connections;                  // accepted sessions.
+  int draining;                         // drain was called: new sessions are turned away.
+  struct rate_limit connect_rate;       // per peer address.
+  struct rate_limit message_rate;
+  struct peer_table peers;
+  struct file_cache files;
+  struct tls_state *tls;                // NULL unless listening with -ssl.
+
+#if TCLWEBSOCKETS_STATS
+  struct context_stats stats;
+#endif
+};
+
+
+// A named group of sessions that broadcasts can be addressed to.  The
+// topic exists only while it has members.
+struct topic_struct {
+  Tcl_HashEntry *entry;                 // in context_userdata_struct.topics
+  Tcl_HashTable members;                // session pointer -> NULL
+};
+
+struct topic_membership {
+  struct topic_struct *topic;
+  struct topic_membership *next;
+};
+
+
+// One of these exists for every socket that libwebsockets has asked us
+// to watch when the context is integrated with the Tcl event loop.
+struct pollfd_entry {
+  struct context_userdata_struct *userdata;
+  int fd;
+  int events;                           // POLLIN/POLLOUT mask wanted by libwebsockets.
+};
+
+
+// An outbound frame payload, allocated with the padding that
+// libwebsocket_write() needs on both sides.  Frames are reference counted
+// so that the same one can sit in the queues of several sessions.
+struct outbound_frame {
+  int refcount;
+  size_t len;
+  enum libwebsocket_write_protocol write_protocol;
+  int nocompress;                       // written with -nocompress.
+  unsigned char data[1];                // PRE_PADDING + payload + POST_PADDING
+};
+
+#define FRAME_PAYLOAD(frame) ((frame)->data + LWS_SEND_BUFFER_PRE_PADDING)
+
+struct outbound_queue_entry {
+  struct outbound_frame *frame;
+  struct outbound_queue_entry *next;
+};
+
+// Default watermarks for the per-session outbound queues.
+#define DEFAULT_HIGHWATER (1024 * 1024)
+#define DEFAULT_LOWWATER (256 * 1024)
+
+// How long drain waits for connections to close, in milliseconds.
+#define DEFAULT_DRAIN_TIMEOUT 10000
+
+// At most this many bytes are written per writeable callback, so that one
+// busy connection does not starve the others.  Fewer are written when the
+// socket has less room, see tclwebsockets_send_room().
+#define WRITE_DRAIN_QUANTUM (64 * 1024)
+
+
+
+// A zlib allocation kept for reuse by the next connection.
+struct zlib_block {
+  struct zlib_block *next;
+  size_t size;
+};
+
+// Freed zlib allocations of one size.  A deflate or inflate stream makes
+// only a handful of allocations of fixed sizes, so a few buckets suffice.
+struct zlib_bucket {
+  size_t size;                          // 0 if the bucket is unused.
+  struct zlib_block *blocks;
+};
+
+#define COMPRESSION_POOL_BUCKETS 8
+
+// At most this many bytes of freed zlib allocations are kept per context.
+#define COMPRESSION_POOL_BYTES (4 * 1024 * 1024)
+
+// Size of the buffers that compressed output and inflated input go
+// through.  libwebsockets consumes them before calling us again, so they
+// are shared by every connection of a context.
+#define COMPRESSION_BUFFER_SIZE (64 * 1024)
+
+// Settings and counters of the deflate-stream extension of a context
+// created with -compression.
+struct compression_struct {
+  struct libwebsocket_extension extensions[2];  // passed to libwebsocket_create_context()
+
+  int level;                            // zlib level for frames of min_size bytes or more.
+  int window_bits;
+  int mem_level;
+  size_t min_size;                      // smaller frames are sent as stored blocks.
+  int nocompress;                       // set while a -nocompress frame is written.
+
+  unsigned char tx_buffer[COMPRESSION_BUFFER_SIZE];
+  unsigned char rx_buffer[COMPRESSION_BUFFER_SIZE];
+
+  struct zlib_bucket pool[COMPRESSION_POOL_BUCKETS];
+  size_t pool_bytes;
+
+  Tcl_WideInt frames;                   // frames written ...
+  Tcl_WideInt stored_frames;            // ... of which were not compressed.
+  Tcl_WideInt tx_bytes_in;              // bytes handed to deflate,
+  Tcl_WideInt tx_bytes_out;             // and the bytes it produced.
+  Tcl_WideInt rx_bytes_in;              // bytes handed to inflate,
+  Tcl_WideInt rx_bytes_out;             // and the bytes it produced.
+  Tcl_WideInt deflate_ns;               // time spent in deflate() and inflate().
+  Tcl_WideInt inflate_ns;
+  Tcl_WideInt pool_hits;                // zlib allocations served from the pool,
+  Tcl_WideInt pool_misses;              // and from ckalloc().
+};
+
+// Per-connection state of the deflate-stream extension, allocated by
+// libwebsockets.
+struct deflate_conn {
+  struct compression_struct *compression;
+  z_stream zs_in;
+  z_stream zs_out;
+  int initialized;
+  int level;                            // current level of zs_out.
+  int rx_more;                          // inflate has more output for the last input.
+  int tx_more;                          // deflate has more output for the last input.
+};
+
+// Defaults for -compression.  Level 1 is what the built-in
+// deflate-stream extension of libwebsockets uses.
+#define DEFAULT_COMPRESSION_LEVEL 1
+#define DEFAULT_COMPRESSION_MEMLEVEL 8
+#define DEFAULT_COMPRESSION_MIN_SIZE 64
+
+
+// Default limit on the size of an incoming message.
+#define DEFAULT_MAXMESSAGE (16 * 1024 * 1024)
+
+// Flags of a chunk of a streamed message.
+#define RX_FIRST 1
+#define RX_FINAL 2
+
+// Handler lambdas are passed at most this many arguments (wsi, data, flags).
+#define MAX_HANDLER_ARGS 3
+
+// $wsi waitwritable yields from within the connection command, which
+// takes the non-recursive engine of Tcl 8.6.
+#if TCL_MAJOR_VERSION > 8 || (TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION >= 6)
+#define TCLWEBSOCKETS_NRE 1
+#else
+#define TCLWEBSOCKETS_NRE 0
+#endif
+
+// States of the coroutine of a connection with a -coroutine handler.
+#define CORO_NONE 0                     // not started, or over.
+#define CORO_RUNNING 1
+#define CORO_WAIT_MESSAGE 2             // in [yield], for the next message.
+#define CORO_WAIT_WRITABLE 3            // in $wsi waitwritable.
+
+
+// Contexts that are still inside libwebsocket_create_context() do not have
+// their user data attached yet, but the listening socket is added then.
+// Listeners may be created in several threads at once, so this is kept
+// per thread.
+typedef struct ThreadSpecificData {
+  struct context_userdata_struct *creatingContext;
+} ThreadSpecificData;
+
+static Tcl_ThreadDataKey dataKey;
+
+
+struct websocket_session_struct {
+  struct handler_dispatch_struct *dispatch;
+  char connection_cmd_name[32];         // "websocket" and a counter.
+  Tcl_Obj *connection_cmd_obj;
+
+  Tcl_Obj **statevals;                  // values of the statevars, NULL if unset.
+  int num_statevals;
+
+  int close_requested;
+  int close_when_flushed;               // drain closes it once its queue is empty.
+  struct websocket_session_struct *next_pending_close;
+
+  Tcl_Interp *interp;
+  Tcl_Command cmdToken;                 // NULL if the listener was created with -commands 0.
+  struct connection_handle *handle;
+
+  struct outbound_queue_entry *queue_head;    // frames waiting for the socket.
+  struct outbound_queue_entry *queue_tail;
+  size_t queued_bytes;
+  int throttled;                        // a write was refused at the high watermark.
+  int raw_frames;                       // queued frames can be framed by us and coalesced.
+
+  int is_client;                        // opened by websockets::connect.
+  int released;                         // tclwebsockets_free_session() was called.
+  enum lws_close_status close_status;   // sent when a deferred close is carried out.
+
+  unsigned char *rx_buffer;             // fragments of the message being received.
+  size_t rx_size;                       // allocated size of rx_buffer.
+  size_t rx_len;                        // bytes received so far of the current message.
+  int rx_binary;                        // the current message is binary.
+  int rx_discard;                       // the current message exceeded -maxmessage.
+
+  Tcl_Obj *batch;                       // messages waiting for receive-batch, or NULL.
+  Tcl_WideInt batch_deadline;           // when they are due, in tclwebsockets_now_ns() time.
+  struct websocket_session_struct *next_batch;  // in context_userdata_struct.batches or .flushing
+
+  struct peer_entry *peer;              // of an accepted session, if the peers are tracked.
+
+  struct wheel_link wheel_link;         // in context_userdata_struct.wheel, if next is set.
+  Tcl_WideInt wheel_due;                // tick of the slot it is linked into.
+  Tcl_WideInt last_message;             // tclwebsockets_now_ns() of the last message received,
+  Tcl_WideInt last_seen;                // of anything received, including pongs,
+  Tcl_WideInt last_ping;                // and of the last ping sent.
+
+  Tcl_Obj *coroutine;                   // command of the -coroutine handler, while it runs.
+  Tcl_Obj *coro_pending;                // messages waiting for it to yield, or NULL.
+  int coro_state;                       // CORO_NONE ... CORO_WAIT_WRITABLE
+  int rx_held;                          // reading is stopped, see tclwebsockets_update_rx().
+
+  struct websocket_session_struct *prev_session;    // in context_userdata_struct.sessions
+  struct websocket_session_struct *next_session;
+  struct topic_membership *topics;      // topics this session has joined.
+
+  struct libwebsocket *socket;
+  struct libwebsocket_context *context;
+
+#if TCLWEBSOCKETS_STATS
+  struct session_stats stats;
+#endif
+};
+
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_defer_close --
+ *
+ *    Queue a session to be closed with the given status once the
+ *    context has finished servicing.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_defer_close(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data, enum lws_close_status status)
+{
+  if (session_data->close_requested) {
+    return;
+  }
+  session_data->close_requested = 1;
+  session_data->close_status = status;
+  session_data->next_pending_close = userdata->pending_close;
+  userdata->pending_close = session_data;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_request_close --
+ *
+ *    Close a connection.  If libwebsockets is currently calling into us,
+ *    the session is still referenced further up the stack, so the close
+ *    is deferred until the context has finished servicing.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_request_close(struct websocket_session_struct *session_data)
+{
+  struct context_userdata_struct *userdata = (struct context_userdata_struct*) libwebsockets_get_user_data(session_data->context);
+
+  if (session_data->close_requested) {
+    return;
+  }
+
+  if (userdata->callback_depth == 0) {
+    libwebsocket_close_and_free_session(session_data->context, session_data->socket, LWS_CLOSE_STATUS_NORMAL);
+    return;
+  }
+
+  tclwebsockets_defer_close(userdata, session_data, LWS_CLOSE_STATUS_NORMAL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_flush_pending_closes --
+ *
+ *    Close the sessions whose close was deferred by a handler.  Must only
+ *    be called once libwebsockets has returned control to us.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_flush_pending_closes(struct context_userdata_struct *userdata)
+{
+  while (userdata->pending_close != NULL) {
+    struct websocket_session_struct *session_data = userdata->pending_close;
+    userdata->pending_close = session_data->next_pending_close;
+    session_data->next_pending_close = NULL;
+
+    libwebsocket_close_and_free_session(userdata->context, session_data->socket, session_data->close_status);
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_wheel_unlink, tclwebsockets_wheel_append --
+ *
+ *    Take a session off the timing wheel list it is on, if any, and
+ *    append a link to a list.
+ *
+ *----------------------------------------------------------------------
+ */
+#define SESSION_FROM_WHEEL(link) ((struct websocket_session_struct*) ((char*) (link) - offsetof(struct websocket_session_struct, wheel_link)))
+
+static void
+tclwebsockets_wheel_unlink(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data)
+{
+  struct wheel_link *link = &session_data->wheel_link;
+
+  if (link->next != NULL) {
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->prev = link->next = NULL;
+    userdata->wheel->count--;
+  }
+}
+
+static void
+tclwebsockets_wheel_append(struct wheel_link *list, struct wheel_link *link)
+{
+  link->prev = list->prev;
+  link->next = list;
+  list->prev->next = link;
+  list->prev = link;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_pool_alloc, tclwebsockets_pool_free --
+ *
+ *    Allocate and free buffers from the pool of a context.  Freed
+ *    buffers go onto the free list of their size class, so that the
+ *    next connection or message reuses them, until the context keeps
+ *    POOL_KEEP_BYTES.
+ *
+ *----------------------------------------------------------------------
+ */
+static void *
+tclwebsockets_pool_alloc(struct buffer_pool *pool, size_t size)
+{
+  struct pool_block *block;
+  int size_class = 0;
+
+  while (size_class < POOL_CLASSES && ((size_t) 1 << (size_class + POOL_MIN_SHIFT)) < size) {
+    size_class++;
+  }
+
+  if (size_class == POOL_CLASSES) {
+    block = (struct pool_block*) ckalloc(sizeof(struct pool_block) + size);
+    block->size_class = -1;
+    block->size = size;
+    pool->oversize++;
+    pool->oversize_in_use++;
+    return (void*) (block + 1);
+  }
+
+  block = pool->free[size_class];
+  if (block != NULL) {
+    pool->free[size_class] = block->next;
+    pool->num_free[size_class]--;
+    pool->free_bytes -= block->size;
+    pool->hits++;
+  } else {
+    block = (struct pool_block*) ckalloc(sizeof(struct pool_block) + ((size_t) 1 << (size_class + POOL_MIN_SHIFT)));
+    block->size_class = size_class;
+    block->size = (size_t) 1 << (size_class + POOL_MIN_SHIFT);
+    pool->misses++;
+  }
+  pool->in_use[size_class]++;
+  return (void*) (block + 1);
+}
+
+static void
+tclwebsockets_pool_free(struct buffer_pool *pool, void *ptr)
+{
+  struct pool_block *block = ((struct pool_block*) ptr) - 1;
+
+  if (block->size_class < 0) {
+    pool->oversize_in_use--;
+    ckfree((char*) block);
+    return;
+  }
+
+  pool->in_use[block->size_class]--;
+  if (pool->free_bytes + block->size > POOL_KEEP_BYTES) {
+    ckfree((char*) block);
+    return;
+  }
+  block->next = pool->free[block->size_class];
+  pool->free[block->size_class] = block;
+  pool->num_free[block->size_class]++;
+  pool->free_bytes += block->size;
+}
+
+// Usable size of a buffer from the pool.
+#define POOL_BUFFER_SIZE(ptr) ((((struct pool_block*) (ptr)) - 1)->size)
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_pool_release --
+ *
+ *    Return the free buffers of a pool to ckfree(), when its context is
+ *    deleted.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_pool_release(struct buffer_pool *pool)
+{
+  int i;
+
+  for (i = 0; i < POOL_CLASSES; i++) {
+    while (pool->free[i] != NULL) {
+      struct pool_block *block = pool->free[i];
+      pool->free[i] = block->next;
+      ckfree((char*) block);
+    }
+    pool->num_free[i] = 0;
+  }
+  pool->free_bytes = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_peer_address --
+ *
+ *    Get the address of the peer of a socket as 16 bytes (IPv4
+ *    addresses are mapped into IPv6), and as text if text is not NULL.
+ *
+ * Results:
+ *    1 if the socket has an IP peer, else 0.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_peer_address(int fd, unsigned char *addr, char *text, size_t textlen)
+{
+  struct sockaddr_storage ss;
+  socklen_t sslen = sizeof(ss);
+
+  if (getpeername(fd, (struct sockaddr*) &ss, &sslen) != 0) {
+    return 0;
+  }
+  if (ss.ss_family == AF_INET) {
+    struct sockaddr_in *sin = (struct sockaddr_in*) &ss;
+    memset(addr, 0, 10);
+    addr[10] = addr[11] = 0xff;
+    memcpy(addr + 12, &sin->sin_addr, 4);
+    if (text != NULL) {
+      inet_ntop(AF_INET, &sin->sin_addr, text, textlen);
+    }
+    return 1;
+  }
+  if (ss.ss_family == AF_INET6) {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6*) &ss;
+    memcpy(addr, &sin6->sin6_addr, 16);
+    if (text != NULL) {
+      inet_ntop(AF_INET6, &sin6->sin6_addr, text, textlen);
+    }
+    return 1;
+  }
+  return 0;
+}
+
+
+// Refill a bucket and take a token from it, if there is one.
+static int
+tclwebsockets_take_token(struct rate_limit *limit, double *tokens, Tcl_WideInt *last, Tcl_WideInt now)
+{
+  *tokens += (double) (now - *last) * limit->rate / 1e9;
+  if (*tokens > limit->burst) {
+    *tokens = limit->burst;
+  }
+  *last = now;
+  if (*tokens < 1.0) {
+    return 0;
+  }
+  *tokens -= 1.0;
+  return 1;
+}
+
+static unsigned int
+tclwebsockets_peer_hash(const unsigned char *addr)
+{
+  unsigned int hash = 2166136261u;
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    hash = (hash ^ addr[i]) * 16777619u;
+  }
+  return hash;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_peer_rehash --
+ *
+ *    Move the entries of the peer table into a table of the given size,
+ *    leaving out (and freeing) those that have no connections and whose
+ *    buckets are full again, since they are no different from a new
+ *    entry.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_peer_rehash(struct context_userdata_struct *userdata, int size, Tcl_WideInt now)
+{
+  struct peer_table *table = &userdata->peers;
+  struct peer_entry **slots = (struct peer_entry**) ckalloc(sizeof(struct peer_entry*) * size);
+  int i;
+
+  memset(slots, 0, sizeof(struct peer_entry*) * size);
+  table->count = 0;
+  for (i = 0; i < table->size; i++) {
+    struct peer_entry *entry = table->slots[i];
+    unsigned int h;
+
+    if (entry == NULL) {
+      continue;
+    }
+    if (entry->connections == 0 &&
+	(userdata->connect_rate.rate == 0 || entry->connect_tokens + (double) (now - entry->connect_time) * userdata->connect_rate.rate / 1e9 >= userdata->connect_rate.burst) &&
+	(userdata->message_rate.rate == 0 || entry->message_tokens + (double) (now - entry->message_time) * userdata->message_rate.rate / 1e9 >= userdata->message_rate.burst)) {
+      tclwebsockets_pool_free(&userdata->pool, entry);
+      continue;
+    }
+    for (h = tclwebsockets_peer_hash(entry->addr) & (size - 1); slots[h] != NULL; h = (h + 1) & (size - 1)) {
+    }
+    slots[h] = entry;
+    table->count++;
+  }
+
+  if (table->slots != NULL) {
+    ckfree((char*) table->slots);
+  }
+  table->slots = slots;
+  table->size = size;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_peer_lookup --
+ *
+ *    Find the entry of a peer address, creating it with full buckets if
+ *    there is none.
+ *
+ *----------------------------------------------------------------------
+ */
+static struct peer_entry *
+tclwebsockets_peer_lookup(struct context_userdata_struct *userdata, const unsigned char *addr, Tcl_WideInt now)
+{
+  struct peer_table *table = &userdata->peers;
+  struct peer_entry *entry;
+  unsigned int h;
+
+  for (h = tclwebsockets_peer_hash(addr) & (table->size - 1); table->slots[h] != NULL; h = (h + 1) & (table->size - 1)) {
+    if (memcmp(table->slots[h]->addr, addr, 16) == 0) {
+      return table->slots[h];
+    }
+  }
+
+  // keep the table at most half full: drop idle entries first, and grow
+  // only if that was not enough.
+  if (2 * (table->count + 1) > table->size) {
+    tclwebsockets_peer_rehash(userdata, table->size, now);
+    if (4 * (table->count + 1) > table->size) {
+      tclwebsockets_peer_rehash(userdata, table->size * 2, now);
+    }
+    for (h = tclwebsockets_peer_hash(addr) & (table->size - 1); table->slots[h] != NULL; h = (h + 1) & (table->size - 1)) {
+    }
+  }
+
+  entry = (struct peer_entry*) tclwebsockets_pool_alloc(&userdata->pool, sizeof(struct peer_entry));
+  memcpy(entry->addr, addr, 16);
+  entry->connections = 0;
+  entry->connect_tokens = userdata->connect_rate.burst;
+  entry->message_tokens = userdata->message_rate.burst;
+  entry->connect_time = entry->message_time = now;
+  table->slots[h] = entry;
+  table->count++;
+  return entry;
+}
+
+
+static void
+tclwebsockets_free_peers(struct context_userdata_struct *userdata)
+{
+  int i;
+
+  for (i = 0; i < userdata->peers.size; i++) {
+    if (userdata->peers.slots[i] != NULL) {
+      tclwebsockets_pool_free(&userdata->pool, userdata->peers.slots[i]);
+    }
+  }
+  if (userdata->peers.slots != NULL) {
+    ckfree((char*) userdata->peers.slots);
+  }
+  userdata->peers.slots = NULL;
+  userdata->peers.size = userdata->peers.count = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_parse_rate --
+ *
+ *    Parse the value of -connectrate or -messagerate: a rate per second,
+ *    optionally followed by the burst allowed above it, which defaults
+ *    to one second's worth.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_parse_rate(Tcl_Interp *interp, Tcl_Obj *valueObj, const char *option, struct rate_limit *limit)
+{
+  Tcl_Obj **elemv;
+  int elemc;
+  double rate, burst;
+
+  if (Tcl_ListObjGetElements(interp, valueObj, &elemc, &elemv) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  if (elemc < 1 || elemc > 2) {
+    Tcl_AppendResult(interp, option, " must be a rate per second, optionally followed by a burst", NULL);
+    return TCL_ERROR;
+  }
+  if (Tcl_GetDoubleFromObj(interp, elemv[0], &rate) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  burst = (rate > 1 ? rate : 1);
+  if (elemc == 2 && Tcl_GetDoubleFromObj(interp, elemv[1], &burst) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  if (rate < 0 || burst < 1) {
+    Tcl_AppendResult(interp, option, " needs a rate of at least 0 and a burst of at least 1", NULL);
+    return TCL_ERROR;
+  }
+  limit->rate = rate;
+  limit->burst = burst;
+  return TCL_OK;
+}
+
+
+// Content types of the files under -docroot, by extension.
+static const char *content_types[] = {
+  "html", "text/html; charset=utf-8",
+  "htm", "text/html; charset=utf-8",
+  "js", "application/javascript",
+  "mjs", "application/javascript",
+  "css", "text/css",
+  "json", "application/json",
+  "map", "application/json",
+  "txt", "text/plain; charset=utf-8",
+  "svg", "image/svg+xml",
+  "png", "image/png",
+  "jpg", "image/jpeg",
+  "jpeg", "image/jpeg",
+  "gif", "image/gif",
+  "webp", "image/webp",
+  "ico", "image/x-icon",
+  "wasm", "application/wasm",
+  "woff", "font/woff",
+  "woff2", "font/woff2",
+  NULL
+};
+
+static const char *
+tclwebsockets_content_type(const char *path)
+{
+  const char *dot = strrchr(path, '.');
+  int i;
+
+  if (dot != NULL && strchr(dot, '/') == NULL) {
+    for (i = 0; content_types[i] != NULL; i += 2) {
+      if (strcmp(dot + 1, content_types[i]) == 0) {
+	return content_types[i + 1];
+      }
+    }
+  }
+  return "application/octet-stream";
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_http_path --
+ *
+ *    Turn the URI of a request into a path below the docroot: the query
+ *    is dropped, %XX escapes are decoded, and a directory stands for
+ *    its index.html.  Components starting with a dot are refused, which
+ *    keeps out ".." as well as hidden files.
+ *
+ * Results:
+ *    1 if path was set, 0 if the URI has no place under the docroot.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_http_path(const char *uri, int len, char *path, size_t size)
+{
+  size_t n = 0;
+  int i;
+
+  if (len <= 0 || uri[0] != '/') {
+    return 0;
+  }
+  for (i = 0; i < len && uri[i] != '?' && uri[i] != '#'; i++) {
+    int c = (unsigned char) uri[i];
+
+    if (c == '%' && i + 2 < len && isxdigit((unsigned char) uri[i + 1]) && isxdigit((unsigned char) uri[i + 2])) {
+      char hex[3];
+      hex[0] = uri[i + 1];
+      hex[1] = uri[i + 2];
+      hex[2] = '\0';
+      c = (int) strtol(hex, NULL, 16);
+      i += 2;
+    }
+    if (c == '\0' || c == '\\' || n + 1 >= size || (c == '.' && path[n - 1] == '/')) {
+      return 0;
+    }
+    path[n++] = (char) c;
+  }
+  if (path[n - 1] == '/') {
+    if (n + sizeof("index.html") > size) {
+      return 0;
+    }
+    memcpy(path + n, "index.html", sizeof("index.html") - 1);
+    n += sizeof("index.html") - 1;
+  }
+  path[n] = '\0';
+  return 1;
+}
+
+
+static void
+tclwebsockets_cache_unlink(struct file_cache *cache, struct cache_entry *entry)
+{
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    cache->head = entry->next;
+  }
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->tail = entry->prev;
+  }
+  entry->prev = entry->next = NULL;
+}
+
+static void
+tclwebsockets_cache_push(struct file_cache *cache, struct cache_entry *entry)
+{
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head != NULL) {
+    cache->head->prev = entry;
+  } else {
+    cache->tail = entry;
+  }
+  cache->head = entry;
+}
+
+static void
+tclwebsockets_cache_evict(struct file_cache *cache, struct cache_entry *entry)
+{
+  tclwebsockets_cache_unlink(cache, entry);
+  Tcl_DeleteHashEntry(entry->hentry);
+  cache->bytes -= entry->length;
+  ckfree(entry->response);
+  ckfree((char*) entry);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_cache_load --
+ *
+ *    Read a file into a new cache entry, behind the headers of its
+ *    response, and make room for it by dropping the entries served
+ *    least recently.
+ *
+ * Results:
+ *    The entry, or NULL if the file could not be read.
+ *
+ *----------------------------------------------------------------------
+ */
+static struct cache_entry *
+tclwebsockets_cache_load(struct file_cache *cache, const char *path, const char *filename, struct stat *st, Tcl_WideInt now)
+{
+  struct cache_entry *entry;
+  char header[512], date[64];
+  struct tm tm;
+  size_t header_len, done = 0;
+  int fd, isNew;
+
+  if ((fd = open(filename, O_RDONLY)) < 0) {
+    return NULL;
+  }
+
+  gmtime_r(&st->st_mtime, &tm);
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  header_len = snprintf(header, sizeof(header),
+			"HTTP/1.0 200 OK\r\n"
+			"Server: tclwebsockets\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %lld\r\n"
+			"Last-Modified: %s\r\n"
+			"Connection: close\r\n\r\n",
+			tclwebsockets_content_type(path), (long long) st->st_size, date);
+
+  entry = (struct cache_entry*) ckalloc(sizeof(struct cache_entry));
+  entry->length = header_len + (size_t) st->st_size;
+  entry->response = ckalloc(entry->length);
+  memcpy(entry->response, header, header_len);
+  while (done < (size_t) st->st_size) {
+    ssize_t n = read(fd, entry->response + header_len + done, (size_t) st->st_size - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // it shrank or failed under us.
+      close(fd);
+      ckfree(entry->response);
+      ckfree((char*) entry);
+      return NULL;
+    }
+    done += (size_t) n;
+  }
+  close(fd);
+
+  entry->mtime = st->st_mtime;
+  entry->size = st->st_size;
+  entry->checked = now;
+  entry->hentry = Tcl_CreateHashEntry(&cache->entries, path, &isNew);
+  Tcl_SetHashValue(entry->hentry, entry);
+  cache->bytes += entry->length;
+  tclwebsockets_cache_push(cache, entry);
+
+  while (cache->bytes > cache->limit && cache->tail != entry) {
+    tclwebsockets_cache_evict(cache, cache->tail);
+  }
+  return entry;
+}
+
+
+static void
+tclwebsockets_free_file_cache(struct file_cache *cache)
+{
+  if (cache->docroot == NULL) {
+    return;
+  }
+  while (cache->head != NULL) {
+    tclwebsockets_cache_evict(cache, cache->head);
+  }
+  Tcl_DeleteHashTable(&cache->entries);
+  ckfree(cache->docroot);
+  cache->docroot = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_new_frame --
+ *
+ *    Allocate an outbound frame with room for a payload of the given
+ *    length plus the padding required by libwebsocket_write().
+ *
+ * Results:
+ *    The frame, with a reference count of zero.
+ *
+ *----------------------------------------------------------------------
+ */
+static struct outbound_frame *
+tclwebsockets_new_frame(struct buffer_pool *pool, size_t len, enum libwebsocket_write_protocol write_protocol)
+{
+  struct outbound_frame *frame;
+
+  frame = (struct outbound_frame*) tclwebsockets_pool_alloc(pool, sizeof(struct outbound_frame) + LWS_SEND_BUFFER_PRE_PADDING + len + LWS_SEND_BUFFER_POST_PADDING);
+  frame->refcount = 0;
+  frame->len = len;
+  frame->write_protocol = write_protocol;
+  frame->nocompress = 0;
+  return frame;
+}
+
+static void
+tclwebsockets_release_frame(struct buffer_pool *pool, struct outbound_frame *frame)
+{
+  if (--frame->refcount <= 0) {
+    tclwebsockets_pool_free(pool, frame);
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_enqueue_frame --
+ *
+ *    Append a frame to the outbound queue of a session, and ask
+ *    libwebsockets for a writeable callback if the queue was idle.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_enqueue_frame(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data, struct outbound_frame *frame)
+{
+  struct outbound_queue_entry *entry;
+
+  entry = (struct outbound_queue_entry*) tclwebsockets_pool_alloc(&userdata->pool, sizeof(struct outbound_queue_entry));
+  entry->frame = frame;
+  entry->next = NULL;
+  frame->refcount++;
+
+  if (session_data->queue_tail == NULL) {
+    session_data->queue_head = entry;
+    libwebsocket_callback_on_writable(session_data->context, session_data->socket);
+  } else {
+    session_data->queue_tail->next = entry;
+  }
+  session_data->queue_tail = entry;
+  session_data->queued_bytes += frame->len;
+  STATS_MAX(session_data, peak_queued, session_data->queued_bytes);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_send_room --
+ *
+ *    How many bytes the send buffer of a socket takes right now without
+ *    cutting a write short: its SO_SNDBUF less what SIOCOUTQ reports as
+ *    still queued in it.  Linux reports SO_SNDBUF as twice the size
+ *    that was set, half of it being kept for its own bookkeeping, so
+ *    only that half is counted.
+ *
+ * Results:
+ *    The room, or -1 if the platform cannot tell.  The size of the
+ *    whole buffer is stored in *sizePtr.
+ *
+ *----------------------------------------------------------------------
+ */
+static long
+tclwebsockets_send_room(int fd, size_t *sizePtr)
+{
+#ifdef SIOCOUTQ
+  int sndbuf, queued;
+  socklen_t optlen = sizeof(sndbuf);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen) == 0 && ioctl(fd, SIOCOUTQ, &queued) == 0) {
+    sndbuf /= 2;
+    *sizePtr = (size_t) sndbuf;
+    return (sndbuf > queued ? (long) (sndbuf - queued) : 0);
+  }
+#endif
+  return -1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_fit_write --
+ *
+ *    Check that a write of len bytes goes into the send buffer of a
+ *    socket whole.  A buffer too small to ever take it is grown first;
+ *    the kernel may grant less than asked for.
+ *
+ * Results:
+ *    1 if it fits now, 0 if it does not fit yet, -1 if the buffer can
+ *    never take it or the platform cannot tell.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_fit_write(int fd, size_t len)
+{
+  size_t size;
+  long room = tclwebsockets_send_room(fd, &size);
+
+  if (room >= 0 && len > size) {
+    int want = (len > INT_MAX / 2 ? INT_MAX / 2 : (int) len);
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &want, sizeof(want));
+    room = tclwebsockets_send_room(fd, &size);
+  }
+  if (room < 0 || len > size) {
+    return -1;
+  }
+  return ((size_t) room >= len);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_write_coalesced --
+ *
+ *    Frame as many of the queued frames of a session as fit into room
+ *    bytes, at most WRITE_DRAIN_QUANTUM, and send them with a single
+ *    libwebsocket_write(), which takes the buffer as raw bytes with
+ *    LWS_WRITE_HTTP.  Only used for connections with raw_frames set:
+ *    version 13 servers without TLS or an extension, whose frames are a
+ *    plain unmasked header followed by the payload.  The frames stay in
+ *    the queue until the write has succeeded.
+ *
+ * Results:
+ *    The number of bytes written, 0 if fewer than two frames fit (they
+ *    are then written one by one), or -1 if the socket failed.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_write_coalesced(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data, size_t room)
+{
+  struct outbound_queue_entry *entry, *last = NULL;
+  unsigned char *buffer, *p;
+  size_t payload = 0, size;
+  int frames = 0, n;
+
+  if (room > WRITE_DRAIN_QUANTUM) {
+    room = WRITE_DRAIN_QUANTUM;
+  }
+
+  // count what fits: the largest header is 10 bytes.
+  for (entry = session_data->queue_head; entry != NULL; entry = entry->next) {
+    enum libwebsocket_write_protocol protocol = entry->frame->write_protocol;
+    if ((protocol != LWS_WRITE_TEXT && protocol != LWS_WRITE_BINARY && protocol != LWS_WRITE_PING) ||
+	payload + 10 * (frames + 1) + entry->frame->len > room) {
+      break;
+    }
+    payload += entry->frame->len;
+    frames++;
+    last = entry;
+  }
+  if (frames < 2) {
+    return 0;
+  }
+
+  p = buffer = (unsigned char*) tclwebsockets_pool_alloc(&userdata->pool, WRITE_DRAIN_QUANTUM);
+  for (entry = session_data->queue_head; ; entry = entry->next) {
+    size_t len = entry->frame->len;
+
+    switch (entry->frame->write_protocol) {
+    case LWS_WRITE_BINARY: *p++ = 0x82; break;
+    case LWS_WRITE_PING:   *p++ = 0x89; break;
+    default:               *p++ = 0x81; break;
+    }
+    if (len < 126) {
+      *p++ = (unsigned char) len;
+    } else if (len < 65536) {
+      *p++ = 126;
+      *p++ = (unsigned char) (len >> 8);
+      *p++ = (unsigned char) len;
+    } else {
+      int i;
+      *p++ = 127;
+      for (i = 7; i >= 0; i--) {
+	*p++ = (unsigned char) ((Tcl_WideUInt) len >> (8 * i));
+      }
+    }
+    memcpy(p, FRAME_PAYLOAD(entry->frame), len);
+    p += len;
+    if (entry == last) {
+      break;
+    }
+  }
+
+  size = p - buffer;
+  n = libwebsocket_write(session_data->socket, buffer, size, LWS_WRITE_HTTP);
+  tclwebsockets_pool_free(&userdata->pool, buffer);
+  STATS_INCR(userdata, write_calls);
+  STATS_INCR(session_data, write_calls);
+  if (n < 0) {
+    STATS_INCR(userdata, write_errors);
+    STATS_INCR(session_data, write_errors);
+    return -1;
+  }
+
+  STATS_ADD(userdata, messages_out, frames);
+  STATS_ADD(userdata, bytes_out, payload);
+  STATS_ADD(session_data, messages_out, frames);
+  STATS_ADD(session_data, bytes_out, payload);
+
+  while (frames-- > 0) {
+    entry = session_data->queue_head;
+    session_data->queue_head = entry->next;
+    session_data->queued_bytes -= entry->frame->len;
+    tclwebsockets_release_frame(&userdata->pool, entry->frame);
+    tclwebsockets_pool_free(&userdata->pool, entry);
+  }
+  if (session_data->queue_head == NULL) {
+    session_data->queue_tail = NULL;
+  }
+  return (int) size;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_update_rx --
+ *
+ *    Stop reading from a connection while its coroutine has messages it
+ *    has not taken yet, and read again once it has taken them all.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_update_rx(struct websocket_session_struct *session_data)
+{
+  int hold = (session_data->coro_pending != NULL);
+
+  if (hold != session_data->rx_held) {
+    session_data->rx_held = hold;
+    libwebsocket_rx_flow_control(session_data->socket, !hold);
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_drain_queue --
+ *
+ *    Called when the socket of a session is writeable.  Writes queued
+ *    frames, up to WRITE_DRAIN_QUANTUM bytes or as many as the send
+ *    buffer of the socket has room for, and asks for another callback
+ *    if any remain.  libwebsocket_write() fails the connection if the
+ *    socket takes only part of a write, so nothing is written that the
+ *    buffer cannot take whole; a frame stays queued until it is.
+ *
+ *    Connections with raw_frames set have several frames framed by us
+ *    and written at once.  The others are written a frame at a time.
+ *
+ * Results:
+ *    0 on success, -1 if the socket failed.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_drain_queue(struct websocket_session_struct *session_data)
+{
+  struct context_userdata_struct *userdata = (struct context_userdata_struct*) libwebsockets_get_user_data(session_data->context);
+  int fd = libwebsocket_get_socket_fd(session_data->socket);
+  size_t written = 0, size;
+  long room = tclwebsockets_send_room(fd, &size);
+
+  while (written < WRITE_DRAIN_QUANTUM) {
+    struct outbound_queue_entry *entry;
+    struct outbound_frame *frame;
+    int n, fit;
+
+    if ((entry = session_data->queue_head) == NULL) {
+      break;
+    }
+
+    // several frames waiting go out in one write when they fit.
+    if (session_data->raw_frames && entry->next != NULL && room > 0) {
+      n = tclwebsockets_write_coalesced(userdata, session_data, (size_t) room);
+      if (n < 0) {
+	return -1;
+      }
+      if (n > 0) {
+	written += n;
+	room -= n;
+	continue;
+      }
+    }
+
+    // one frame, its header and its mask, unless the platform cannot
+    // tell the room left: then stop at a choked socket, as ever.
+    frame = entry->frame;
+    if (room >= 0) {
+      fit = tclwebsockets_fit_write(fd, frame->len + 14);
+      if (fit == 0 || (fit < 0 && written > 0)) {
+	break;
+      }
+    } else if (written > 0 && lws_send_pipe_choked(session_data->socket)) {
+      break;
+    }
+
+    // the extension compresses the frame from within libwebsocket_write().
+    if (userdata->compression != NULL) {
+      userdata->compression->nocompress = frame->nocompress;
+    }
+    n = libwebsocket_write(session_data->socket, FRAME_PAYLOAD(frame), frame->len, frame->write_protocol);
+    if (userdata->compression != NULL) {
+      userdata->compression->nocompress = 0;
+    }
+    STATS_INCR(userdata, write_calls);
+    STATS_INCR(session_data, write_calls);
+    if (n < 0) {
+      STATS_INCR(userdata, write_errors);
+      STATS_INCR(session_data, write_errors);
+      return -1;
+    }
+    written += frame->len;
+    if (room >= 0) {
+      room = tclwebsockets_send_room(fd, &size);
+    }
+    STATS_INCR(userdata, messages_out);
+    STATS_ADD(userdata, bytes_out, frame->len);
+    STATS_INCR(session_data, messages_out);
+    STATS_ADD(session_data, bytes_out, frame->len);
+
+    session_data->queue_head = entry->next;
+    if (session_data->queue_head == NULL) {
+      session_data->queue_tail = NULL;
+    }
+    session_data->queued_bytes -= frame->len;
+    tclwebsockets_release_frame(&userdata->pool, frame);
+    tclwebsockets_pool_free(&userdata->pool, entry);
+  }
+
+  if (session_data->queue_head != NULL) {
+    libwebsocket_callback_on_writable(session_data->context, session_data->socket);
+  }
+  return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_discard_queue --
+ *
+ *    Drop every frame still queued for a session.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_discard_queue(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data)
+{
+  while (session_data->queue_head != NULL) {
+    struct outbound_queue_entry *entry = session_data->queue_head;
+    session_data->queue_head = entry->next;
+    tclwebsockets_release_frame(&userdata->pool, entry->frame);
+    tclwebsockets_pool_free(&userdata->pool, entry);
+  }
+  session_data->queue_tail = NULL;
+  session_data->queued_bytes = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_queue_frame --
+ *
+ *    Enqueue a frame to a session unless its queue has already reached
+ *    the high watermark.
+ *
+ * Results:
+ *    1 if the frame was queued, 0 if the session is throttled.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_queue_frame(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data, struct outbound_frame *frame)
+{
+  if (userdata->highwater > 0 && session_data->queued_bytes >= userdata->highwater) {
+    session_data->throttled = 1;
+    STATS_INCR(userdata, queue_full);
+    STATS_INCR(session_data, queue_full);
+    return 0;
+  }
+  tclwebsockets_enqueue_frame(userdata, session_data, frame);
+  return 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_join_topic --
+ *
+ *    Add a session to a topic, creating the topic if needed.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_join_topic(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data, const char *name)
+{
+  Tcl_HashEntry *entry;
+  struct topic_struct *topic;
+  struct topic_membership *membership;
+  int isNew;
+
+  entry = Tcl_CreateHashEntry(&userdata->topics, name, &isNew);
+  if (isNew) {
+    topic = (struct topic_struct*) ckalloc(sizeof(struct topic_struct));
+    topic->entry = entry;
+    Tcl_InitHashTable(&topic->members, TCL_ONE_WORD_KEYS);
+    Tcl_SetHashValue(entry, topic);
+  } else {
+    topic = (struct topic_struct*) Tcl_GetHashValue(entry);
+  }
+
+  Tcl_CreateHashEntry(&topic->members, (char*) session_data, &isNew);
+  if (!isNew) {
+    return;
+  }
+
+  membership = (struct topic_membership*) ckalloc(sizeof(struct topic_membership));
+  membership->topic = topic;
+  membership->next = session_data->topics;
+  session_data->topics = membership;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_leave_topic --
+ *
+ *    Remove a session from a topic, or from every topic it joined if
+ *    topic is NULL.  Topics left without members are deleted.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_leave_topic(struct websocket_session_struct *session_data, struct topic_struct *topic)
+{
+  struct topic_membership **pp = &session_data->topics;
+
+  while (*pp != NULL) {
+    struct topic_membership *membership = *pp;
+    Tcl_HashEntry *entry;
+
+    if (topic != NULL && membership->topic != topic) {
+      pp = &membership->next;
+      continue;
+    }
+
+    entry = Tcl_FindHashEntry(&membership->topic->members, (char*) session_data);
+    if (entry != NULL) {
+      Tcl_DeleteHashEntry(entry);
+    }
+    if (membership->topic->members.numEntries == 0) {
+      Tcl_DeleteHashEntry(membership->topic->entry);
+      Tcl_DeleteHashTable(&membership->topic->members);
+      ckfree((char*) membership->topic);
+    }
+
+    *pp = membership->next;
+    ckfree((char*) membership);
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_free_topics --
+ *
+ *    Delete the topic table of a context.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_free_topics(struct context_userdata_struct *userdata)
+{
+  Tcl_HashEntry *entry;
+  Tcl_HashSearch search;
+
+  for (entry = Tcl_FirstHashEntry(&userdata->topics, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+    struct topic_struct *topic = (struct topic_struct*) Tcl_GetHashValue(entry);
+    Tcl_DeleteHashTable(&topic->members);
+    ckfree((char*) topic);
+  }
+  Tcl_DeleteHashTable(&userdata->topics);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_zalloc, tclwebsockets_zfree --
+ *
+ *    zlib allocators for the streams of a context.  Freed blocks are
+ *    kept in the context so that the streams of the next connection are
+ *    set up without going to the allocator.
+ *
+ *----------------------------------------------------------------------
+ */
+static voidpf
+tclwebsockets_zalloc(voidpf opaque, uInt items, uInt size)
+{
+  struct compression_struct *compression = (struct compression_struct*) opaque;
+  size_t bytes = (size_t) items * size;
+  struct zlib_block *block;
+  int i;
+
+  for (i = 0; i < COMPRESSION_POOL_BUCKETS; i++) {
+    if (compression->pool[i].size == bytes && compression->pool[i].blocks != NULL) {
+      block = compression->pool[i].blocks;
+      compression->pool[i].blocks = block->next;
+      compression->pool_bytes -= bytes;
+      compression->pool_hits++;
+      return (voidpf) (block + 1);
+    }
+  }
+
+  compression->pool_misses++;
+  block = (struct zlib_block*) attemptckalloc(sizeof(struct zlib_block) + bytes);
+  if (block == NULL) {
+    return Z_NULL;
+  }
+  block->size = bytes;
+  return (voidpf) (block + 1);
+}
+
+static void
+tclwebsockets_zfree(voidpf opaque, voidpf address)
+{
+  struct compression_struct *compression = (struct compression_struct*) opaque;
+  struct zlib_block *block = ((struct zlib_block*) address) - 1;
+  struct zlib_bucket *bucket = NULL;
+  int i;
+
+  if (compression->pool_bytes + block->size <= COMPRESSION_POOL_BYTES) {
+    for (i = 0; i < COMPRESSION_POOL_BUCKETS; i++) {
+      if (compression->pool[i].size == block->size) {
+	bucket = &compression->pool[i];
+	break;
+      }
+      if (bucket == NULL && compression->pool[i].blocks == NULL) {
+	bucket = &compression->pool[i];
+      }
+    }
+  }
+
+  if (bucket == NULL) {
+    ckfree((char*) block);
+    return;
+  }
+  bucket->size = block->size;
+  block->next = bucket->blocks;
+  bucket->blocks = block;
+  compression->pool_bytes += block->size;
+}
+
+
+static Tcl_WideInt
+tclwebsockets_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (Tcl_WideInt) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_deflate_callback --
+ *
+ *    The deflate-stream extension of contexts created with -compression.
+ *    Like the one built into libwebsockets, it runs everything sent on a
+ *    connection through one deflate stream and everything received
+ *    through one inflate stream, flushed at the end of every frame.
+ *    Frames smaller than the -compression min-size, and those written
+ *    with -nocompress, are sent as stored blocks so that they cost no
+ *    more than a copy.
+ *
+ * Results:
+ *    1 if there is more output for the same input, 0 if not, -1 on
+ *    failure.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_deflate_callback(struct libwebsocket_context *context, struct libwebsocket_extension *ext,
+			       struct libwebsocket *wsi, enum libwebsocket_extension_callback_reasons reason,
+			       void *user, void *in, size_t len)
+{
+  struct compression_struct *compression = (struct compression_struct*) ext->per_context_private_data;
+  struct deflate_conn *conn = (struct deflate_conn*) user;
+  struct lws_tokens *eff_buf = (struct lws_tokens*) in;
+  Tcl_WideInt start;
+  int n;
+
+  switch (reason) {
+  case LWS_EXT_CALLBACK_CONSTRUCT:
+  case LWS_EXT_CALLBACK_CLIENT_CONSTRUCT:
+    memset(conn, 0, sizeof(struct deflate_conn));
+    conn->compression = compression;
+    conn->zs_in.zalloc = conn->zs_out.zalloc = tclwebsockets_zalloc;
+    conn->zs_in.zfree = conn->zs_out.zfree = tclwebsockets_zfree;
+    conn->zs_in.opaque = conn->zs_out.opaque = (voidpf) compression;
+
+    // the peer may have compressed with any window size.
+    if (inflateInit2(&conn->zs_in, -MAX_WBITS) != Z_OK) {
+      return -1;
+    }
+    if (deflateInit2(&conn->zs_out, compression->level, Z_DEFLATED, -compression->window_bits,
+		     compression->mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+      inflateEnd(&conn->zs_in);
+      return -1;
+    }
+    conn->level = compression->level;
+    conn->initialized = 1;
+    return 0;
+
+  case LWS_EXT_CALLBACK_DESTROY:
+    if (conn->initialized) {
+      inflateEnd(&conn->zs_in);
+      deflateEnd(&conn->zs_out);
+      conn->initialized = 0;
+    }
+    return 0;
+
+  case LWS_EXT_CALLBACK_PACKET_RX_PREPARSE:
+    if (eff_buf->token_len > 0) {
+      conn->zs_in.next_in = (Bytef*) eff_buf->token;
+      conn->zs_in.avail_in = eff_buf->token_len;
+      compression->rx_bytes_in += eff_buf->token_len;
+    } else if (!conn->rx_more) {
+      return 0;
+    }
+    conn->zs_in.next_out = compression->rx_buffer;
+    conn->zs_in.avail_out = COMPRESSION_BUFFER_SIZE;
+
+    start = tclwebsockets_now_ns();
+    n = inflate(&conn->zs_in, Z_SYNC_FLUSH);
+    compression->inflate_ns += tclwebsockets_now_ns() - start;
+    if (n != Z_OK && n != Z_BUF_ERROR) {
+      return -1;
+    }
+
+    eff_buf->token = (char*) compression->rx_buffer;
+    eff_buf->token_len = COMPRESSION_BUFFER_SIZE - conn->zs_in.avail_out;
+    compression->rx_bytes_out += eff_buf->token_len;
+    conn->rx_more = (conn->zs_in.avail_out == 0);
+    return conn->rx_more;
+
+  case LWS_EXT_CALLBACK_PACKET_TX_PRESEND:
+  case LWS_EXT_CALLBACK_FLUSH_PENDING_TX:
+    conn->zs_out.next_out = compression->tx_buffer;
+    conn->zs_out.avail_out = COMPRESSION_BUFFER_SIZE;
+
+    if (eff_buf->token_len > 0) {
+      int level = compression->level;
+      if (compression->nocompress || (size_t) eff_buf->token_len < compression->min_size) {
+	level = 0;
+	compression->stored_frames++;
+      }
+      // any output of the switch lands in the buffer ahead of the frame.
+      if (level != conn->level) {
+	deflateParams(&conn->zs_out, level, Z_DEFAULT_STRATEGY);
+	conn->level = level;
+      }
+      conn->zs_out.next_in = (Bytef*) eff_buf->token;
+      conn->zs_out.avail_in = eff_buf->token_len;
+      compression->tx_bytes_in += eff_buf->token_len;
+      compression->frames++;
+    } else if (!conn->tx_more) {
+      return 0;
+    }
+
+    start = tclwebsockets_now_ns();
+    n = deflate(&conn->zs_out, Z_SYNC_FLUSH);
+    compression->deflate_ns += tclwebsockets_now_ns() - start;
+    if (n == Z_STREAM_ERROR) {
+      return -1;
+    }
+
+    eff_buf->token = (char*) compression->tx_buffer;
+    eff_buf->token_len = COMPRESSION_BUFFER_SIZE - conn->zs_out.avail_out;
+    compression->tx_bytes_out += eff_buf->token_len;
+    conn->tx_more = (conn->zs_out.avail_out == 0);
+    return conn->tx_more;
+
+  default:
+    return 0;
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_parse_compression --
+ *
+ *    Parse the value of the -compression option of websockets::listen:
+ *    a boolean, or a dictionary with the keys level, window-bits,
+ *    mem-level and min-size.
+ *
+ * Results:
+ *    TCL_OK or TCL_ERROR.  *compressionPtr is set to the settings, or
+ *    NULL if compression was turned off.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_parse_compression(Tcl_Interp *interp, Tcl_Obj *valueObj, struct compression_struct **compressionPtr)
+{
+  static CONST char *keys[] = { "level", "window-bits", "mem-level", "min-size", NULL };
+  enum compressionkeys { KEY_LEVEL, KEY_WINDOWBITS, KEY_MEMLEVEL, KEY_MINSIZE };
+  struct compression_struct *compression;
+  Tcl_Obj **elements;
+  int enabled, num_elements, i, keyIndex, value;
+
+  *compressionPtr = NULL;
+  if (Tcl_GetBooleanFromObj(NULL, valueObj, &enabled) == TCL_OK && !enabled) {
+    return TCL_OK;
+  }
+
+  compression = (struct compression_struct*) ckalloc(sizeof(struct compression_struct));
+  memset(compression, 0, sizeof(struct compression_struct));
+  compression->level = DEFAULT_COMPRESSION_LEVEL;
+  compression->window_bits = MAX_WBITS;
+  compression->mem_level = DEFAULT_COMPRESSION_MEMLEVEL;
+  compression->min_size = DEFAULT_COMPRESSION_MIN_SIZE;
+
+  if (Tcl_GetBooleanFromObj(NULL, valueObj, &enabled) != TCL_OK) {
+    if (Tcl_ListObjGetElements(interp, valueObj, &num_elements, &elements) != TCL_OK) {
+      ckfree((char*) compression);
+      return TCL_ERROR;
+    }
+    if (num_elements & 1) {
+      Tcl_AppendResult(interp, "-compression must be a boolean or a dictionary", NULL);
+      ckfree((char*) compression);
+      return TCL_ERROR;
+    }
+
+    for (i = 0; i < num_elements; i += 2) {
+      if (Tcl_GetIndexFromObj(interp, elements[i], keys, "-compression key", TCL_EXACT, &keyIndex) != TCL_OK ||
+	  Tcl_GetIntFromObj(interp, elements[i + 1], &value) != TCL_OK) {
+	ckfree((char*) compression);
+	return TCL_ERROR;
+      }
+
+      switch ((enum compressionkeys) keyIndex) {
+      case KEY_LEVEL:
+	if (value < 0 || value > 9) {
+	  Tcl_AppendResult(interp, "-compression level must be between 0 and 9", NULL);
+	  ckfree((char*) compression);
+	  return TCL_ERROR;
+	}
+	compression->level = value;
+	break;
+      case KEY_WINDOWBITS:
+	// zlib does not support a raw deflate window of 8 bits.
+	if (value < 9 || value > MAX_WBITS) {
+	  Tcl_AppendResult(interp, "-compression window-bits must be between 9 and 15", NULL);
+	  ckfree((char*) compression);
+	  return TCL_ERROR;
+	}
+	compression->window_bits = value;
+	break;
+      case KEY_MEMLEVEL:
+	if (value < 1 || value > MAX_MEM_LEVEL) {
+	  Tcl_AppendResult(interp, "-compression mem-level must be between 1 and 9", NULL);
+	  ckfree((char*) compression);
+	  return TCL_ERROR;
+	}
+	compression->mem_level = value;
+	break;
+      case KEY_MINSIZE:
+	if (value < 0) {
+	  Tcl_AppendResult(interp, "-compression min-size must not be negative", NULL);
+	  ckfree((char*) compression);
+	  return TCL_ERROR;
+	}
+	compression->min_size = (size_t) value;
+	break;
+      }
+    }
+  }
+
+  compression->extensions[0].name = "deflate-stream";
+  compression->extensions[0].callback = tclwebsockets_deflate_callback;
+  compression->extensions[0].per_session_data_size = sizeof(struct deflate_conn);
+  compression->extensions[0].per_context_private_data = compression;
+
+  *compressionPtr = compression;
+  return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_free_compression --
+ *
+ *    Free the settings and the allocation pool of a context.  Must be
+ *    called after libwebsocket_context_destroy() has ended the streams.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_free_compression(struct compression_struct *compression)
+{
+  int i;
+
+  if (compression == NULL) {
+    return;
+  }
+  for (i = 0; i < COMPRESSION_POOL_BUCKETS; i++) {
+    while (compression->pool[i].blocks != NULL) {
+      struct zlib_block *block = compression->pool[i].blocks;
+      compression->pool[i].blocks = block->next;
+      ckfree((char*) block);
+    }
+  }
+  ckfree((char*) compression);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_append_stat --
+ *
+ *    Append a key and value to a dictionary being built as a list.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_append_stat(Tcl_Obj *dictObj, const char *name, Tcl_Obj *valueObj)
+{
+  Tcl_ListObjAppendElement(NULL, dictObj, Tcl_NewStringObj(name, -1));
+  Tcl_ListObjAppendElement(NULL, dictObj, valueObj);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_compression_stats --
+ *
+ *    Return the settings and counters of the compression of a context
+ *    as a dictionary.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_Obj *
+tclwebsockets_compression_stats(struct compression_struct *compression)
+{
+  Tcl_Obj *resultObj = Tcl_NewObj();
+
+  tclwebsockets_append_stat(resultObj, "level", Tcl_NewIntObj(compression->level));
+  tclwebsockets_append_stat(resultObj, "window-bits", Tcl_NewIntObj(compression->window_bits));
+  tclwebsockets_append_stat(resultObj, "mem-level", Tcl_NewIntObj(compression->mem_level));
+  tclwebsockets_append_stat(resultObj, "min-size", Tcl_NewWideIntObj((Tcl_WideInt) compression->min_size));
+  tclwebsockets_append_stat(resultObj, "frames", Tcl_NewWideIntObj(compression->frames));
+  tclwebsockets_append_stat(resultObj, "stored-frames", Tcl_NewWideIntObj(compression->stored_frames));
+  tclwebsockets_append_stat(resultObj, "tx-bytes-in", Tcl_NewWideIntObj(compression->tx_bytes_in));
+  tclwebsockets_append_stat(resultObj, "tx-bytes-out", Tcl_NewWideIntObj(compression->tx_bytes_out));
+  tclwebsockets_append_stat(resultObj, "tx-ratio", Tcl_NewDoubleObj(compression->tx_bytes_in > 0 ? (double) compression->tx_bytes_out / compression->tx_bytes_in : 1.0));
+  tclwebsockets_append_stat(resultObj, "rx-bytes-in", Tcl_NewWideIntObj(compression->rx_bytes_in));
+  tclwebsockets_append_stat(resultObj, "rx-bytes-out", Tcl_NewWideIntObj(compression->rx_bytes_out));
+  tclwebsockets_append_stat(resultObj, "rx-ratio", Tcl_NewDoubleObj(compression->rx_bytes_out > 0 ? (double) compression->rx_bytes_in / compression->rx_bytes_out : 1.0));
+  tclwebsockets_append_stat(resultObj, "deflate-usec", Tcl_NewWideIntObj(compression->deflate_ns / 1000));
+  tclwebsockets_append_stat(resultObj, "inflate-usec", Tcl_NewWideIntObj(compression->inflate_ns / 1000));
+  tclwebsockets_append_stat(resultObj, "pool-hits", Tcl_NewWideIntObj(compression->pool_hits));
+  tclwebsockets_append_stat(resultObj, "pool-misses", Tcl_NewWideIntObj(compression->pool_misses));
+  tclwebsockets_append_stat(resultObj, "pool-bytes", Tcl_NewWideIntObj((Tcl_WideInt) compression->pool_bytes));
+  return resultObj;
+}
+
+
+#if TCLWEBSOCKETS_OPENSSL
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TLS tuning, for listeners created with -ssl.
+ *
+ * libwebsockets keeps its SSL_CTX to itself, except for handing it to
+ * the LWS_CALLBACK_OPENSSL_LOAD_EXTRA_SERVER_VERIFY_CERTS callback while
+ * the context is being created, which it only does when asked to
+ * require client certificates.  listen asks for that, and the callback
+ * turns verification back off before applying the settings below.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int tls_ctx_index = -1;          // SSL_CTX ex data: its struct tls_state.
+static int tls_ssl_index = -1;          // SSL ex data: set once its handshake was counted.
+TCL_DECLARE_MUTEX(tlsMutex)
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX tls_mac_ctx;
+#else
+typedef HMAC_CTX tls_mac_ctx;
+#endif
+
+
+static void
+tclwebsockets_tls_init(void)
+{
+  Tcl_MutexLock(&tlsMutex);
+  if (tls_ctx_index < 0) {
+    tls_ctx_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    tls_ssl_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+  }
+  Tcl_MutexUnlock(&tlsMutex);
+}
+
+
+static int
+tclwebsockets_tls_hexdigit(int c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_tls_read_keys --
+ *
+ *    Read a -ticketkeys file: one key per line, as 96 hex digits (as
+ *    made by "openssl rand -hex 48"), newest first.  Blank lines and
+ *    lines starting with # are skipped.
+ *
+ * Results:
+ *    NULL, or why the file could not be used.
+ *
+ *----------------------------------------------------------------------
+ */
+static const char *
+tclwebsockets_tls_read_keys(const char *path, struct tls_ticket_key *keys, int *num_keys, struct stat *st)
+{
+  char line[256];
+  FILE *f;
+  int count = 0;
+
+  if ((f = fopen(path, "r")) == NULL || fstat(fileno(f), st) != 0) {
+    if (f != NULL) {
+      fclose(f);
+    }
+    return "cannot be read";
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    unsigned char *key;
+    char *p = line, *end;
+    int i;
+
+    while (isspace((unsigned char) *p)) {
+      p++;
+    }
+    for (end = p + strlen(p); end > p && isspace((unsigned char) end[-1]); end--) {
+    }
+    if (p == end || *p == '#') {
+      continue;
+    }
+    if (end - p != 2 * sizeof(struct tls_ticket_key)) {
+      fclose(f);
+      return "must have 96 hex digits on each line";
+    }
+    if (count == TLS_MAX_TICKET_KEYS) {
+      fclose(f);
+      return "has more than 8 keys";
+    }
+    key = (unsigned char*) &keys[count++];
+    for (i = 0; i < (int) sizeof(struct tls_ticket_key); i++) {
+      int hi = tclwebsockets_tls_hexdigit(p[2 * i]), lo = tclwebsockets_tls_hexdigit(p[2 * i + 1]);
+      if (hi < 0 || lo < 0) {
+	fclose(f);
+	return "must have 96 hex digits on each line";
+      }
+      key[i] = (unsigned char) (hi << 4 | lo);
+    }
+  }
+  fclose(f);
+  if (count == 0) {
+    return "has no keys";
+  }
+  *num_keys = count;
+  return NULL;
+}
+
+
+// Pick up a rewritten -ticketkeys file.  A file that does not parse,
+// perhaps because it is being written, leaves the keys as they were.
+static void
+tclwebsockets_tls_check_keyfile(struct tls_state *tls)
+{
+  Tcl_WideInt now = tclwebsockets_now_ns();
+  struct tls_ticket_key keys[TLS_MAX_TICKET_KEYS];
+  struct stat st;
+  int num_keys;
+
+  if (now - tls->keyfile_checked < TLS_KEYFILE_RECHECK_NS) {
+    return;
+  }
+  tls->keyfile_checked = now;
+  if (stat(tls->keyfile, &st) != 0 || (st.st_mtime == tls->keyfile_mtime && st.st_ino == tls->keyfile_ino)) {
+    return;
+  }
+  if (tclwebsockets_tls_read_keys(tls->keyfile, keys, &num_keys, &st) == NULL) {
+    OPENSSL_cleanse(tls->keys, sizeof(tls->keys));
+    memcpy(tls->keys, keys, num_keys * sizeof(struct tls_ticket_key));
+    tls->num_keys = num_keys;
+    tls->keyfile_mtime = st.st_mtime;
+    tls->keyfile_ino = st.st_ino;
+    tls->key_reloads++;
+  }
+  OPENSSL_cleanse(keys, sizeof(keys));
+}
+
+
+static int
+tclwebsockets_tls_mac_init(tls_mac_ctx *mac_ctx, struct tls_ticket_key *key)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  OSSL_PARAM params[2];
+
+  params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*) "SHA256", 0);
+  params[1] = OSSL_PARAM_construct_end();
+  return EVP_MAC_init(mac_ctx, key->hmac_key, sizeof(key->hmac_key), params);
+#else
+  return HMAC_Init_ex(mac_ctx, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), NULL);
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_tls_ticket_callback --
+ *
+ *    Encrypt new session tickets with the first key of the -ticketkeys
+ *    file, and decrypt presented ones with whichever key they name.
+ *    Processes sharing the file accept each other's tickets.
+ *
+ * Results:
+ *    1, 2 to have a ticket of an older key replaced, 0 for a ticket of
+ *    an unknown key (a full handshake follows), or -1 on failure.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_tls_ticket_callback(SSL *ssl, unsigned char *name, unsigned char *iv,
+				  EVP_CIPHER_CTX *cipher_ctx, tls_mac_ctx *mac_ctx, int enc)
+{
+  struct tls_state *tls = (struct tls_state*) SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tls_ctx_index);
+  struct tls_ticket_key *key;
+  int i;
+
+  tclwebsockets_tls_check_keyfile(tls);
+  if (enc) {
+    key = &tls->keys[0];
+    if (RAND_bytes(iv, 16) <= 0) {
+      return -1;
+    }
+    memcpy(name, key->name, sizeof(key->name));
+    if (!EVP_EncryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL, key->aes_key, iv) ||
+	!tclwebsockets_tls_mac_init(mac_ctx, key)) {
+      return -1;
+    }
+    tls->tickets_issued++;
+    return 1;
+  }
+
+  for (i = 0; i < tls->num_keys && memcmp(name, tls->keys[i].name, sizeof(tls->keys[i].name)) != 0; i++) {
+  }
+  if (i == tls->num_keys) {
+    tls->tickets_unknown++;
+    return 0;
+  }
+  key = &tls->keys[i];
+  if (!tclwebsockets_tls_mac_init(mac_ctx, key) ||
+      !EVP_DecryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL, key->aes_key, iv)) {
+    return -1;
+  }
+  return (i == 0 ? 1 : 2);
+}
+
+
+// Count handshakes, and those that resumed a session.  TLS 1.3 reports
+// the handshake done again after sending tickets, so only the first
+// report of each connection counts.
+static void
+tclwebsockets_tls_info_callback(const SSL *ssl, int where, int ret)
+{
+  struct tls_state *tls;
+
+  if (!(where & SSL_CB_HANDSHAKE_DONE) || SSL_get_ex_data(ssl, tls_ssl_index) != NULL) {
+    return;
+  }
+  tls = (struct tls_state*) SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tls_ctx_index);
+  SSL_set_ex_data((SSL*) ssl, tls_ssl_index, tls);
+  tls->handshakes++;
+  if (SSL_session_reused((SSL*) ssl)) {
+    tls->resumed++;
+  }
+}
+
+
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+// Choose the first protocol of -alpn that the client offers.
+static int
+tclwebsockets_tls_alpn_callback(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+				const unsigned char *in, unsigned int inlen, void *arg)
+{
+  struct tls_state *tls = (struct tls_state*) arg;
+
+  if (SSL_select_next_proto((unsigned char**) out, outlen, tls->alpn, tls->alpn_len, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_tls_configure --
+ *
+ *    Apply the TLS settings of a listener to the SSL_CTX of its
+ *    libwebsockets context, while the context is being created.
+ *    Failures are left in tls->error for listen to report.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_tls_configure(struct tls_state *tls, SSL_CTX *ctx)
+{
+  tls->ssl_ctx = ctx;
+
+  // client certificates were only required to be handed the SSL_CTX.
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+  SSL_CTX_set_ex_data(ctx, tls_ctx_index, tls);
+  SSL_CTX_set_info_callback(ctx, tclwebsockets_tls_info_callback);
+
+  // sessions of every worker and process of a deployment are interchangeable.
+  SSL_CTX_set_session_id_context(ctx, (const unsigned char*) "tclwebsockets", 13);
+  if (tls->cache_size == 0) {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+  } else if (tls->cache_size > 0) {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, tls->cache_size);
+  }
+  if (tls->cache_timeout > 0) {
+    SSL_CTX_set_timeout(ctx, tls->cache_timeout);
+  }
+  if (tls->num_keys > 0) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tclwebsockets_tls_ticket_callback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, tclwebsockets_tls_ticket_callback);
+#endif
+  }
+
+  if (tls->ciphers != NULL) {
+    if (!SSL_CTX_set_cipher_list(ctx, tls->ciphers)) {
+      snprintf(tls->error, sizeof(tls->error), "no cipher of -ciphers \"%s\" is available", tls->ciphers);
+      return;
+    }
+    SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE);
+  }
+  if (tls->curves != NULL) {
+#ifdef SSL_CTX_set1_curves_list
+    if (!SSL_CTX_set1_curves_list(ctx, tls->curves)) {
+      snprintf(tls->error, sizeof(tls->error), "invalid value \"%s\" for -curves", tls->curves);
+      return;
+    }
+#else
+    snprintf(tls->error, sizeof(tls->error), "-curves needs OpenSSL 1.0.2 or later");
+    return;
+#endif
+  }
+  if (tls->alpn != NULL) {
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+    SSL_CTX_set_alpn_select_cb(ctx, tclwebsockets_tls_alpn_callback, tls);
+#else
+    snprintf(tls->error, sizeof(tls->error), "-alpn needs OpenSSL 1.0.2 or later");
+    return;
+#endif
+  }
+}
+
+
+static void
+tclwebsockets_free_tls(struct tls_state *tls)
+{
+  if (tls == NULL) {
+    return;
+  }
+  OPENSSL_cleanse(tls->keys, sizeof(tls->keys));
+  if (tls->keyfile != NULL) {
+    ckfree(tls->keyfile);
+  }
+  if (tls->ciphers != NULL) {
+    ckfree(tls->ciphers);
+  }
+  if (tls->curves != NULL) {
+    ckfree(tls->curves);
+  }
+  if (tls->alpn != NULL) {
+    ckfree((char*) tls->alpn);
+  }
+  ckfree((char*) tls);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_new_tls --
+ *
+ *    Check the TLS options of listen, any of which may be NULL, and
+ *    keep them for tclwebsockets_tls_configure.
+ *
+ * Results:
+ *    The settings, or NULL with an error in the interpreter.
+ *
+ *----------------------------------------------------------------------
+ */
+static struct tls_state *
+tclwebsockets_new_tls(Tcl_Interp *interp, Tcl_Obj *cacheObj, Tcl_Obj *timeoutObj, Tcl_Obj *keyfileObj,
+		      Tcl_Obj *ciphersObj, Tcl_Obj *curvesObj, Tcl_Obj *alpnObj)
+{
+  struct tls_state *tls = (struct tls_state*) ckalloc(sizeof(struct tls_state));
+  long value;
+
+  memset(tls, 0, sizeof(struct tls_state));
+  tls->cache_size = -1;
+
+  if (cacheObj != NULL) {
+    if (Tcl_GetLongFromObj(interp, cacheObj, &value) != TCL_OK) {
+      goto error;
+    }
+    if (value < 0) {
+      Tcl_AppendResult(interp, "-sessioncache must not be negative", NULL);
+      goto error;
+    }
+    tls->cache_size = value;
+  }
+  if (timeoutObj != NULL) {
+    if (Tcl_GetLongFromObj(interp, timeoutObj, &value) != TCL_OK) {
+      goto error;
+    }
+    if (value <= 0) {
+      Tcl_AppendResult(interp, "-sessiontimeout must be a positive number of seconds", NULL);
+      goto error;
+    }
+    tls->cache_timeout = value;
+  }
+
+  if (keyfileObj != NULL) {
+    const char *path = Tcl_GetString(keyfileObj);
+    const char *problem;
+    struct stat st;
+
+    if ((problem = tclwebsockets_tls_read_keys(path, tls->keys, &tls->num_keys, &st)) != NULL) {
+      Tcl_AppendResult(interp, "-ticketkeys file \"", path, "\" ", problem, NULL);
+      goto error;
+    }
+    tls->keyfile = ckalloc(strlen(path) + 1);
+    strcpy(tls->keyfile, path);
+    tls->keyfile_mtime = st.st_mtime;
+    tls->keyfile_ino = st.st_ino;
+    tls->keyfile_checked = tclwebsockets_now_ns();
+  }
+
+  if (ciphersObj != NULL) {
+    tls->ciphers = ckalloc(strlen(Tcl_GetString(ciphersObj)) + 1);
+    strcpy(tls->ciphers, Tcl_GetString(ciphersObj));
+  }
+  if (curvesObj != NULL) {
+    tls->curves = ckalloc(strlen(Tcl_GetString(curvesObj)) + 1);
+    strcpy(tls->curves, Tcl_GetString(curvesObj));
+  }
+
+  // ALPN names go on the wire as length-prefixed strings.
+  if (alpnObj != NULL) {
+    Tcl_Obj **elemv;
+    int elemc, i, len;
+
+    if (Tcl_ListObjGetElements(interp, alpnObj, &elemc, &elemv) != TCL_OK) {
+      goto error;
+    }
+    for (i = 0; i < elemc; i++) {
+      Tcl_GetStringFromObj(elemv[i], &len);
+      if (len < 1 || len > 255) {
+	Tcl_AppendResult(interp, "invalid protocol \"", Tcl_GetString(elemv[i]), "\" in -alpn", NULL);
+	goto error;
+      }
+      tls->alpn_len += len + 1;
+    }
+    if (elemc > 0) {
+      unsigned char *p = tls->alpn = (unsigned char*) ckalloc(tls->alpn_len);
+      for (i = 0; i < elemc; i++) {
+	const char *name = Tcl_GetStringFromObj(elemv[i], &len);
+	*p++ = (unsigned char) len;
+	memcpy(p, name, len);
+	p += len;
+      }
+    }
+  }
+  return tls;
+
+ error:
+  tclwebsockets_free_tls(tls);
+  return NULL;
+}
+
+
+#else
+
+#define tclwebsockets_free_tls(tls)
+
+#endif /* TCLWEBSOCKETS_OPENSSL */
+
+
+#if TCLWEBSOCKETS_STATS
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_pool_stats --
+ *
+ *    Return the usage of the buffer pool of a context as a dictionary.
+ *    "classes" maps the size of each class in use to the number of
+ *    buffers handed out and kept free.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_Obj *
+tclwebsockets_pool_stats(struct buffer_pool *pool)
+{
+  Tcl_Obj *resultObj = Tcl_NewObj();
+  Tcl_Obj *classesObj = Tcl_NewObj();
+  int i;
+
+  for (i = 0; i < POOL_CLASSES; i++) {
+    if (pool->in_use[i] != 0 || pool->num_free[i] != 0) {
+      Tcl_Obj *countsObj = Tcl_NewObj();
+      Tcl_ListObjAppendElement(NULL, countsObj, Tcl_NewIntObj(pool->in_use[i]));
+      Tcl_ListObjAppendElement(NULL, countsObj, Tcl_NewIntObj(pool->num_free[i]));
+      Tcl_ListObjAppendElement(NULL, classesObj, Tcl_NewIntObj(1 << (i + POOL_MIN_SHIFT)));
+      Tcl_ListObjAppendElement(NULL, classesObj, countsObj);
+    }
+  }
+
+  tclwebsockets_append_stat(resultObj, "hits", Tcl_NewWideIntObj(pool->hits));
+  tclwebsockets_append_stat(resultObj, "misses", Tcl_NewWideIntObj(pool->misses));
+  tclwebsockets_append_stat(resultObj, "oversize", Tcl_NewWideIntObj(pool->oversize));
+  tclwebsockets_append_stat(resultObj, "oversize-in-use", Tcl_NewIntObj(pool->oversize_in_use));
+  tclwebsockets_append_stat(resultObj, "free-bytes", Tcl_NewWideIntObj((Tcl_WideInt) pool->free_bytes));
+  tclwebsockets_append_stat(resultObj, "classes", classesObj);
+  return resultObj;
+}
+
+
+static Tcl_Obj *
+tclwebsockets_file_cache_stats(struct file_cache *cache)
+{
+  Tcl_Obj *resultObj = Tcl_NewObj();
+
+  tclwebsockets_append_stat(resultObj, "entries", Tcl_NewIntObj(cache->entries.numEntries));
+  tclwebsockets_append_stat(resultObj, "bytes", Tcl_NewWideIntObj((Tcl_WideInt) cache->bytes));
+  tclwebsockets_append_stat(resultObj, "hits", Tcl_NewWideIntObj(cache->hits));
+  tclwebsockets_append_stat(resultObj, "misses", Tcl_NewWideIntObj(cache->misses));
+  tclwebsockets_append_stat(resultObj, "handled", Tcl_NewWideIntObj(cache->handled));
+  return resultObj;
+}
+
+
+#if TCLWEBSOCKETS_OPENSSL
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_tls_stats --
+ *
+ *    Return the handshake and session reuse counters of a listener as
+ *    a dictionary.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_Obj *
+tclwebsockets_tls_stats(struct tls_state *tls)
+{
+  Tcl_Obj *resultObj = Tcl_NewObj();
+
+  tclwebsockets_append_stat(resultObj, "handshakes", Tcl_NewWideIntObj(tls->handshakes));
+  tclwebsockets_append_stat(resultObj, "resumed", Tcl_NewWideIntObj(tls->resumed));
+  tclwebsockets_append_stat(resultObj, "full", Tcl_NewWideIntObj(tls->handshakes - tls->resumed));
+  tclwebsockets_append_stat(resultObj, "cache-entries", Tcl_NewLongObj(SSL_CTX_sess_number(tls->ssl_ctx)));
+  tclwebsockets_append_stat(resultObj, "cache-hits", Tcl_NewLongObj(SSL_CTX_sess_hits(tls->ssl_ctx)));
+  tclwebsockets_append_stat(resultObj, "cache-misses", Tcl_NewLongObj(SSL_CTX_sess_misses(tls->ssl_ctx)));
+  tclwebsockets_append_stat(resultObj, "cache-timeouts", Tcl_NewLongObj(SSL_CTX_sess_timeouts(tls->ssl_ctx)));
+  tclwebsockets_append_stat(resultObj, "cache-full", Tcl_NewLongObj(SSL_CTX_sess_cache_full(tls->ssl_ctx)));
+  tclwebsockets_append_stat(resultObj, "ticket-keys", Tcl_NewIntObj(tls->num_keys));
+  tclwebsockets_append_stat(resultObj, "tickets-issued", Tcl_NewWideIntObj(tls->tickets_issued));
+  tclwebsockets_append_stat(resultObj, "tickets-unknown", Tcl_NewWideIntObj(tls->tickets_unknown));
+  tclwebsockets_append_stat(resultObj, "key-reloads", Tcl_NewWideIntObj(tls->key_reloads));
+  return resultObj;
+}
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_context_stats --
+ *
+ *    Return the counters of a context as a dictionary.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_Obj *
+tclwebsockets_context_stats(struct context_userdata_struct *userdata)
+{
+  struct context_stats *stats = &userdata->stats;
+  struct websocket_session_struct *session_data;
+  Tcl_Obj *resultObj = Tcl_NewObj();
+  Tcl_Obj *eventsObj = Tcl_NewObj();
+  Tcl_Obj *timeObj = Tcl_NewObj();
+  Tcl_Obj *histogramObj = Tcl_NewObj();
+  Tcl_Obj *jsonObj = Tcl_NewObj();
+  size_t queued = 0, peak_queued = 0;
+  int i;
+
+  // queue depths are only tracked per connection.
+  for (session_data = userdata->sessions; session_data != NULL; session_data = session_data->next_session) {
+    queued += session_data->queued_bytes;
+    if (session_data->stats.peak_queued > peak_queued) {
+      peak_queued = session_data->stats.peak_queued;
+    }
+  }
+
+  for (i = 0; i < NUM_HANDLER_EVENTS; i++) {
+    if (stats->events[i] != 0) {
+      tclwebsockets_append_stat(eventsObj, handler_event_names[i], Tcl_NewWideIntObj(stats->events[i]));
+    }
+  }
+
+  // bucket i counts the handlers that took less than 2**(i+1) ticks.
+  for (i = 0; i < HANDLER_TIME_BUCKETS; i++) {
+    if (stats->handler_time[i] != 0) {
+      Tcl_ListObjAppendElement(NULL, histogramObj, Tcl_NewWideIntObj((Tcl_WideInt) 1 << (i + 1)));
+      Tcl_ListObjAppendElement(NULL, histogramObj, Tcl_NewWideIntObj(stats->handler_time[i]));
+    }
+  }
+  tclwebsockets_append_stat(timeObj, "unit", Tcl_NewStringObj(STATS_TICK_UNIT, -1));
+  tclwebsockets_append_stat(timeObj, "total", Tcl_NewWideIntObj(stats->handler_ticks));
+  tclwebsockets_append_stat(timeObj, "histogram", histogramObj);
+
+  tclwebsockets_append_stat(resultObj, "connections-open", Tcl_NewWideIntObj(stats->open_connections));
+  tclwebsockets_append_stat(resultObj, "connections", Tcl_NewWideIntObj(stats->connections));
+  tclwebsockets_append_stat(resultObj, "client-connections", Tcl_NewWideIntObj(stats->client_connections));
+  tclwebsockets_append_stat(resultObj, "connect-errors", Tcl_NewWideIntObj(stats->connect_errors));
+  tclwebsockets_append_stat(resultObj, "closes", Tcl_NewWideIntObj(stats->closes));
+  tclwebsockets_append_stat(resultObj, "messages-in", Tcl_NewWideIntObj(stats->messages_in));
+  tclwebsockets_append_stat(resultObj, "bytes-in", Tcl_NewWideIntObj(stats->bytes_in));
+  tclwebsockets_append_stat(resultObj, "messages-out", Tcl_NewWideIntObj(stats->messages_out));
+  tclwebsockets_append_stat(resultObj, "bytes-out", Tcl_NewWideIntObj(stats->bytes_out));
+  tclwebsockets_append_stat(resultObj, "broadcasts", Tcl_NewWideIntObj(stats->broadcasts));
+  tclwebsockets_append_stat(resultObj, "write-calls", Tcl_NewWideIntObj(stats->write_calls));
+  tclwebsockets_append_stat(resultObj, "write-errors", Tcl_NewWideIntObj(stats->write_errors));
+  tclwebsockets_append_stat(resultObj, "queue-full", Tcl_NewWideIntObj(stats->queue_full));
+  tclwebsockets_append_stat(resultObj, "queued-bytes", Tcl_NewWideIntObj((Tcl_WideInt) queued));
+  tclwebsockets_append_stat(resultObj, "peak-queued-bytes", Tcl_NewWideIntObj((Tcl_WideInt) peak_queued));
+  tclwebsockets_append_stat(resultObj, "handler-errors", Tcl_NewWideIntObj(stats->handler_errors));
+  tclwebsockets_append_stat(resultObj, "messages-too-large", Tcl_NewWideIntObj(stats->messages_too_large));
+  tclwebsockets_append_stat(resultObj, "pings", Tcl_NewWideIntObj(stats->pings));
+  tclwebsockets_append_stat(resultObj, "timeouts", Tcl_NewWideIntObj(stats->timeouts));
+  tclwebsockets_append_stat(resultObj, "refused-maxconnections", Tcl_NewWideIntObj(stats->refused_maxconnections));
+  tclwebsockets_append_stat(resultObj, "refused-connectrate", Tcl_NewWideIntObj(stats->refused_connectrate));
+  tclwebsockets_append_stat(resultObj, "refused-filter", Tcl_NewWideIntObj(stats->refused_filter));
+  tclwebsockets_append_stat(resultObj, "closed-messagerate", Tcl_NewWideIntObj(stats->closed_messagerate));
+  tclwebsockets_append_stat(resultObj, "peers", Tcl_NewIntObj(userdata->peers.count));
+  tclwebsockets_append_stat(jsonObj, "parsed", Tcl_NewWideIntObj(stats->json_parsed));
+  tclwebsockets_append_stat(jsonObj, "parse-time", Tcl_NewWideIntObj(stats->json_parse_ticks));
+  tclwebsockets_append_stat(jsonObj, "errors", Tcl_NewWideIntObj(stats->json_errors));
+  tclwebsockets_append_stat(jsonObj, "written", Tcl_NewWideIntObj(stats->json_written));
+  tclwebsockets_append_stat(jsonObj, "write-time", Tcl_NewWideIntObj(stats->json_write_ticks));
+  tclwebsockets_append_stat(resultObj, "json", jsonObj);
+  tclwebsockets_append_stat(resultObj, "events", eventsObj);
+  tclwebsockets_append_stat(resultObj, "handler-time", timeObj);
+  tclwebsockets_append_stat(resultObj, "pool", tclwebsockets_pool_stats(&userdata->pool));
+  if (userdata->files.docroot != NULL) {
+    tclwebsockets_append_stat(resultObj, "file-cache", tclwebsockets_file_cache_stats(&userdata->files));
+  }
+  if (userdata->compression != NULL) {
+    tclwebsockets_append_stat(resultObj, "compression", tclwebsockets_compression_stats(userdata->compression));
+  }
+#if TCLWEBSOCKETS_OPENSSL
+  if (userdata->tls != NULL) {
+    tclwebsockets_append_stat(resultObj, "tls", tclwebsockets_tls_stats(userdata->tls));
+  }
+#endif
+  return resultObj;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_session_stats --
+ *
+ *    Return the counters of a connection as a dictionary.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_Obj *
+tclwebsockets_session_stats(struct websocket_session_struct *session_data)
+{
+  struct session_stats *stats = &session_data->stats;
+  Tcl_Obj *resultObj = Tcl_NewObj();
+  Tcl_Obj *timeObj = Tcl_NewObj();
+
+  tclwebsockets_append_stat(resultObj, "messages-in", Tcl_NewWideIntObj(stats->messages_in));
+  tclwebsockets_append_stat(resultObj, "bytes-in", Tcl_NewWideIntObj(stats->bytes_in));
+  tclwebsockets_append_stat(resultObj, "messages-out", Tcl_NewWideIntObj(stats->messages_out));
+  tclwebsockets_append_stat(resultObj, "bytes-out", Tcl_NewWideIntObj(stats->bytes_out));
+  tclwebsockets_append_stat(resultObj, "write-calls", Tcl_NewWideIntObj(stats->write_calls));
+  tclwebsockets_append_stat(resultObj, "write-errors", Tcl_NewWideIntObj(stats->write_errors));
+  tclwebsockets_append_stat(resultObj, "queue-full", Tcl_NewWideIntObj(stats->queue_full));
+  tclwebsockets_append_stat(resultObj, "queued-bytes", Tcl_NewWideIntObj((Tcl_WideInt) session_data->queued_bytes));
+  tclwebsockets_append_stat(resultObj, "peak-queued-bytes", Tcl_NewWideIntObj((Tcl_WideInt) stats->peak_queued));
+  tclwebsockets_append_stat(resultObj, "events", Tcl_NewWideIntObj(stats->events));
+  // as for the context, but without a histogram per connection.
+  tclwebsockets_append_stat(timeObj, "unit", Tcl_NewStringObj(STATS_TICK_UNIT, -1));
+  tclwebsockets_append_stat(timeObj, "total", Tcl_NewWideIntObj(stats->handler_ticks));
+  tclwebsockets_append_stat(resultObj, "handler-time", timeObj);
+  return resultObj;
+}
+#endif /* TCLWEBSOCKETS_STATS */
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Connection handle object type --
+ *
+ *    Connection names passed to websockets::conn (and to handler events)
+ *    cache the handle record in their internal representation, so that
+ *    repeated calls skip the name lookup.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_release_handle(struct connection_handle *handle)
+{
+  if (--handle->refcount <= 0) {
+    ckfree((char*) handle);
+  }
+}
+
+static void
+tclwebsockets_handle_freeIntRep(Tcl_Obj *objPtr)
+{
+  tclwebsockets_release_handle((struct connection_handle*) objPtr->internalRep.twoPtrValue.ptr1);
+  objPtr->typePtr = NULL;
+}
+
+static void
+tclwebsockets_handle_dupIntRep(Tcl_Obj *srcPtr, Tcl_Obj *dupPtr)
+{
+  struct connection_handle *handle = (struct connection_handle*) srcPtr->internalRep.twoPtrValue.ptr1;
+
+  handle->refcount++;
+  dupPtr->internalRep.twoPtrValue.ptr1 = handle;
+  dupPtr->typePtr = srcPtr->typePtr;
+}
+
+// the string representation is never invalidated, so no updateStringProc.
+static Tcl_ObjType connectionHandleType = {
+  "websocket-connection",
+  tclwebsockets_handle_freeIntRep,
+  tclwebsockets_handle_dupIntRep,
+  NULL,
+  NULL
+};
+
+static void
+tclwebsockets_set_handle_intrep(Tcl_Obj *objPtr, struct connection_handle *handle)
+{
+  if (objPtr->typePtr != NULL && objPtr->typePtr->freeIntRepProc != NULL) {
+    objPtr->typePtr->freeIntRepProc(objPtr);
+  }
+  handle->refcount++;
+  objPtr->internalRep.twoPtrValue.ptr1 = handle;
+  objPtr->typePtr = &connectionHandleType;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_get_connection --
+ *
+ *    Resolve a connection name to its session, caching the handle in
+ *    the object.
+ *
+ * Results:
+ *    The session, or NULL with an error in interp if the name is unknown
+ *    or the connection has closed.
+ *
+ *----------------------------------------------------------------------
+ */
+static struct websocket_session_struct *
+tclwebsockets_get_connection(Tcl_Interp *interp, struct interp_data_struct *interpdata, Tcl_Obj *objPtr)
+{
+  struct connection_handle *handle = NULL;
+
+  if (objPtr->typePtr == &connectionHandleType) {
+    handle = (struct connection_handle*) objPtr->internalRep.twoPtrValue.ptr1;
+    if (handle->interpdata != interpdata) {
+      handle = NULL;
+    }
+  }
+
+  if (handle == NULL) {
+    Tcl_HashEntry *entry = Tcl_FindHashEntry(&interpdata->handles, Tcl_GetString(objPtr));
+    if (entry == NULL) {
+      Tcl_AppendResult(interp, "invalid connection \"", Tcl_GetString(objPtr), "\"", NULL);
+      return NULL;
+    }
+    handle = (struct connection_handle*) Tcl_GetHashValue(entry);
+    tclwebsockets_set_handle_intrep(objPtr, handle);
+  }
+
+  if (handle->session == NULL) {
+    Tcl_AppendResult(interp, "connection \"", Tcl_GetString(objPtr), "\" is closed", NULL);
+    return NULL;
+  }
+  return handle->session;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_loadstatevarsCmd --
+ *
+ *    Implements websockets::loadstatevars, which the compiled handler
+ *    lambdas invoke first.  Sets the statevars of the session whose event
+ *    is being handled as local variables of the caller's frame.  The
+ *    values are moved into the variables, so that lappend, dict set and
+ *    the like modify them in place rather than copying a shared value;
+ *    savestatevars puts them back.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_loadstatevarsCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  struct interp_data_struct *interpdata = (struct interp_data_struct*) cData;
+  struct websocket_session_struct *session_data = interpdata->current_session;
+  struct handler_dispatch_struct *dispatch;
+  int i;
+
+  if (session_data == NULL) {
+    return TCL_OK;
+  }
+  dispatch = session_data->dispatch;
+
+  for (i = 0; i < dispatch->num_statevars && i < session_data->num_statevals; i++) {
+    if (session_data->statevals[i] != NULL &&
+	Tcl_ObjSetVar2(interp, dispatch->statevar_names[i], NULL, session_data->statevals[i], 0) != NULL) {
+      Tcl_DecrRefCount(session_data->statevals[i]);
+      session_data->statevals[i] = NULL;
+    }
+  }
+  return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_savestatevarsCmd --
+ *
+ *    Implements websockets::savestatevars, which the compiled handler
+ *    lambdas invoke last, even if the body raised an error.  Captures the
+ *    caller's statevar locals back into the slots of the session.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_savestatevarsCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  struct interp_data_struct *interpdata = (struct interp_data_struct*) cData;
+  struct websocket_session_struct *session_data = interpdata->current_session;
+  struct handler_dispatch_struct *dispatch;
+  int i;
+
+  if (session_data == NULL) {
+    return TCL_OK;
+  }
+  dispatch = session_data->dispatch;
+
+  // the handler may have been redefined with a different set of statevars.
+  if (session_data->num_statevals != dispatch->num_statevars) {
+    session_data->statevals = (Tcl_Obj**) ckrealloc((char*) session_data->statevals, sizeof(Tcl_Obj*) * dispatch->num_statevars);
+    for (i = session_data->num_statevals; i < dispatch->num_statevars; i++) {
+      session_data->statevals[i] = NULL;
+    }
+    session_data->num_statevals = dispatch->num_statevars;
+  }
+
+  for (i = 0; i < dispatch->num_statevars; i++) {
+    Tcl_Obj *value = Tcl_ObjGetVar2(interp, dispatch->statevar_names[i], NULL, 0);
+
+    if (value != NULL) {
+      Tcl_IncrRefCount(value);
+    }
+    if (session_data->statevals[i] != NULL) {
+      Tcl_DecrRefCount(session_data->statevals[i]);
+    }
+    session_data->statevals[i] = value;
+  }
+  return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_end_coroutine --
+ *
+ *    Delete the coroutine of a session that is going away, which
+ *    unwinds it where it waits.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_end_coroutine(struct context_userdata_struct *context_data, struct websocket_session_struct *session_data)
+{
+  Tcl_Obj *coroutine = session_data->coroutine;
+
+  if (session_data->coro_pending != NULL) {
+    Tcl_DecrRefCount(session_data->coro_pending);
+    session_data->coro_pending = NULL;
+  }
+  if (coroutine == NULL) {
+    return;
+  }
+  session_data->coroutine = NULL;
+  session_data->coro_state = CORO_NONE;
+
+  // anything the unwinding asks of the connection is deferred.
+  context_data->callback_depth++;
+  Tcl_DeleteCommand(session_data->interp, Tcl_GetString(coroutine));
+  context_data->callback_depth--;
+  Tcl_DecrRefCount(coroutine);
+  Tcl_ResetResult(session_data->interp);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_unlink_batch --
+ *
+ *    Take a session off the list of pending batches, or off the part of
+ *    it that tclwebsockets_flush_batches() is going through.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_unlink_batch(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data)
+{
+  struct websocket_session_struct **lists[2], **pp;
+  int i;
+
+  lists[0] = &userdata->batches;
+  lists[1] = &userdata->flushing;
+  for (i = 0; i < 2; i++) {
+    for (pp = lists[i]; *pp != NULL; pp = &(*pp)->next_batch) {
+      if (*pp == session_data) {
+	*pp = session_data->next_batch;
+	session_data->next_batch = NULL;
+	return;
+      }
+    }
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_free_session --
+ *
+ *    Release everything a session holds once its connection has closed.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_free_session(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data)
+{
+  int i;
+
+  // outbound connections can fail and then close.
+  if (session_data->released) {
+    return;
+  }
+  session_data->released = 1;
+  STATS_ADD(userdata, open_connections, -1);
+
+  // before the connection command goes, since the coroutine may use it
+  // while it unwinds.
+  tclwebsockets_end_coroutine(userdata, session_data);
+
+  if (!session_data->is_client) {
+    userdata->num_connections--;
+  }
+  if (session_data->peer != NULL) {
+    session_data->peer->connections--;
+    session_data->peer = NULL;
+  }
+
+  // it may have been waiting for a deferred close.
+  if (session_data->close_requested) {
+    struct websocket_session_struct **pp;
+    for (pp = &userdata->pending_close; *pp != NULL; pp = &(*pp)->next_pending_close) {
+      if (*pp == session_data) {
+	*pp = session_data->next_pending_close;
+	break;
+      }
+    }
+  }
+
+  tclwebsockets_discard_queue(userdata, session_data);
+  tclwebsockets_leave_topic(session_data, NULL);
+
+  if (session_data->rx_buffer != NULL) {
+    tclwebsockets_pool_free(&userdata->pool, session_data->rx_buffer);
+    session_data->rx_buffer = NULL;
+  }
+
+  if (userdata->wheel != NULL) {
+    tclwebsockets_wheel_unlink(userdata, session_data);
+  }
+
+  if (session_data->batch != NULL) {
+    tclwebsockets_unlink_batch(userdata, session_data);
+    Tcl_DecrRefCount(session_data->batch);
+    session_data->batch = NULL;
+  }
+  session_data->rx_size = session_data->rx_len = 0;
+
+  if (session_data->prev_session != NULL) {
+    session_data->prev_session->next_session = session_data->next_session;
+  } else if (userdata->sessions == session_data) {
+    userdata->sessions = session_data->next_session;
+  }
+  if (session_data->next_session != NULL) {
+    session_data->next_session->prev_session = session_data->prev_session;
+  }
+  session_data->prev_session = session_data->next_session = NULL;
+
+  for (i = 0; i < session_data->num_statevals; i++) {
+    if (session_data->statevals[i] != NULL) {
+      Tcl_DecrRefCount(session_data->statevals[i]);
+    }
+  }
+  if (session_data->statevals != NULL) {
+    ckfree((char*) session_data->statevals);
+  }
+  session_data->statevals = NULL;
+  session_data->num_statevals = 0;
+
+  // the connection command goes away with the connection, so a stale $wsi
+  // is an unknown command rather than a dangling pointer.
+  if (session_data->cmdToken != NULL) {
+    Tcl_DeleteCommandFromToken(session_data->interp, session_data->cmdToken);
+  }
+  if (session_data->connection_cmd_obj != NULL) {
+    Tcl_DecrRefCount(session_data->connection_cmd_obj);
+    session_data->connection_cmd_obj = NULL;
+  }
+  if (session_data->handle != NULL) {
+    if (session_data->handle->entry != NULL) {
+      Tcl_DeleteHashEntry(session_data->handle->entry);
+    }
+    session_data->handle->entry = NULL;
+    session_data->handle->session = NULL;
+    tclwebsockets_release_handle(session_data->handle);
+    session_data->handle = NULL;
+  }
+  session_data->socket = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * JSON codec, for handlers created with -format json and for
+ * $wsi writejson.
+ *
+ * Objects are parsed into dicts, arrays into lists, numbers into
+ * integer or double objects and strings into strings; true, false and
+ * null become those words.  Writing goes the other way by a type given
+ * with the value, since the same Tcl value can stand for a string, a
+ * number or a list.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define JSON_MAX_DEPTH 512
+
+#define JSON_ONES  ((Tcl_WideUInt) 0x0101010101010101ULL)
+#define JSON_HIGHS ((Tcl_WideUInt) 0x8080808080808080ULL)
+
+// Nonzero if a byte of w is below n (n <= 128), or equal to c.
+#define JSON_HAS_LESS(w, n) (((w) - JSON_ONES * (n)) & ~(w) & JSON_HIGHS)
+#define JSON_HAS_BYTE(w, c) JSON_HAS_LESS((w) ^ (JSON_ONES * (c)), 1)
+
+struct json_parser {
+  const unsigned char *p;
+  const unsigned char *end;
+  int depth;
+};
+
+// With buf NULL, only the length of the output is counted, so that the
+// frame can be allocated before the value is written into it.  That
+// first pass also reports the errors, in interp.
+struct json_writer {
+  Tcl_Interp *interp;
+  unsigned char *buf;
+  size_t len;
+  int depth;
+};
+
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_json_scan --
+ *
+ *    Skip the bytes of a string that can be copied as they are, eight
+ *    at a time: everything but the quote, the backslash and control
+ *    characters, and also 0xC0 when writing, which starts Tcl's
+ *    encoding of NUL.
+ *
+ * Results:
+ *    The first byte that needs attention, or end.
+ *
+ *----------------------------------------------------------------------
+ */
+static const unsigned char *
+tclwebsockets_json_scan(const unsigned char *p, const unsigned char *end, int writing)
+{
+  while (end - p >= 8) {
+    Tcl_WideUInt w;
+
+    memcpy(&w, p, 8);
+    if (JSON_HAS_BYTE(w, '"') | JSON_HAS_BYTE(w, '\\') | JSON_HAS_LESS(w, 0x20) |
+	(writing ? JSON_HAS_BYTE(w, 0xC0) : 0)) {
+      break;
+    }
+    p += 8;
+  }
+  while (p < end && *p != '"' && *p != '\\' && *p >= 0x20 && !(writing && *p == 0xC0)) {
+    p++;
+  }
+  return p;
+}
+
+
+static void
+tclwebsockets_json_skip_space(struct json_parser *jp)
+{
+  while (jp->p < jp->end && (*jp->p == ' ' || *jp->p == '\t' || *jp->p == '\n' || *jp->p == '\r')) {
+    jp->p++;
+  }
+}
+
+
+static int
+tclwebsockets_json_hex4(const unsigned char *p, const unsigned char *end, unsigned int *codePtr)
+{
+  unsigned int code = 0;
+  int i;
+
+  if (end - p < 4) {
+    return 0;
+  }
+  for (i = 0; i < 4; i++) {
+    int c = p[i];
+    code <<= 4;
+    if (c >= '0' && c <= '9') {
+      code |= c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      code |= c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      code |= c - 'A' + 10;
+    } else {
+      return 0;
+    }
+  }
+  *codePtr = code;
+  return 1;
+}
+
+
+// Encode a code point the way Tcl keeps it: NUL as C0 80, everything
+// else as UTF-8.
+static int
+tclwebsockets_json_utf8(unsigned int code, char *buf)
+{
+  if (code == 0) {
+    buf[0] = (char) 0xC0;
+    buf[1] = (char) 0x80;
+    return 2;
+  }
+  if (code < 0x80) {
+    buf[0] = (char) code;
+    return 1;
+  }
+  if (code < 0x800) {
+    buf[0] = (char) (0xC0 | (code >> 6));
+    buf[1] = (char) (0x80 | (code & 0x3F));
+    return 2;
+  }
+  if (code < 0x10000) {
+    buf[0] = (char) (0xE0 | (code >> 12));
+    buf[1] = (char) (0x80 | ((code >> 6) & 0x3F));
+    buf[2] = (char) (0x80 | (code & 0x3F));
+    return 3;
+  }
+  buf[0] = (char) (0xF0 | (code >> 18));
+  buf[1] = (char) (0x80 | ((code >> 12) & 0x3F));
+  buf[2] = (char) (0x80 | ((code >> 6) & 0x3F));
+  buf[3] = (char) (0x80 | (code & 0x3F));
+  return 4;
+}
+
+
+// Parse a string, the parser being on its opening quote.  Strings
+// without escapes, which are most of them, are made from the input as
+// they are.
+static Tcl_Obj *
+tclwebsockets_json_string(struct json_parser *jp)
+{
+  const unsigned char *start = jp->p + 1;
+  const unsigned char *q = tclwebsockets_json_scan(start, jp->end, 0);
+  Tcl_DString ds;
+
+  if (q < jp->end && *q == '"') {
+    jp->p = q + 1;
+    return Tcl_NewStringObj((const char*) start, (int) (q - start));
+  }
+
+  Tcl_DStringInit(&ds);
+  for (;;) {
+    unsigned int code;
+    char utf[4];
+
+    Tcl_DStringAppend(&ds, (const char*) start, (int) (q - start));
+    if (q >= jp->end || *q < 0x20) {
+      break;
+    }
+    if (*q == '"') {
+      Tcl_Obj *resultObj = Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+      Tcl_DStringFree(&ds);
+      jp->p = q + 1;
+      return resultObj;
+    }
+
+    // a backslash.
+    if (++q >= jp->end) {
+      break;
+    }
+    switch (*q++) {
+    case '"': Tcl_DStringAppend(&ds, "\"", 1); break;
+    case '\\': Tcl_DStringAppend(&ds, "\\", 1); break;
+    case '/': Tcl_DStringAppend(&ds, "/", 1); break;
+    case 'b': Tcl_DStringAppend(&ds, "\b", 1); break;
+    case 'f': Tcl_DStringAppend(&ds, "\f", 1); break;
+    case 'n': Tcl_DStringAppend(&ds, "\n", 1); break;
+    case 'r': Tcl_DStringAppend(&ds, "\r", 1); break;
+    case 't': Tcl_DStringAppend(&ds, "\t", 1); break;
+    case 'u': {
+      unsigned int low;
+
+      if (!tclwebsockets_json_hex4(q, jp->end, &code)) {
+	goto error;
+      }
+      q += 4;
+      // a surrogate pair stands for one character beyond the BMP.
+      if (code >= 0xD800 && code <= 0xDBFF && jp->end - q >= 6 && q[0] == '\\' && q[1] == 'u' &&
+	  tclwebsockets_json_hex4(q + 2, jp->end, &low) && low >= 0xDC00 && low <= 0xDFFF) {
+	code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+	q += 6;
+      }
+      Tcl_DStringAppend(&ds, utf, tclwebsockets_json_utf8(code, utf));
+      break;
+    }
+    default:
+      goto error;
+    }
+    start = q;
+    q = tclwebsockets_json_scan(start, jp->end, 0);
+  }
+
+ error:
+  Tcl_DStringFree(&ds);
+  return NULL;
+}
+
+
+// Find the end of a number, checking its syntax.
+static const unsigned char *
+tclwebsockets_json_number_end(const unsigned char *p, const unsigned char *end, int *is_integer)
+{
+  *is_integer = 1;
+  if (p < end && *p == '-') {
+    p++;
+  }
+  if (p < end && *p == '0') {
+    p++;
+  } else if (p < end && *p >= '1' && *p <= '9') {
+    while (p < end && *p >= '0' && *p <= '9') {
+      p++;
+    }
+  } else {
+    return NULL;
+  }
+  if (p < end && *p == '.') {
+    *is_integer = 0;
+    if (++p >= end || *p < '0' || *p > '9') {
+      return NULL;
+    }
+    while (p < end && *p >= '0' && *p <= '9') {
+      p++;
+    }
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    *is_integer = 0;
+    if (++p < end && (*p == '+' || *p == '-')) {
+      p++;
+    }
+    if (p >= end || *p < '0' || *p > '9') {
+      return NULL;
+    }
+    while (p < end && *p >= '0' && *p <= '9') {
+      p++;
+    }
+  }
+  return p;
+}
+
+
+static Tcl_Obj *
+tclwebsockets_json_number(struct json_parser *jp)
+{
+  const unsigned char *start = jp->p, *p;
+  int is_integer;
+  Tcl_Obj *resultObj;
+  double d;
+
+  if ((p = tclwebsockets_json_number_end(start, jp->end, &is_integer)) == NULL) {
+    return NULL;
+  }
+  jp->p = p;
+
+  // up to 18 digits always fit.
+  if (is_integer && p - start <= 18) {
+    const unsigned char *d = (*start == '-' ? start + 1 : start);
+    Tcl_WideInt value = 0;
+
+    while (d < p) {
+      value = value * 10 + (*d++ - '0');
+    }
+    return Tcl_NewWideIntObj(*start == '-' ? -value : value);
+  }
+
+  // the rest keep their text, and Tcl makes a double or bignum of it.
+  resultObj = Tcl_NewStringObj((const char*) start, (int) (p - start));
+  Tcl_GetDoubleFromObj(NULL, resultObj, &d);
+  return resultObj;
+}
+
+
+static Tcl_Obj *
+tclwebsockets_json_value(struct json_parser *jp)
+{
+  Tcl_Obj *resultObj = NULL;
+
+  tclwebsockets_json_skip_space(jp);
+  if (jp->p >= jp->end) {
+    return NULL;
+  }
+
+  switch (*jp->p) {
+  case '{':
+  case '[': {
+    int is_object = (*jp->p == '{');
+    char close = (is_object ? '}' : ']');
+
+    if (++jp->depth > JSON_MAX_DEPTH) {
+      return NULL;
+    }
+    jp->p++;
+    resultObj = (is_object ? Tcl_NewDictObj() : Tcl_NewListObj(0, NULL));
+    tclwebsockets_json_skip_space(jp);
+    if (jp->p < jp->end && *jp->p == close) {
+      jp->p++;
+      jp->depth--;
+      return resultObj;
+    }
+    for (;;) {
+      Tcl_Obj *keyObj = NULL, *elementObj;
+
+      if (is_object) {
+	tclwebsockets_json_skip_space(jp);
+	if (jp->p >= jp->end || *jp->p != '"' || (keyObj = tclwebsockets_json_string(jp)) == NULL) {
+	  break;
+	}
+	Tcl_IncrRefCount(keyObj);
+	tclwebsockets_json_skip_space(jp);
+	if (jp->p >= jp->end || *jp->p != ':') {
+	  Tcl_DecrRefCount(keyObj);
+	  break;
+	}
+	jp->p++;
+      }
+      if ((elementObj = tclwebsockets_json_value(jp)) == NULL) {
+	if (keyObj != NULL) {
+	  Tcl_DecrRefCount(keyObj);
+	}
+	break;
+      }
+      if (is_object) {
+	Tcl_DictObjPut(NULL, resultObj, keyObj, elementObj);
+	Tcl_DecrRefCount(keyObj);
+      } else {
+	Tcl_ListObjAppendElement(NULL, resultObj, elementObj);
+      }
+
+      tclwebsockets_json_skip_space(jp);
+      if (jp->p < jp->end && *jp->p == ',') {
+	jp->p++;
+	continue;
+      }
+      if (jp->p < jp->end && *jp->p == close) {
+	jp->p++;
+	jp->depth--;
+	return resultObj;
+      }
+      break;
+    }
+    jp->depth--;
+    Tcl_IncrRefCount(resultObj);
+    Tcl_DecrRefCount(resultObj);
+    return NULL;
+  }
+
+  case '"':
+    return tclwebsockets_json_string(jp);
+
+  case 't':
+  case 'f':
+  case 'n': {
+    static const char *words[] = { "true", "false", "null" };
+    int i;
+
+    for (i = 0; i < 3; i++) {
+      size_t len = strlen(words[i]);
+      if ((size_t) (jp->end - jp->p) >= len && memcmp(jp->p, words[i], len) == 0) {
+	jp->p += len;
+	return Tcl_NewStringObj(words[i], (int) len);
+      }
+    }
+    return NULL;
+  }
+
+  default:
+    return tclwebsockets_json_number(jp);
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_json_parse --
+ *
+ *    Parse one JSON text.
+ *
+ * Results:
+ *    The value, with a reference count of zero, or NULL if the text is
+ *    not valid JSON.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_Obj *
+tclwebsockets_json_parse(const char *text, size_t len)
+{
+  struct json_parser jp;
+  Tcl_Obj *resultObj;
+
+  jp.p = (const unsigned char*) text;
+  jp.end = jp.p + len;
+  jp.depth = 0;
+  if ((resultObj = tclwebsockets_json_value(&jp)) == NULL) {
+    return NULL;
+  }
+  tclwebsockets_json_skip_space(&jp);
+  if (jp.p != jp.end) {
+    Tcl_IncrRefCount(resultObj);
+    Tcl_DecrRefCount(resultObj);
+    return NULL;
+  }
+  return resultObj;
+}
+
+
+static void
+tclwebsockets_json_put(struct json_writer *jw, const void *data, size_t len)
+{
+  if (jw->buf != NULL) {
+    memcpy(jw->buf + jw->len, data, len);
+  }
+  jw->len += len;
+}
+
+
+static void
+tclwebsockets_json_put_string(struct json_writer *jw, const char *str, int len)
+{
+  const unsigned char *p = (const unsigned char*) str, *end = p + len;
+
+  tclwebsockets_json_put(jw, "\"", 1);
+  while (p < end) {
+    const unsigned char *q = tclwebsockets_json_scan(p, end, 1);
+    char escape[8];
+
+    tclwebsockets_json_put(jw, p, q - p);
+    if (q >= end) {
+      break;
+    }
+    switch (*q) {
+    case '"': tclwebsockets_json_put(jw, "\\\"", 2); break;
+    case '\\': tclwebsockets_json_put(jw, "\\\\", 2); break;
+    case '\n': tclwebsockets_json_put(jw, "\\n", 2); break;
+    case '\r': tclwebsockets_json_put(jw, "\\r", 2); break;
+    case '\t': tclwebsockets_json_put(jw, "\\t", 2); break;
+    case 0xC0:
+      if (q + 1 < end && q[1] == 0x80) {
+	tclwebsockets_json_put(jw, "\\u0000", 6);
+	q++;
+      } else {
+	tclwebsockets_json_put(jw, q, 1);
+      }
+      break;
+    default:
+      snprintf(escape, sizeof(escape), "\\u%04x", *q);
+      tclwebsockets_json_put(jw, escape, 6);
+      break;
+    }
+    p = q + 1;
+  }
+  tclwebsockets_json_put(jw, "\"", 1);
+}
+
+
+// Whether text is a number as JSON writes them.
+static int
+tclwebsockets_json_is_number(const char *text, int len)
+{
+  const unsigned char *end = (const unsigned char*) text + len;
+  int is_integer;
+
+  return (tclwebsockets_json_number_end((const unsigned char*) text, end, &is_integer) == end);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_json_write --
+ *
+ *    Write a value as JSON of the given type: string, number, boolean
+ *    or null (whatever the value), {array type} for a list whose
+ *    elements are all of that type, or {object {key type ...}} for a
+ *    dict, where the type of a key "*" applies to the keys not listed.
+ *    The type is never taken from the Tcl object, whose internal
+ *    representation only says how it was last used.  Numbers are
+ *    written as their string representation when that is valid JSON,
+ *    which keeps the text of parsed numbers; infinities and NaN become
+ *    null.
+ *
+ * Results:
+ *    1, or 0 with an error message in jw->interp if the value does not
+ *    have its type, the type is not valid, or they nest too deeply.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_json_write(struct json_writer *jw, Tcl_Obj *typeObj, Tcl_Obj *valueObj)
+{
+  static CONST char *jsonTypes[] = { "string", "number", "boolean", "null", "array", "object", NULL };
+  enum jsontypes { JSON_STRING, JSON_NUMBER, JSON_BOOLEAN, JSON_NULL, JSON_ARRAY, JSON_OBJECT };
+  Tcl_Obj **typev;
+  const char *str;
+  int typec, typeIndex, len, i;
+
+  if (Tcl_ListObjGetElements(jw->interp, typeObj, &typec, &typev) != TCL_OK) {
+    return 0;
+  }
+  if (typec == 0 || typec > 2) {
+    Tcl_AppendResult(jw->interp, "bad JSON type \"", Tcl_GetString(typeObj), "\"", NULL);
+    return 0;
+  }
+  if (Tcl_GetIndexFromObj(jw->interp, typev[0], jsonTypes, "JSON type", TCL_EXACT, &typeIndex) != TCL_OK) {
+    return 0;
+  }
+  if ((typeIndex == JSON_ARRAY || typeIndex == JSON_OBJECT) != (typec == 2)) {
+    Tcl_AppendResult(jw->interp, "bad JSON type \"", Tcl_GetString(typeObj), "\"", NULL);
+    return 0;
+  }
+
+  switch ((enum jsontypes) typeIndex) {
+  case JSON_OBJECT: {
+    Tcl_DictSearch search;
+    Tcl_Obj *keyObj, *elementObj, *elementType, *otherType, *starObj;
+    int done, first = 1, code;
+
+    if (++jw->depth > JSON_MAX_DEPTH) {
+      Tcl_AppendResult(jw->interp, "value is nested too deeply", NULL);
+      return 0;
+    }
+    starObj = Tcl_NewStringObj("*", 1);
+    Tcl_IncrRefCount(starObj);
+    code = Tcl_DictObjGet(jw->interp, typev[1], starObj, &otherType);
+    Tcl_DecrRefCount(starObj);
+    if (code != TCL_OK || Tcl_DictObjFirst(jw->interp, valueObj, &search, &keyObj, &elementObj, &done) != TCL_OK) {
+      return 0;
+    }
+    tclwebsockets_json_put(jw, "{", 1);
+    for (; !done; Tcl_DictObjNext(&search, &keyObj, &elementObj, &done)) {
+      Tcl_DictObjGet(NULL, typev[1], keyObj, &elementType);
+      if (elementType == NULL && (elementType = otherType) == NULL) {
+	Tcl_AppendResult(jw->interp, "no JSON type for key \"", Tcl_GetString(keyObj), "\"", NULL);
+	Tcl_DictObjDone(&search);
+	return 0;
+      }
+      if (!first) {
+	tclwebsockets_json_put(jw, ",", 1);
+      }
+      first = 0;
+      str = Tcl_GetStringFromObj(keyObj, &len);
+      tclwebsockets_json_put_string(jw, str, len);
+      tclwebsockets_json_put(jw, ":", 1);
+      if (!tclwebsockets_json_write(jw, elementType, elementObj)) {
+	Tcl_DictObjDone(&search);
+	return 0;
+      }
+    }
+    tclwebsockets_json_put(jw, "}", 1);
+    jw->depth--;
+    return 1;
+  }
+
+  case JSON_ARRAY: {
+    Tcl_Obj **elemv;
+    int elemc;
+
+    if (++jw->depth > JSON_MAX_DEPTH) {
+      Tcl_AppendResult(jw->interp, "value is nested too deeply", NULL);
+      return 0;
+    }
+    if (Tcl_ListObjGetElements(jw->interp, valueObj, &elemc, &elemv) != TCL_OK) {
+      return 0;
+    }
+    tclwebsockets_json_put(jw, "[", 1);
+    for (i = 0; i < elemc; i++) {
+      if (i > 0) {
+	tclwebsockets_json_put(jw, ",", 1);
+      }
+      if (!tclwebsockets_json_write(jw, typev[1], elemv[i])) {
+	return 0;
+      }
+    }
+    tclwebsockets_json_put(jw, "]", 1);
+    jw->depth--;
+    return 1;
+  }
+
+  case JSON_NUMBER: {
+    Tcl_WideInt wide;
+    double d;
+    char number[TCL_DOUBLE_SPACE + 8];
+
+    str = Tcl_GetStringFromObj(valueObj, &len);
+    if (tclwebsockets_json_is_number(str, len)) {
+      tclwebsockets_json_put(jw, str, len);
+    } else if (Tcl_GetWideIntFromObj(NULL, valueObj, &wide) == TCL_OK) {
+      snprintf(number, sizeof(number), "%" TCL_LL_MODIFIER "d", wide);
+      tclwebsockets_json_put(jw, number, strlen(number));
+    } else if (Tcl_GetDoubleFromObj(jw->interp, valueObj, &d) != TCL_OK) {
+      return 0;
+    } else if (d == d && d - d == 0) {
+      snprintf(number, sizeof(number), "%.17g", d);
+      tclwebsockets_json_put(jw, number, strlen(number));
+    } else {
+      tclwebsockets_json_put(jw, "null", 4);
+    }
+    return 1;
+  }
+
+  case JSON_BOOLEAN:
+    if (Tcl_GetBooleanFromObj(jw->interp, valueObj, &i) != TCL_OK) {
+      return 0;
+    }
+    tclwebsockets_json_put(jw, (i ? "true" : "false"), (i ? 4 : 5));
+    return 1;
+
+  case JSON_NULL:
+    tclwebsockets_json_put(jw, "null", 4);
+    return 1;
+
+  case JSON_STRING:
+  default:
+    str = Tcl_GetStringFromObj(valueObj, &len);
+    tclwebsockets_json_put_string(jw, str, len);
+    return 1;
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_json_message --
+ *
+ *    Parse a received text message for a handler created with -format
+ *    json.  A message that is not JSON closes the connection with
+ *    status 1007.
+ *
+ * Results:
+ *    The value, with a reference count of zero, or NULL.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_Obj *
+tclwebsockets_json_message(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data, const char *data, size_t len)
+{
+  Tcl_Obj *resultObj;
+#if TCLWEBSOCKETS_STATS
+  Tcl_WideUInt start_ticks = tclwebsockets_ticks();
+#endif
+
+  resultObj = tclwebsockets_json_parse(data, len);
+  STATS_ADD(userdata, json_parse_ticks, (Tcl_WideInt) (tclwebsockets_ticks() - start_ticks));
+  if (resultObj == NULL) {
+    STATS_INCR(userdata, json_errors);
+    tclwebsockets_defer_close(userdata, session_data, LWS_CLOSE_STATUS_INVALID_PAYLOAD);
+    return NULL;
+  }
+  STATS_INCR(userdata, json_parsed);
+  return resultObj;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_connectionDeleteProc --
+ *
+ *    Called when a connection command is deleted, either because the
+ *    connection closed or because the script renamed it away.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_connectionDeleteProc(ClientData cData)
+{
+  struct websocket_session_struct *session_data = (struct websocket_session_struct*)cData;
+
+  session_data->cmdToken = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_connection_subcommand --
+ *
+ *    Implements the subcommands of a connection, for both the
+ *    per-connection command and websockets::conn.  objv[1] is the
+ *    subcommand and its arguments start at objv[skip].
+ *
+ * Results:
+ *    stuff
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_connection_subcommand(struct websocket_session_struct *session_data, Tcl_Interp *interp, int skip, int objc, Tcl_Obj *CONST objv[])
+{
+  const char *commands[] = {
+    "close",
+    "write",
+    "writev",
+    "writejson",
+    "pending",
+    "join",
+    "leave",
+    "stats",
+    "waitwritable",
+    NULL
+  };
+
+  enum command_enum {
+    CMD_CLOSE,
+    CMD_WRITE,
+    CMD_WRITEV,
+    CMD_WRITEJSON,
+    CMD_PENDING,
+    CMD_JOIN,
+    CMD_LEAVE,
+    CMD_STATS,
+    CMD_WAITWRITABLE
+  };
+
+  int cmdIndex;
+
+  if (Tcl_GetIndexFromObj(interp, objv[1], commands, "command", TCL_EXACT, &cmdIndex) != TCL_OK) {
+    return TCL_ERROR;
+  }
+
+  switch (cmdIndex) {
+  case CMD_CLOSE: {
+    if (objc != skip) {
+      Tcl_WrongNumArgs (interp, skip, objv, NULL);
+      return TCL_ERROR;
+    }
+    tclwebsockets_request_close(session_data);
+    break;
+  }
+
+  case CMD_WAITWRITABLE: {
+    // the coroutine yields from the NRE variants of the commands below.
+    if (objc != skip) {
+      Tcl_WrongNumArgs (interp, skip, objv, NULL);
+      return TCL_ERROR;
+    }
+    Tcl_AppendResult(interp, "waitwritable must be called from the coroutine of a -coroutine handler, with Tcl 8.6 or later", NULL);
+    return TCL_ERROR;
+  }
+
+  case CMD_WRITE:
+  case CMD_WRITEV:
+  case CMD_WRITEJSON: {
+    static CONST char *writeOptions[] = { "-binary", "-text", "-nocompress", NULL };
+    enum writeoptions { WRITEOPT_BINARY, WRITEOPT_TEXT, WRITEOPT_NOCOMPRESS };
+    enum libwebsocket_write_protocol write_protocol = LWS_WRITE_TEXT;
+    int nocompress = 0;
+    struct context_userdata_struct *userdata = (struct context_userdata_struct*) libwebsockets_get_user_data(session_data->context);
+    struct outbound_frame *frame;
+    struct json_writer jw;
+    Tcl_Obj **valuev;
+    unsigned char *p;
+    int len, optIndex, i, valuec, last;
+#if TCLWEBSOCKETS_STATS
+    Tcl_WideUInt start_ticks = tclwebsockets_ticks();
+#endif
+
+    // writejson takes the JSON type of the value before it.
+    last = (cmdIndex == CMD_WRITEJSON ? objc - 2 : objc - 1);
+    if (last < skip) {
+      Tcl_WrongNumArgs (interp, skip, objv, (cmdIndex == CMD_WRITEV ? "?-binary|-text? ?-nocompress? values" :
+					     cmdIndex == CMD_WRITEJSON ? "?-nocompress? type value" : "?-binary|-text? ?-nocompress? value"));
+      return TCL_ERROR;
+    }
+
+    for (i = skip; i < last; i++) {
+      if (Tcl_GetIndexFromObj(interp, objv[i], writeOptions, "option", TCL_EXACT, &optIndex) != TCL_OK) {
+	return TCL_ERROR;
+      }
+      // JSON is always text.
+      if (cmdIndex == CMD_WRITEJSON && optIndex != WRITEOPT_NOCOMPRESS) {
+	Tcl_AppendResult(interp, "bad option \"", Tcl_GetString(objv[i]), "\": must be -nocompress", NULL);
+	return TCL_ERROR;
+      }
+      switch ((enum writeoptions) optIndex) {
+      case WRITEOPT_BINARY: write_protocol = LWS_WRITE_BINARY; break;
+      case WRITEOPT_TEXT: write_protocol = LWS_WRITE_TEXT; break;
+      case WRITEOPT_NOCOMPRESS: nocompress = 1; break;
+      }
+    }
+
+    // writev queues one frame per element of a list, and all of them
+    // are sent with as few writes as the connection allows.
+    if (cmdIndex == CMD_WRITEV) {
+      if (Tcl_ListObjGetElements(interp, objv[objc - 1], &valuec, &valuev) != TCL_OK) {
+	return TCL_ERROR;
+      }
+    } else {
+      valuec = 1;
+      valuev = (Tcl_Obj**) &objv[objc - 1];
+    }
+    for (i = 0; i < valuec; i++) {
+      if (cmdIndex == CMD_WRITEJSON) {
+	// a first pass only measures, so the value can be written into its frame.
+	jw.interp = interp;
+	jw.buf = NULL;
+	jw.len = 0;
+	jw.depth = 0;
+	if (!tclwebsockets_json_write(&jw, objv[objc - 2], valuev[i])) {
+	  return TCL_ERROR;
+	}
+	continue;
+      }
+      if (write_protocol == LWS_WRITE_BINARY) {
+	Tcl_GetByteArrayFromObj (valuev[i], &len);
+      } else {
+	Tcl_GetStringFromObj (valuev[i], &len);
+      }
+      if (len == 0) {
+	Tcl_AppendResult(interp, "invalid value", NULL);
+	return TCL_ERROR;
+      }
+    }
+
+    // frames are sent when libwebsockets reports the socket writeable.
+    // Each is refused once the client has fallen too far behind, so
+    // writev stops at the first that does not fit and leaves the ones
+    // before it queued; the errorCode says how many those are.
+    for (i = 0; i < valuec; i++) {
+      if (cmdIndex == CMD_WRITEJSON) {
+	frame = tclwebsockets_new_frame(&userdata->pool, jw.len, LWS_WRITE_TEXT);
+	jw.buf = FRAME_PAYLOAD(frame);
+	jw.len = 0;
+	tclwebsockets_json_write(&jw, objv[objc - 2], valuev[i]);
+      } else {
+	// binary frames take the bytes as they are, without a trip through UTF-8.
+	if (write_protocol == LWS_WRITE_BINARY) {
+	  p = Tcl_GetByteArrayFromObj (valuev[i], &len);
+	} else {
+	  p = (unsigned char*) Tcl_GetStringFromObj (valuev[i], &len);
+	}
+	frame = tclwebsockets_new_frame(&userdata->pool, (size_t) len, write_protocol);
+	memcpy(FRAME_PAYLOAD(frame), p, len);
+      }
+      frame->nocompress = nocompress;
+
+      if (!tclwebsockets_queue_frame(userdata, session_data, frame)) {
+	char queued[TCL_INTEGER_SPACE];
+	tclwebsockets_pool_free(&userdata->pool, frame);
+	sprintf(queued, "%d", i);
+	Tcl_SetErrorCode(interp, "WEBSOCKETS", "QUEUEFULL", queued, NULL);
+	Tcl_AppendResult(interp, "output queue full for socket ", session_data->connection_cmd_name, NULL);
+	if (cmdIndex == CMD_WRITEV) {
+	  Tcl_AppendResult(interp, " after ", queued, " of the messages", NULL);
+	}
+	return TCL_ERROR;
+      }
+      if (cmdIndex == CMD_WRITEJSON) {
+	STATS_INCR(userdata, json_written);
+	STATS_ADD(userdata, json_write_ticks, (Tcl_WideInt) (tclwebsockets_ticks() - start_ticks));
+      }
+    }
+    break;
+  }
+
+  case CMD_JOIN:
+  case CMD_LEAVE: {
+    struct context_userdata_struct *userdata = (struct context_userdata_struct*) libwebsockets_get_user_data(session_data->context);
+    Tcl_HashEntry *entry;
+
+    if (objc != skip + 1) {
+      Tcl_WrongNumArgs (interp, skip, objv, "topic");
+      return TCL_ERROR;
+    }
+
+    if (cmdIndex == CMD_JOIN) {
+      tclwebsockets_join_topic(userdata, session_data, Tcl_GetString(objv[skip]));
+    } else {
+      entry = Tcl_FindHashEntry(&userdata->topics, Tcl_GetString(objv[skip]));
+      if (entry != NULL) {
+	tclwebsockets_leave_topic(session_data, (struct topic_struct*) Tcl_GetHashValue(entry));
+      }
+    }
+    break;
+  }
+
+  case CMD_PENDING: {
+    if (objc != skip) {
+      Tcl_WrongNumArgs (interp, skip, objv, NULL);
+      return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt) session_data->queued_bytes));
+    break;
+  }
+
+  case CMD_STATS: {
+    if (objc != skip) {
+      Tcl_WrongNumArgs (interp, skip, objv, NULL);
+      return TCL_ERROR;
+    }
+#if TCLWEBSOCKETS_STATS
+    Tcl_SetObjResult(interp, tclwebsockets_session_stats(session_data));
+    break;
+#else
+    Tcl_AppendResult(interp, "statistics were disabled at build time", NULL);
+    return TCL_ERROR;
+#endif
+  }
+
+  default: break;
+  }
+
+  return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_connectionCmd --
+ *
+ *    Allows the caller to invoke various commands against a client connection.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+tclwebsockets_connectionCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  struct websocket_session_struct *session_data = (struct websocket_session_struct*)cData;
+
+  // basic command line processing
+  if (objc < 2) {
+    Tcl_WrongNumArgs (interp, 1, objv, "command ?arg ...?");
+    return TCL_ERROR;
+  }
+
+  return tclwebsockets_connection_subcommand(session_data, interp, 2, objc, objv);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_connCmd --
+ *
+ *    websockets::conn command connection ?arg ...?
+ *
+ *    Same subcommands as the per-connection command, with the connection
+ *    given as an argument.  This works whether or not the listener
+ *    creates per-connection commands.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+tclwebsockets_connCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  struct interp_data_struct *interpdata = (struct interp_data_struct*) cData;
+  struct websocket_session_struct *session_data;
+
+  // basic command line processing
+  if (objc < 3) {
+    Tcl_WrongNumArgs (interp, 1, objv, "command connection ?arg ...?");
+    return TCL_ERROR;
+  }
+
+  session_data = tclwebsockets_get_connection(interp, interpdata, objv[2]);
+  if (session_data == NULL) {
+    return TCL_ERROR;
+  }
+
+  return tclwebsockets_connection_subcommand(session_data, interp, 3, objc, objv);
+}
+
+
+#if TCLWEBSOCKETS_NRE
+
+// Set by Tclwebsockets_Init if the Tcl we were loaded into has the
+// non-recursive engine, whatever we were compiled against.
+static int tclwebsockets_have_nre = 0;
+
+
+static int
+tclwebsockets_waitwritable_done(ClientData data[], Tcl_Interp *interp, int result)
+{
+  struct websocket_session_struct *session_data = (struct websocket_session_struct*) data[0];
+
+  // [yield] failed, outside of a coroutine; a deleted session has CORO_NONE.
+  if (result != TCL_OK && session_data->coro_state == CORO_WAIT_WRITABLE) {
+    session_data->coro_state = CORO_RUNNING;
+  }
+  if (result == TCL_OK) {
+    Tcl_ResetResult(interp);
+  }
+  return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_waitwritable --
+ *
+ *    $wsi waitwritable: park the coroutine of the connection until its
+ *    queue has drained below the low watermark, as seen from the next
+ *    writeable callback.
+ *
+ * Results:
+ *    A standard Tcl result, once the coroutine is resumed.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_waitwritable(struct websocket_session_struct *session_data, Tcl_Interp *interp)
+{
+  if (session_data->coro_state != CORO_RUNNING) {
+    Tcl_AppendResult(interp, "waitwritable must be called from the coroutine of the connection", NULL);
+    return TCL_ERROR;
+  }
+  session_data->coro_state = CORO_WAIT_WRITABLE;
+  libwebsocket_callback_on_writable(session_data->context, session_data->socket);
+
+  Tcl_NRAddCallback(interp, tclwebsockets_waitwritable_done, (ClientData) session_data, NULL, NULL, NULL);
+  return Tcl_NREvalObj(interp, Tcl_NewStringObj("::yield", -1), 0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_connectionNRCmd, tclwebsockets_connNRCmd --
+ *
+ *    The per-connection command and websockets::conn as run by the
+ *    non-recursive engine, which lets waitwritable yield.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_connectionNRCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  if (objc == 2 && strcmp(Tcl_GetString(objv[1]), "waitwritable") == 0) {
+    return tclwebsockets_waitwritable((struct websocket_session_struct*) cData, interp);
+  }
+  return tclwebsockets_connectionCmd(cData, interp, objc, objv);
+}
+
+static int
+tclwebsockets_connNRCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  if (objc == 3 && strcmp(Tcl_GetString(objv[1]), "waitwritable") == 0) {
+    struct websocket_session_struct *session_data = tclwebsockets_get_connection(interp, (struct interp_data_struct*) cData, objv[2]);
+    if (session_data == NULL) {
+      return TCL_ERROR;
+    }
+    return tclwebsockets_waitwritable(session_data, interp);
+  }
+  return tclwebsockets_connCmd(cData, interp, objc, objv);
+}
+
+#endif /* TCLWEBSOCKETS_NRE */
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_refresh_dispatch --
+ *
+ *    Resolve the lambdas registered in ::websockets::handlerMethods for
+ *    every event of one handler, and pin them in the dispatch table.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_refresh_dispatch(Tcl_Interp *interp, struct handler_dispatch_struct *dispatch, int epoch)
+{
+  Tcl_DString methodKey;
+  int reason, listc, numargs;
+  Tcl_Obj **listv;
+
+  Tcl_DStringInit(&methodKey);
+
+  for (reason = 0; reason < NUM_HANDLER_EVENTS; reason++) {
+    Tcl_Obj *handlerMethodList;
+    Tcl_Obj *lambda = NULL;
+
+    // build the name of the array element to find.
+    Tcl_DStringSetLength(&methodKey, 0);
+    Tcl_DStringAppend(&methodKey, dispatch->handler_name, -1);
+    Tcl_DStringAppend(&methodKey, ":", 1);
+    Tcl_DStringAppend(&methodKey, handler_event_names[reason], -1);
+
+    // Should be list of 2 elements: numargs lambda
+    handlerMethodList = Tcl_GetVar2Ex(interp, "::websockets::handlerMethods", Tcl_DStringValue(&methodKey), TCL_GLOBAL_ONLY);
+    if (handlerMethodList != NULL &&
+	Tcl_ListObjGetElements(NULL, handlerMethodList, &listc, &listv) == TCL_OK && listc == 2 &&
+	Tcl_GetIntFromObj(NULL, listv[0], &numargs) == TCL_OK) {
+      lambda = listv[1];
+      Tcl_IncrRefCount(lambda);
+    } else {
+      // no handler defined for this event method, or an invalid definition.
+      numargs = 0;
+    }
+
+    if (dispatch->lambdas[reason] != NULL) {
+      Tcl_DecrRefCount(dispatch->lambdas[reason]);
+    }
+    dispatch->lambdas[reason] = lambda;
+    dispatch->numargs[reason] = (numargs > MAX_HANDLER_ARGS ? MAX_HANDLER_ARGS : numargs);
+  }
+
+  // Collect the names of the statevars from the handler registry.
+  {
+    Tcl_Obj *handlerRegistryList = Tcl_GetVar2Ex(interp, "::websockets::handlerRegistry", dispatch->handler_name, TCL_GLOBAL_ONLY);
+    Tcl_Obj *statevars = NULL;
+    Tcl_Obj *batch = NULL;
+    int i, streaming = 0, json = 0, coroutine = 0;
+
+    for (i = 0; i < dispatch->num_statevars; i++) {
+      Tcl_DecrRefCount(dispatch->statevar_names[i]);
+    }
+    if (dispatch->statevar_names != NULL) {
+      ckfree((char*) dispatch->statevar_names);
+      dispatch->statevar_names = NULL;
+    }
+    dispatch->num_statevars = 0;
+
+    if (handlerRegistryList != NULL && Tcl_ListObjGetElements(NULL, handlerRegistryList, &listc, &listv) == TCL_OK) {
+      // walk through the key-value list and save the values of the "statevars" and "streaming" keys.
+      for (i = 0; i + 1 < listc; i += 2) {
+	if (strcmp(Tcl_GetString(listv[i]), "statevars") == 0) {
+	  statevars = listv[i+1];
+	} else if (strcmp(Tcl_GetString(listv[i]), "streaming") == 0) {
+	  Tcl_GetBooleanFromObj(NULL, listv[i+1], &streaming);
+	} else if (strcmp(Tcl_GetString(listv[i]), "batch") == 0) {
+	  batch = listv[i+1];
+	} else if (strcmp(Tcl_GetString(listv[i]), "format") == 0) {
+	  json = (strcmp(Tcl_GetString(listv[i+1]), "json") == 0);
+	} else if (strcmp(Tcl_GetString(listv[i]), "coroutine") == 0) {
+	  Tcl_GetBooleanFromObj(NULL, listv[i+1], &coroutine);
+	}
+      }
+    }
+    dispatch->streaming = streaming;
+    dispatch->json = json;
+    dispatch->coroutine = coroutine;
+
+    // -batch {maxcount N maxdelay-us D}, already validated by websockets::handler.
+    dispatch->batch_maxcount = 0;
+    dispatch->batch_maxdelay_ns = 0;
+    if (batch != NULL && Tcl_ListObjGetElements(NULL, batch, &listc, &listv) == TCL_OK) {
+      for (i = 0; i + 1 < listc; i += 2) {
+	Tcl_WideInt value;
+	if (Tcl_GetWideIntFromObj(NULL, listv[i+1], &value) != TCL_OK) {
+	  continue;
+	}
+	if (strcmp(Tcl_GetString(listv[i]), "maxcount") == 0) {
+	  dispatch->batch_maxcount = (int) value;
+	} else if (strcmp(Tcl_GetString(listv[i]), "maxdelay-us") == 0) {
+	  dispatch->batch_maxdelay_ns = value * 1000;
+	}
+      }
+    }
+
+    if (statevars != NULL && Tcl_ListObjGetElements(NULL, statevars, &listc, &listv) == TCL_OK && listc > 0) {
+      dispatch->statevar_names = (Tcl_Obj**) ckalloc(sizeof(Tcl_Obj*) * listc);
+      for (i = 0; i < listc; i++) {
+	dispatch->statevar_names[i] = listv[i];
+	Tcl_IncrRefCount(listv[i]);
+      }
+      dispatch->num_statevars = listc;
+    }
+  }
+
+  Tcl_DStringFree(&methodKey);
+  dispatch->epoch = epoch;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_free_dispatch --
+ *
+ *    Release the lambdas pinned by the dispatch tables of a context.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_free_dispatch(struct handler_dispatch_struct *dispatch, int num_protocols)
+{
+  int q, reason, i;
+
+  for (q = 0; q < num_protocols; q++) {
+    for (reason = 0; reason < NUM_HANDLER_EVENTS; reason++) {
+      if (dispatch[q].lambdas[reason] != NULL) {
+	Tcl_DecrRefCount(dispatch[q].lambdas[reason]);
+      }
+    }
+    for (i = 0; i < dispatch[q].num_statevars; i++) {
+      Tcl_DecrRefCount(dispatch[q].statevar_names[i]);
+    }
+    if (dispatch[q].statevar_names != NULL) {
+      ckfree((char*) dispatch[q].statevar_names);
+    }
+  }
+  ckfree((char*) dispatch);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_eval_handler --
+ *
+ *    Evaluate a command on behalf of a handler event of a session: with
+ *    the session current (for its statevars) and closes deferred, and
+ *    with the time it takes counted under the event.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_eval_handler(struct context_userdata_struct *context_data, struct websocket_session_struct *session_data,
+			   int event, int objc, Tcl_Obj *objv[])
+{
+  struct websocket_session_struct *outer_session = context_data->interpdata->current_session;
+  int argi;
+#if TCLWEBSOCKETS_STATS
+  Tcl_WideUInt start_ticks;
+#endif
+
+  for (argi = 0; argi < objc; argi++) {
+    Tcl_IncrRefCount(objv[argi]);
+  }
+
+#if TCLWEBSOCKETS_STATS
+  start_ticks = tclwebsockets_ticks();
+#endif
+
+  // the lambda loads and saves the statevars of the current session.
+  context_data->interpdata->current_session = session_data;
+  context_data->callback_depth++;
+  if (Tcl_EvalObjv(session_data->interp, objc, objv, TCL_EVAL_GLOBAL) == TCL_ERROR) {
+    Tcl_AddErrorInfo(session_data->interp, "\n    (websocket handler event)");
+    Tcl_BackgroundError(session_data->interp);
+    STATS_INCR(context_data, handler_errors);
+  }
+  context_data->callback_depth--;
+  context_data->interpdata->current_session = outer_session;
+
+#if TCLWEBSOCKETS_STATS
+  {
+    Tcl_WideUInt ticks = tclwebsockets_ticks() - start_ticks;
+    int bucket = 0;
+    while (bucket < HANDLER_TIME_BUCKETS - 1 && (ticks >> (bucket + 1)) != 0) {
+      bucket++;
+    }
+    context_data->stats.events[event]++;
+    context_data->stats.handler_ticks += ticks;
+    context_data->stats.handler_time[bucket]++;
+    session_data->stats.events++;
+    session_data->stats.handler_ticks += ticks;
+  }
+#endif
+
+  for (argi = 0; argi < objc; argi++) {
+    Tcl_DecrRefCount(objv[argi]);
+  }
+  Tcl_ResetResult(session_data->interp);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_handler_args --
+ *
+ *    Append the arguments of a handler lambda to objv: ?wsi? ?data?
+ *    ?flags?, as many as the user declared.  dataObj and flagsObj may
+ *    be NULL.
+ *
+ * Results:
+ *    The new number of elements in objv.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_handler_args(struct websocket_session_struct *session_data, int event, Tcl_Obj *dataObj, Tcl_Obj *flagsObj,
+			   int objc, Tcl_Obj *objv[])
+{
+  int argi, numargs = session_data->dispatch->numargs[event];
+
+  for (argi = 0; argi < numargs; argi++) {
+    switch (argi) {
+    case 0: objv[objc++] = session_data->connection_cmd_obj; break;
+    case 1: objv[objc++] = (dataObj != NULL ? dataObj : Tcl_NewObj()); break;
+    case 2: objv[objc++] = (flagsObj != NULL ? flagsObj : Tcl_NewObj()); break;
+    default: objv[objc++] = Tcl_NewObj(); break;
+    }
+  }
+  return objc;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_run_handler --
+ *
+ *    Invoke the lambda of a handler event as: apply lambda ?wsi? ?data?
+ *    ?flags?, passing as many arguments as the user declared.  The
+ *    lambda object keeps its compiled body between invocations.
+ *    dataObj and flagsObj may be NULL.  Objects without references
+ *    are freed afterwards, whether the lambda took them or not.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_run_handler(struct context_userdata_struct *context_data, struct websocket_session_struct *session_data,
+			  int event, Tcl_Obj *lambda, Tcl_Obj *dataObj, Tcl_Obj *flagsObj)
+{
+  Tcl_Obj *objv[2 + MAX_HANDLER_ARGS];
+  int objc = 0;
+
+  if (dataObj != NULL) {
+    Tcl_IncrRefCount(dataObj);
+  }
+  if (flagsObj != NULL) {
+    Tcl_IncrRefCount(flagsObj);
+  }
+
+  objv[objc++] = context_data->applyObj;
+  objv[objc++] = lambda;
+  objc = tclwebsockets_handler_args(session_data, event, dataObj, flagsObj, objc, objv);
+  tclwebsockets_eval_handler(context_data, session_data, event, objc, objv);
+
+  if (dataObj != NULL) {
+    Tcl_DecrRefCount(dataObj);
+  }
+  if (flagsObj != NULL) {
+    Tcl_DecrRefCount(flagsObj);
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_message_obj --
+ *
+ *    Make the value a complete incoming message is delivered as: a
+ *    byte array if it is binary, else a string, or its parsed value
+ *    with -format json.
+ *
+ * Results:
+ *    The object, or NULL if the JSON was invalid and the connection is
+ *    being closed.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_Obj *
+tclwebsockets_message_obj(struct context_userdata_struct *context_data, struct websocket_session_struct *session_data,
+			  unsigned char *data, size_t len)
+{
+  if (session_data->rx_binary) {
+    return Tcl_NewByteArrayObj(data, (int) len);
+  } else if (session_data->dispatch->json) {
+    return tclwebsockets_json_message(context_data, session_data, (char*) data, len);
+  }
+  return Tcl_NewStringObj((char*) data, (int) len);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_run_coroutine --
+ *
+ *    Start or resume the coroutine of a -coroutine handler with the
+ *    given command, then hand it the messages that arrived while it was
+ *    busy, one for each [yield], until it waits for more or for the
+ *    socket.  A coroutine that returned, or failed, has finished the
+ *    conversation, and its connection is closed.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_run_coroutine(struct context_userdata_struct *context_data, struct websocket_session_struct *session_data,
+			    int event, int objc, Tcl_Obj *objv[])
+{
+  Tcl_CmdInfo info;
+  Tcl_Obj *resumeObjv[2];
+  Tcl_Obj **listv;
+  int listc;
+
+  session_data->coro_state = CORO_RUNNING;
+  tclwebsockets_eval_handler(context_data, session_data, event, objc, objv);
+
+  while (session_data->coroutine != NULL && Tcl_GetCommandInfo(session_data->interp, Tcl_GetString(session_data->coroutine), &info)) {
+    if (session_data->coro_state != CORO_RUNNING) {
+      // parked in $wsi waitwritable.
+      return;
+    }
+    session_data->coro_state = CORO_WAIT_MESSAGE;
+    if (session_data->coro_pending == NULL) {
+      return;
+    }
+
+    Tcl_ListObjGetElements(NULL, session_data->coro_pending, &listc, &listv);
+    resumeObjv[0] = session_data->coroutine;
+    resumeObjv[1] = listv[0];
+    Tcl_IncrRefCount(resumeObjv[1]);
+    if (listc > 1) {
+      Tcl_ListObjReplace(NULL, session_data->coro_pending, 0, 1, 0, NULL);
+    } else {
+      Tcl_DecrRefCount(session_data->coro_pending);
+      session_data->coro_pending = NULL;
+      tclwebsockets_update_rx(session_data);
+    }
+
+    session_data->coro_state = CORO_RUNNING;
+    tclwebsockets_eval_handler(context_data, session_data, LWS_CALLBACK_RECEIVE, 2, resumeObjv);
+    Tcl_DecrRefCount(resumeObjv[1]);
+  }
+
+  session_data->coro_state = CORO_NONE;
+  if (session_data->coroutine != NULL) {
+    Tcl_DecrRefCount(session_data->coroutine);
+    session_data->coroutine = NULL;
+  }
+  if (session_data->coro_pending != NULL) {
+    Tcl_DecrRefCount(session_data->coro_pending);
+    session_data->coro_pending = NULL;
+  }
+  tclwebsockets_defer_close(context_data, session_data, LWS_CLOSE_STATUS_NORMAL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_start_coroutine --
+ *
+ *    Run the established (or client-established) lambda of a
+ *    -coroutine handler as the coroutine of the session:
+ *    coroutine ::websockets::coroutine::websocketN apply lambda ?wsi?
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_start_coroutine(struct context_userdata_struct *context_data, struct websocket_session_struct *session_data,
+			      int event, Tcl_Obj *lambda)
+{
+  Tcl_Obj *objv[4 + MAX_HANDLER_ARGS];
+  int objc = 0;
+
+  session_data->coroutine = Tcl_NewStringObj("::websockets::coroutine::", -1);
+  Tcl_AppendToObj(session_data->coroutine, session_data->connection_cmd_name, -1);
+  Tcl_IncrRefCount(session_data->coroutine);
+
+  objv[objc++] = Tcl_NewStringObj("::coroutine", -1);
+  objv[objc++] = session_data->coroutine;
+  objv[objc++] = context_data->applyObj;
+  objv[objc++] = lambda;
+  objc = tclwebsockets_handler_args(session_data, event, NULL, NULL, objc, objv);
+  tclwebsockets_run_coroutine(context_data, session_data, event, objc, objv);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_coroutine_message --
+ *
+ *    Deliver a message to the coroutine of a session: as the result of
+ *    its [yield] if it is waiting for one, else once it is.  Meanwhile
+ *    the connection is not read from, so that no more than what
+ *    libwebsockets has already read piles up.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_coroutine_message(struct context_userdata_struct *context_data, struct websocket_session_struct *session_data,
+				int event, Tcl_Obj *messageObj)
+{
+  Tcl_Obj *objv[2];
+
+  if (session_data->coro_state != CORO_WAIT_MESSAGE) {
+    if (session_data->coro_pending == NULL) {
+      session_data->coro_pending = Tcl_NewListObj(0, NULL);
+      Tcl_IncrRefCount(session_data->coro_pending);
+    }
+    Tcl_ListObjAppendElement(NULL, session_data->coro_pending, messageObj);
+    tclwebsockets_update_rx(session_data);
+    return;
+  }
+
+  objv[0] = session_data->coroutine;
+  objv[1] = messageObj;
+  tclwebsockets_run_coroutine(context_data, session_data, event, 2, objv);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_run_batch --
+ *
+ *    Deliver the messages collected for a session to its receive-batch
+ *    event, and take it off the list of pending batches.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_run_batch(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data)
+{
+  Tcl_Obj *batch = session_data->batch;
+  Tcl_Obj *lambda;
+
+  tclwebsockets_unlink_batch(userdata, session_data);
+  session_data->batch = NULL;
+
+  lambda = session_data->dispatch->lambdas[EVENT_RECEIVE_BATCH];
+  if (lambda == NULL || session_data->socket == NULL) {
+    Tcl_DecrRefCount(batch);
+    return;
+  }
+
+  tclwebsockets_run_handler(userdata, session_data, EVENT_RECEIVE_BATCH, lambda, batch, NULL);
+  Tcl_DecrRefCount(batch);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_batch_message --
+ *
+ *    Add a received message to the batch of a session, delivering the
+ *    batch right away once it holds -batch maxcount messages.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_batch_message(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data, Tcl_Obj *messageObj)
+{
+  struct handler_dispatch_struct *dispatch = session_data->dispatch;
+  int count;
+
+  if (session_data->batch == NULL) {
+    session_data->batch = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(session_data->batch);
+    session_data->batch_deadline = tclwebsockets_now_ns() + dispatch->batch_maxdelay_ns;
+    session_data->next_batch = userdata->batches;
+    userdata->batches = session_data;
+  }
+
+  Tcl_ListObjAppendElement(NULL, session_data->batch, messageObj);
+  Tcl_ListObjLength(NULL, session_data->batch, &count);
+  if (count >= dispatch->batch_maxcount) {
+    tclwebsockets_run_batch(userdata, session_data);
+  }
+}
+
+
+static void tclwebsockets_batch_timerProc(ClientData cData);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_flush_batches --
+ *
+ *    Deliver the batches that are due: all of them if force is set,
+ *    else those without a maxdelay-us and those whose delay has
+ *    expired.  A timer is set for the earliest of the rest.
+ *
+ *    The sessions still to be looked at are kept in userdata->flushing
+ *    rather than in a local list: a receive-batch event that enters the
+ *    event loop may close one of them, and tclwebsockets_free_session()
+ *    then takes it off that list too.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_flush_batches(struct context_userdata_struct *userdata, int force)
+{
+  struct websocket_session_struct *session_data;
+  Tcl_WideInt now, next_deadline = 0;
+
+  if (userdata->batches == NULL) {
+    return;
+  }
+
+  // move the list over, and put back what is not due yet.
+  now = tclwebsockets_now_ns();
+  while ((session_data = userdata->batches) != NULL) {
+    userdata->batches = session_data->next_batch;
+    session_data->next_batch = userdata->flushing;
+    userdata->flushing = session_data;
+  }
+  while ((session_data = userdata->flushing) != NULL) {
+    userdata->flushing = session_data->next_batch;
+    session_data->next_batch = NULL;
+    if (force || session_data->batch_deadline <= now) {
+      tclwebsockets_run_batch(userdata, session_data);
+    } else {
+      session_data->next_batch = userdata->batches;
+      userdata->batches = session_data;
+    }
+  }
+
+  // handlers may have started batches of their own meanwhile.
+  for (session_data = userdata->batches; session_data != NULL; session_data = session_data->next_batch) {
+    if (next_deadline == 0 || session_data->batch_deadline < next_deadline) {
+      next_deadline = session_data->batch_deadline;
+    }
+  }
+
+  if (userdata->batch_timer != NULL) {
+    Tcl_DeleteTimerHandler(userdata->batch_timer);
+    userdata->batch_timer = NULL;
+  }
+  if (userdata->batches != NULL && next_deadline != 0) {
+    // Tcl timers have millisecond resolution; round up.
+    int ms = (int) ((next_deadline - now + 999999) / 1000000);
+    userdata->batch_timer = Tcl_CreateTimerHandler(ms, tclwebsockets_batch_timerProc, userdata);
+  }
+}
+
+static void
+tclwebsockets_batch_timerProc(ClientData cData)
+{
+  struct context_userdata_struct *userdata = (struct context_userdata_struct*) cData;
+
+  userdata->batch_timer = NULL;
+  tclwebsockets_flush_batches(userdata, 0);
+  tclwebsockets_flush_pending_closes(userdata);
+}
+
+
+static void tclwebsockets_wheel_timerProc(ClientData cData);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_wheel_schedule --
+ *
+ *    Link a session into the slot of the tick when its next ping is
+ *    due or it times out, whichever comes first, and make sure the
+ *    wheel is turning.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_wheel_schedule(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data)
+{
+  struct timing_wheel *wheel = userdata->wheel;
+  Tcl_WideInt due = 0, tick;
+
+  tclwebsockets_wheel_unlink(userdata, session_data);
+
+  if (userdata->idle_timeout_ns > 0) {
+    due = session_data->last_message + userdata->idle_timeout_ns;
+  }
+  if (userdata->ping_interval_ns > 0) {
+    Tcl_WideInt ping_due = (session_data->last_seen > session_data->last_ping ? session_data->last_seen : session_data->last_ping) + userdata->ping_interval_ns;
+    if (due == 0 || ping_due < due) {
+      due = ping_due;
+    }
+  }
+
+  // rounded up, so that the session is never looked at early.
+  tick = (due + wheel->tick_ns - 1) / wheel->tick_ns;
+  if (tick < wheel->current) {
+    tick = wheel->current;
+  }
+  session_data->wheel_due = tick;
+  tclwebsockets_wheel_append(&wheel->slots[tick & (WHEEL_SLOTS - 1)], &session_data->wheel_link);
+  wheel->count++;
+
+  if (wheel->timer == NULL) {
+    wheel->timer = Tcl_CreateTimerHandler((int) (wheel->tick_ns / 1000000), tclwebsockets_wheel_timerProc, (ClientData) userdata);
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_wheel_expire --
+ *
+ *    Called for a session whose tick has come: close it if it has been
+ *    idle too long, after invoking its timeout event, else send a ping
+ *    if it has been silent for the ping interval.  Sessions that are
+ *    kept are scheduled again.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_wheel_expire(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data, Tcl_WideInt now)
+{
+  if (session_data->close_requested) {
+    return;
+  }
+
+  if (userdata->idle_timeout_ns > 0 && now - session_data->last_message >= userdata->idle_timeout_ns) {
+    struct handler_dispatch_struct *dispatch = session_data->dispatch;
+
+    STATS_INCR(userdata, timeouts);
+    if (dispatch->epoch != userdata->interpdata->handlerEpoch) {
+      tclwebsockets_refresh_dispatch(session_data->interp, dispatch, userdata->interpdata->handlerEpoch);
+    }
+    if (dispatch->lambdas[EVENT_TIMEOUT] != NULL) {
+      tclwebsockets_run_handler(userdata, session_data, EVENT_TIMEOUT, dispatch->lambdas[EVENT_TIMEOUT], NULL, NULL);
+    }
+    tclwebsockets_defer_close(userdata, session_data, LWS_CLOSE_STATUS_GOINGAWAY);
+    return;
+  }
+
+  // the payload is the time it was sent, which the pong echoes.
+  if (userdata->ping_interval_ns > 0 &&
+      now - (session_data->last_seen > session_data->last_ping ? session_data->last_seen : session_data->last_ping) >= userdata->ping_interval_ns) {
+    struct outbound_frame *frame = tclwebsockets_new_frame(&userdata->pool, 8, LWS_WRITE_PING);
+    int i;
+    for (i = 0; i < 8; i++) {
+      FRAME_PAYLOAD(frame)[i] = (unsigned char) ((Tcl_WideUInt) now >> (56 - 8 * i));
+    }
+    tclwebsockets_enqueue_frame(userdata, session_data, frame);
+    session_data->last_ping = now;
+    STATS_INCR(userdata, pings);
+  }
+
+  tclwebsockets_wheel_schedule(userdata, session_data);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_wheel_advance --
+ *
+ *    Process the slots of the ticks that have passed.  Sessions that are
+ *    due are moved to a list of their own first, since handlers and
+ *    closes may unlink others.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_wheel_advance(struct context_userdata_struct *userdata)
+{
+  struct timing_wheel *wheel = userdata->wheel;
+  struct wheel_link expired, *link, *next;
+  Tcl_WideInt now, now_tick;
+  int rounds;
+
+  if (wheel == NULL || wheel->count == 0) {
+    return;
+  }
+  now = tclwebsockets_now_ns();
+  now_tick = now / wheel->tick_ns;
+
+  // one pass over every slot finds everything, however late we are.
+  expired.prev = expired.next = &expired;
+  for (rounds = 0; wheel->current <= now_tick && rounds < WHEEL_SLOTS; rounds++, wheel->current++) {
+    struct wheel_link *slot = &wheel->slots[wheel->current & (WHEEL_SLOTS - 1)];
+    for (link = slot->next; link != slot; link = next) {
+      next = link->next;
+      if (SESSION_FROM_WHEEL(link)->wheel_due <= now_tick) {
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+	tclwebsockets_wheel_append(&expired, link);
+      }
+    }
+  }
+  if (wheel->current <= now_tick) {
+    wheel->current = now_tick + 1;
+  }
+
+  while (expired.next != &expired) {
+    struct websocket_session_struct *session_data = SESSION_FROM_WHEEL(expired.next);
+    tclwebsockets_wheel_unlink(userdata, session_data);
+    tclwebsockets_wheel_expire(userdata, session_data, now);
+  }
+}
+
+
+static void
+tclwebsockets_wheel_timerProc(ClientData cData)
+{
+  struct context_userdata_struct *userdata = (struct context_userdata_struct*) cData;
+  struct timing_wheel *wheel = userdata->wheel;
+
+  wheel->timer = NULL;
+  tclwebsockets_wheel_advance(userdata);
+  tclwebsockets_flush_pending_closes(userdata);
+  if (wheel->count > 0 && wheel->timer == NULL) {
+    wheel->timer = Tcl_CreateTimerHandler((int) (wheel->tick_ns / 1000000), tclwebsockets_wheel_timerProc, (ClientData) userdata);
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_wheel_start --
+ *
+ *    Start keeping time for a session once its connection is
+ *    established.  With -pinginterval, the kernel is also told to give
+ *    up on the socket when sent data (such as a ping) stays
+ *    unacknowledged that long, so that dead peers are noticed without
+ *    waiting for the retransmissions to run out.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_wheel_start(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data)
+{
+  Tcl_WideInt now = tclwebsockets_now_ns();
+
+  session_data->last_message = session_data->last_seen = session_data->last_ping = now;
+#ifdef TCP_USER_TIMEOUT
+  if (userdata->ping_interval_ns > 0) {
+    unsigned int timeout_ms = (unsigned int) (userdata->ping_interval_ns / 1000000);
+    setsockopt(libwebsocket_get_socket_fd(session_data->socket), IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout_ms, sizeof(timeout_ms));
+  }
+#endif
+  tclwebsockets_wheel_schedule(userdata, session_data);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_end_service --
+ *
+ *    Called when libwebsockets has finished servicing a context:
+ *    deliver the batches that are due, turn the timing wheel (for
+ *    listeners serviced without the Tcl event loop) and carry out
+ *    deferred closes.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_end_service(struct context_userdata_struct *userdata)
+{
+  tclwebsockets_flush_batches(userdata, 0);
+  tclwebsockets_wheel_advance(userdata);
+  tclwebsockets_flush_pending_closes(userdata);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_fileProc --
+ *
+ *    Tcl file handler invoked by the notifier when a socket that
+ *    libwebsockets is interested in becomes ready.  Only that one
+ *    socket is serviced, so nothing blocks and nothing is polled.
+ *
+ * Results:
+ *    None.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_fileProc(ClientData cData, int mask)
+{
+  struct pollfd_entry *entry = (struct pollfd_entry*) cData;
+  struct context_userdata_struct *userdata = entry->userdata;
+  struct pollfd pfd;
+
+  pfd.fd = entry->fd;
+  pfd.events = entry->events;
+  pfd.revents = 0;
+  if (mask & TCL_READABLE) pfd.revents |= POLLIN;
+  if (mask & TCL_WRITABLE) pfd.revents |= POLLOUT;
+  if (mask & TCL_EXCEPTION) pfd.revents |= POLLERR;
+
+  // the entry may be freed by a DEL_POLL_FD callback while servicing.
+  libwebsocket_service_fd(userdata->context, &pfd);
+  tclwebsockets_end_service(userdata);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_update_filehandler --
+ *
+ *    (Re)register the Tcl file handler for a socket so that its mask
+ *    matches the poll events currently wanted by libwebsockets.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_update_filehandler(struct pollfd_entry *entry)
+{
+  int mask = 0;
+
+  if (entry->events & POLLIN) mask |= TCL_READABLE;
+  if (entry->events & POLLOUT) mask |= TCL_WRITABLE;
+
+  Tcl_CreateFileHandler(entry->fd, mask, tclwebsockets_fileProc, (ClientData) entry);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_pollfd_callback --
+ *
+ *    Handles the external poll() management callbacks from libwebsockets
+ *    by mirroring its set of sockets into Tcl file handlers.
+ *
+ * Results:
+ *    0 on success, -1 if memory could not be allocated.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_pollfd_callback(struct context_userdata_struct *userdata,
+			      enum libwebsocket_callback_reasons reason,
+			      int fd, int events)
+{
+  Tcl_HashEntry *hashEntry;
+  struct pollfd_entry *entry;
+  int isNew;
+
+  // the first socket added while the context is being created is the
+  // listening socket.
+  if (userdata != NULL && userdata->context == NULL && reason == LWS_CALLBACK_ADD_POLL_FD && userdata->listen_fd < 0) {
+    userdata->listen_fd = fd;
+  }
+
+  if (userdata == NULL || !userdata->use_eventloop) {
+    // libwebsocket_service() is polling on its own.
+    return 0;
+  }
+
+  switch (reason) {
+  case LWS_CALLBACK_ADD_POLL_FD: {
+    hashEntry = Tcl_CreateHashEntry(&userdata->pollfds, (char*) (long) fd, &isNew);
+    if (isNew) {
+      entry = (struct pollfd_entry*) ckalloc(sizeof(struct pollfd_entry));
+      if (entry == NULL) {
+	Tcl_DeleteHashEntry(hashEntry);
+	return -1;
+      }
+      entry->userdata = userdata;
+      entry->fd = fd;
+      Tcl_SetHashValue(hashEntry, entry);
+    } else {
+      entry = (struct pollfd_entry*) Tcl_GetHashValue(hashEntry);
+    }
+    entry->events = POLLIN;
+    tclwebsockets_update_filehandler(entry);
+    break;
+  }
+  case LWS_CALLBACK_DEL_POLL_FD: {
+    hashEntry = Tcl_FindHashEntry(&userdata->pollfds, (char*) (long) fd);
+    if (hashEntry != NULL) {
+      Tcl_DeleteFileHandler(fd);
+      ckfree((char*) Tcl_GetHashValue(hashEntry));
+      Tcl_DeleteHashEntry(hashEntry);
+    }
+    break;
+  }
+  case LWS_CALLBACK_SET_MODE_POLL_FD:
+  case LWS_CALLBACK_CLEAR_MODE_POLL_FD: {
+    hashEntry = Tcl_FindHashEntry(&userdata->pollfds, (char*) (long) fd);
+    if (hashEntry == NULL) {
+      break;
+    }
+    entry = (struct pollfd_entry*) Tcl_GetHashValue(hashEntry);
+    if (reason == LWS_CALLBACK_SET_MODE_POLL_FD) {
+      entry->events |= events;
+    } else {
+      entry->events &= ~events;
+    }
+    tclwebsockets_update_filehandler(entry);
+    break;
+  }
+  default: break;
+  }
+
+  return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_free_pollfds --
+ *
+ *    Remove any file handlers still registered for a context that
+ *    is being destroyed.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_free_pollfds(struct context_userdata_struct *userdata)
+{
+  Tcl_HashEntry *hashEntry;
+  Tcl_HashSearch search;
+
+  if (!userdata->use_eventloop) {
+    return;
+  }
+
+  for (hashEntry = Tcl_FirstHashEntry(&userdata->pollfds, &search); hashEntry != NULL; hashEntry = Tcl_NextHashEntry(&search)) {
+    struct pollfd_entry *entry = (struct pollfd_entry*) Tcl_GetHashValue(hashEntry);
+    Tcl_DeleteFileHandler(entry->fd);
+    ckfree((char*) entry);
+  }
+  Tcl_DeleteHashTable(&userdata->pollfds);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_replace_listener --
+ *
+ *    Put another socket in place of the listening socket of a context,
+ *    under the same fd number, so that libwebsockets goes on polling
+ *    and accepting from it without knowing.  The socket is closed under
+ *    its own number.
+ *
+ * Results:
+ *    A standard Tcl result.  On failure the socket is left open.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_replace_listener(Tcl_Interp *interp, struct context_userdata_struct *userdata, int fd)
+{
+  struct pollfd_entry *entry = NULL;
+  int flags, result = TCL_OK;
+
+  // the notifier may be watching the open file rather than the number,
+  // so it is told before and after.
+  if (userdata->use_eventloop) {
+    Tcl_HashEntry *hashEntry = Tcl_FindHashEntry(&userdata->pollfds, (char*) (long) userdata->listen_fd);
+    if (hashEntry != NULL) {
+      entry = (struct pollfd_entry*) Tcl_GetHashValue(hashEntry);
+      Tcl_DeleteFileHandler(userdata->listen_fd);
+    }
+  }
+
+  // keep the blocking mode libwebsockets chose, and take over its fd number.
+  flags = fcntl(userdata->listen_fd, F_GETFL);
+  if (flags != -1) {
+    fcntl(fd, F_SETFL, flags);
+  }
+  if (dup2(fd, userdata->listen_fd) < 0) {
+    Tcl_AppendResult(interp, "unable to replace listening socket: ", Tcl_ErrnoMsg(errno), NULL);
+    result = TCL_ERROR;
+  } else {
+    close(fd);
+  }
+
+  if (entry != NULL) {
+    tclwebsockets_update_filehandler(entry);
+  }
+  return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_stop_accepting --
+ *
+ *    Put the read end of a pipe in place of the listening socket of a
+ *    context: libwebsockets goes on polling it, but nothing ever
+ *    arrives.  A process that inherited the socket keeps accepting from
+ *    it; otherwise it is closed and new connections are refused.
+ *
+ * Results:
+ *    A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_stop_accepting(Tcl_Interp *interp, struct context_userdata_struct *userdata)
+{
+  int fds[2];
+
+  if (userdata->listen_fd < 0 || userdata->drain_fd >= 0) {
+    return TCL_OK;
+  }
+  if (pipe(fds) != 0) {
+    Tcl_AppendResult(interp, "unable to create pipe: ", Tcl_ErrnoMsg(errno), NULL);
+    return TCL_ERROR;
+  }
+  if (tclwebsockets_replace_listener(interp, userdata, fds[0]) != TCL_OK) {
+    close(fds[0]);
+    close(fds[1]);
+    return TCL_ERROR;
+  }
+  userdata->drain_fd = fds[1];
+  return TCL_OK;
+}
+
+
+static void
+tclwebsockets_drain_timerProc(ClientData cData)
+{
+  *(int*) cData = 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_drain --
+ *
+ *    Stop accepting connections and close the open ones with "going
+ *    away", each once its queue has been written, servicing the context
+ *    until they are gone or the timeout has passed.  Those still open
+ *    then are dropped without waiting for the close handshake.
+ *
+ * Results:
+ *    A standard Tcl result; a dictionary with the counts of closed and
+ *    forced connections on success.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_drain(Tcl_Interp *interp, struct context_userdata_struct *userdata, int timeout_ms)
+{
+  struct websocket_session_struct *session_data, *next;
+  Tcl_Obj *resultObj;
+  int total = 0, forced = 0, expired = 0;
+
+  // the servicing below cannot be nested in that of libwebsockets.
+  if (userdata->callback_depth > 0) {
+    Tcl_AppendResult(interp, "drain cannot be called from a handler", NULL);
+    return TCL_ERROR;
+  }
+  if (tclwebsockets_stop_accepting(interp, userdata) != TCL_OK) {
+    return TCL_ERROR;
+  }
+  userdata->draining = 1;
+
+  // those with frames still queued are closed from the writeable callback.
+  for (session_data = userdata->sessions; session_data != NULL; session_data = session_data->next_session) {
+    total++;
+    session_data->close_when_flushed = 1;
+    if (session_data->queue_head == NULL) {
+      tclwebsockets_defer_close(userdata, session_data, LWS_CLOSE_STATUS_GOINGAWAY);
+    }
+  }
+  tclwebsockets_flush_pending_closes(userdata);
+
+  if (userdata->use_eventloop) {
+    Tcl_TimerToken timer = Tcl_CreateTimerHandler(timeout_ms, tclwebsockets_drain_timerProc, (ClientData) &expired);
+    while (userdata->sessions != NULL && !expired) {
+      Tcl_DoOneEvent(TCL_FILE_EVENTS | TCL_TIMER_EVENTS);
+    }
+    if (!expired) {
+      Tcl_DeleteTimerHandler(timer);
+    }
+  } else {
+    Tcl_WideInt deadline = tclwebsockets_now_ns() + (Tcl_WideInt) timeout_ms * 1000000;
+    while (userdata->sessions != NULL && tclwebsockets_now_ns() < deadline) {
+      libwebsocket_service(userdata->context, 50);
+      tclwebsockets_end_service(userdata);
+    }
+  }
+
+  // the rest are dropped; the closed handlers run with the depth raised,
+  // so any close they ask for is deferred and the list stays intact.
+  // Handshakes completed meanwhile are not counted.
+  for (session_data = userdata->sessions; session_data != NULL; session_data = next) {
+    next = session_data->next_session;
+    forced += session_data->close_when_flushed;
+    libwebsocket_close_and_free_session(userdata->context, session_data->socket, LWS_CLOSE_STATUS_NOSTATUS);
+  }
+  tclwebsockets_flush_pending_closes(userdata);
+
+  resultObj = Tcl_NewObj();
+  Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("closed", -1));
+  Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(total - forced));
+  Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("forced", -1));
+  Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(forced));
+  Tcl_SetObjResult(interp, resultObj);
+  return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_context_deleteProc --
+ *
+ *    Destroys the context when its command goes away, whether by
+ *    $ctx delete, rename or the deletion of the interpreter, so that
+ *    no file handler or timer of it outlives the interpreter.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_context_deleteProc(ClientData cData)
+{
+  struct context_userdata_struct *userdata = (struct context_userdata_struct*) cData;
+
+  // stop and free the listener socket.
+  libwebsocket_context_destroy(userdata->context);
+
+  // forget about any sockets that were registered with the notifier.
+  tclwebsockets_free_pollfds(userdata);
+
+  // free the memory for the protocol array.
+  ckfree((char*) userdata->protocols);
+  tclwebsockets_free_dispatch(userdata->dispatch, userdata->num_protocols);
+  Tcl_DecrRefCount(userdata->applyObj);
+
+  // websockets::connect creates a new one next time.
+  if (userdata->client_entry != NULL) {
+    Tcl_DeleteHashEntry(userdata->client_entry);
+  }
+
+  tclwebsockets_free_topics(userdata);
+
+  // the streams were ended when the context was destroyed.
+  tclwebsockets_free_compression(userdata->compression);
+
+  tclwebsockets_free_file_cache(&userdata->files);
+
+  // libwebsockets has freed the SSL_CTX.
+  tclwebsockets_free_tls(userdata->tls);
+
+  // and closed the pipe that drain put in place of the listening socket.
+  if (userdata->drain_fd >= 0) {
+    close(userdata->drain_fd);
+  }
+
+  // every session has given its buffers back by now.
+  tclwebsockets_free_peers(userdata);
+  tclwebsockets_pool_release(&userdata->pool);
+
+  // and has left the wheel.
+  if (userdata->wheel != NULL) {
+    if (userdata->wheel->timer != NULL) {
+      Tcl_DeleteTimerHandler(userdata->wheel->timer);
+    }
+    ckfree((char*) userdata->wheel);
+  }
+
+  if (userdata->batch_timer != NULL) {
+    Tcl_DeleteTimerHandler(userdata->batch_timer);
+  }
+  ckfree((char*) userdata);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_contextCmd --
+ *
+ *    Allows the caller to invoke various commands against a server context.
+ *
+ * Results:
+ *    stuff
+ *
+ *----------------------------------------------------------------------
+ */
+int
+tclwebsockets_contextCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  struct context_userdata_struct *userdata = (struct context_userdata_struct*) cData;
+
+  const char *commands[] = {
+    "service",
+    "delete",
+    "broadcast",
+    "compression",
+    "stats",
+    "drain",
+    "listenfd",
+    NULL
+  };
+
+  enum command_enum {
+    CMD_SERVICE,
+    CMD_DELETE,
+    CMD_BROADCAST,
+    CMD_COMPRESSION,
+    CMD_STATS,
+    CMD_DRAIN,
+    CMD_LISTENFD
+  };
+
+  int cmdIndex;
+
+
+  // basic command line processing
+  if (objc < 1) {
+    Tcl_WrongNumArgs (interp, 1, objv, "missing argument");
+    return TCL_ERROR;
+  }
+
+  if (Tcl_GetIndexFromObj(interp, objv[1], commands, "command", TCL_EXACT, &cmdIndex) != TCL_OK) {
+    return TCL_ERROR;
+  }
+
+  switch (cmdIndex) {
+  case CMD_SERVICE: {
+    // process pending socket events on the listener.
+    int n = libwebsocket_service(userdata->context, 50);    // block up to 50ms
+    tclwebsockets_end_service(userdata);
+    if (n != 0) {
+      return TCL_ERROR;
+    }
+    break;
+  }
+  case CMD_DELETE: {
+    // the delete proc frees the context and userdata with it.
+    Tcl_DeleteCommandFromToken(interp, userdata->cmdToken);
+    break;
+  }
+  case CMD_COMPRESSION: {
+    if (objc != 2) {
+      Tcl_WrongNumArgs (interp, 2, objv, NULL);
+      return TCL_ERROR;
+    }
+    if (userdata->compression == NULL) {
+      Tcl_AppendResult(interp, "compression was not enabled with -compression", NULL);
+      return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, tclwebsockets_compression_stats(userdata->compression));
+    break;
+  }
+  case CMD_STATS: {
+    if (objc != 2) {
+      Tcl_WrongNumArgs (interp, 2, objv, NULL);
+      return TCL_ERROR;
+    }
+#if TCLWEBSOCKETS_STATS
+    Tcl_SetObjResult(interp, tclwebsockets_context_stats(userdata));
+    break;
+#else
+    Tcl_AppendResult(interp, "statistics were disabled at build time", NULL);
+    return TCL_ERROR;
+#endif
+  }
+  case CMD_DRAIN: {
+    int timeout_ms = DEFAULT_DRAIN_TIMEOUT;
+
+    if (objc == 4 && strcmp(Tcl_GetString(objv[2]), "-timeout") == 0) {
+      if (Tcl_GetIntFromObj(interp, objv[3], &timeout_ms) != TCL_OK) {
+	return TCL_ERROR;
+      }
+      if (timeout_ms < 0) {
+	Tcl_AppendResult(interp, "-timeout must not be negative", NULL);
+	return TCL_ERROR;
+      }
+    } else if (objc != 2) {
+      Tcl_WrongNumArgs (interp, 2, objv, "?-timeout ms?");
+      return TCL_ERROR;
+    }
+    return tclwebsockets_drain(interp, userdata, timeout_ms);
+  }
+  case CMD_LISTENFD: {
+    // for a replacement process to inherit and pass to listen -fd.
+    int flags;
+
+    if (objc != 2) {
+      Tcl_WrongNumArgs (interp, 2, objv, NULL);
+      return TCL_ERROR;
+    }
+    if (userdata->listen_fd < 0 || userdata->drain_fd >= 0) {
+      Tcl_AppendResult(interp, "the context is not listening", NULL);
+      return TCL_ERROR;
+    }
+    flags = fcntl(userdata->listen_fd, F_GETFD);
+    if (flags != -1 && (flags & FD_CLOEXEC)) {
+      fcntl(userdata->listen_fd, F_SETFD, flags & ~FD_CLOEXEC);
+    }
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(userdata->listen_fd));
+    break;
+  }
+  case CMD_BROADCAST: {
+    static CONST char *broadcastOptions[] = { "-binary", "-text", "-topic", "-nocompress", NULL };
+    enum broadcastoptions { BCASTOPT_BINARY, BCASTOPT_TEXT, BCASTOPT_TOPIC, BCASTOPT_NOCOMPRESS };
+    enum libwebsocket_write_protocol write_protocol = LWS_WRITE_TEXT;
+    int nocompress = 0;
+    struct topic_struct *topic = NULL;
+    struct websocket_session_struct *session_data;
+    struct outbound_frame *frame;
+    unsigned char *p;
+    int len, optIndex, i, recipients = 0;
+
+    if (objc < 3) {
+      Tcl_WrongNumArgs (interp, 2, objv, "?-binary|-text? ?-topic name? ?-nocompress? value");
+      return TCL_ERROR;
+    }
+
+    for (i = 2; i < objc - 1; i++) {
+      if (Tcl_GetIndexFromObj(interp, objv[i], broadcastOptions, "option", TCL_EXACT, &optIndex) != TCL_OK) {
+	return TCL_ERROR;
+      }
+      switch ((enum broadcastoptions) optIndex) {
+      case BCASTOPT_BINARY: write_protocol = LWS_WRITE_BINARY; break;
+      case BCASTOPT_TEXT: write_protocol = LWS_WRITE_TEXT; break;
+      case BCASTOPT_NOCOMPRESS: nocompress = 1; break;
+      case BCASTOPT_TOPIC: {
+	Tcl_HashEntry *entry;
+	if (i + 1 >= objc - 1) {
+	  Tcl_WrongNumArgs (interp, 2, objv, "?-binary|-text? ?-topic name? ?-nocompress? value");
+	  return TCL_ERROR;
+	}
+	entry = Tcl_FindHashEntry(&userdata->topics, Tcl_GetString(objv[++i]));
+	if (entry == NULL) {
+	  // nobody has joined it.
+	  Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+	  return TCL_OK;
+	}
+	topic = (struct topic_struct*) Tcl_GetHashValue(entry);
+	break;
+      }
+      }
+    }
+
+    if (write_protocol == LWS_WRITE_BINARY) {
+      p = Tcl_GetByteArrayFromObj (objv[objc - 1], &len);
+    } else {
+      p = (unsigned char*) Tcl_GetStringFromObj (objv[objc - 1], &len);
+    }
+    if (len == 0) {
+      Tcl_AppendResult(interp, "invalid value", NULL);
+      return TCL_ERROR;
+    }
+
+    // the payload is copied once and shared by the queue of every recipient.
+    frame = tclwebsockets_new_frame(&userdata->pool, (size_t) len, write_protocol);
+    frame->nocompress = nocompress;
+    memcpy(FRAME_PAYLOAD(frame), p, len);
+    frame->refcount++;
+    STATS_INCR(userdata, broadcasts);
+
+    if (topic != NULL) {
+      Tcl_HashEntry *entry;
+      Tcl_HashSearch search;
+      for (entry = Tcl_FirstHashEntry(&topic->members, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+	session_data = (struct websocket_session_struct*) Tcl_GetHashKey(&topic->members, entry);
+	if (!session_data->close_requested) {
+	  recipients += tclwebsockets_queue_frame(userdata, session_data, frame);
+	}
+      }
+    } else {
+      for (session_data = userdata->sessions; session_data != NULL; session_data = session_data->next_session) {
+	if (!session_data->close_requested) {
+	  recipients += tclwebsockets_queue_frame(userdata, session_data, frame);
+	}
+      }
+    }
+    tclwebsockets_release_frame(&userdata->pool, frame);
+
+    // sessions that were skipped because their queue is full are not counted.
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(recipients));
+    return TCL_OK;
+  }
+  default: break;
+  } // end switch
+
+  return 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_init_session --
+ *
+ *    Initialize the session structure of a new connection: accepted
+ *    ones when they are established, outbound ones before connecting.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_init_session(struct context_userdata_struct *context_data, struct websocket_session_struct *session_data,
+			   struct handler_dispatch_struct *dispatch, struct libwebsocket *wsi, int is_client)
+{
+  session_data->dispatch = dispatch;
+  session_data->interp = context_data->interp;
+  session_data->socket = wsi;
+  session_data->context = context_data->context;
+  session_data->is_client = is_client;
+  session_data->released = 0;
+#if TCLWEBSOCKETS_STATS
+  memset(&session_data->stats, 0, sizeof(session_data->stats));
+#endif
+  STATS_INCR(context_data, open_connections);
+
+  // generate a unique connection_command_name.
+  snprintf(session_data->connection_cmd_name, sizeof(session_data->connection_cmd_name), "websocket%lu", context_data->interpdata->nextConnectionIndex++);
+
+  // all statevars start out unset.
+  session_data->statevals = NULL;
+  session_data->num_statevals = 0;
+  session_data->close_requested = 0;
+  session_data->close_when_flushed = 0;
+  session_data->close_status = LWS_CLOSE_STATUS_NORMAL;
+  session_data->next_pending_close = NULL;
+
+  session_data->rx_buffer = NULL;
+  session_data->rx_size = 0;
+  session_data->rx_len = 0;
+  session_data->rx_binary = 0;
+  session_data->rx_discard = 0;
+
+  session_data->batch = NULL;
+  session_data->next_batch = NULL;
+
+  session_data->coroutine = NULL;
+  session_data->coro_pending = NULL;
+  session_data->coro_state = CORO_NONE;
+
+  session_data->wheel_link.prev = session_data->wheel_link.next = NULL;
+
+  // accepted connections count against -maxconnections, and against the
+  // rates of their address when those are limited.
+  session_data->peer = NULL;
+  if (!is_client) {
+    unsigned char addr[16];
+
+    context_data->num_connections++;
+    if (context_data->peers.slots != NULL &&
+	tclwebsockets_peer_address(libwebsocket_get_socket_fd(wsi), addr, NULL, 0)) {
+      session_data->peer = tclwebsockets_peer_lookup(context_data, addr, tclwebsockets_now_ns());
+      session_data->peer->connections++;
+    }
+  }
+
+  // register the name for websockets::conn.
+  {
+    int isNew;
+    session_data->handle = (struct connection_handle*) ckalloc(sizeof(struct connection_handle));
+    session_data->handle->session = session_data;
+    session_data->handle->interpdata = context_data->interpdata;
+    session_data->handle->refcount = 1;
+    session_data->handle->entry = Tcl_CreateHashEntry(&context_data->interpdata->handles, session_data->connection_cmd_name, &isNew);
+    Tcl_SetHashValue(session_data->handle->entry, session_data->handle);
+  }
+
+  // keep this as an object, since it is passed to every handler invocation.
+  // It comes with the handle already resolved.
+  session_data->connection_cmd_obj = Tcl_NewStringObj(session_data->connection_cmd_name, -1);
+  Tcl_IncrRefCount(session_data->connection_cmd_obj);
+  tclwebsockets_set_handle_intrep(session_data->connection_cmd_obj, session_data->handle);
+
+  session_data->queue_head = NULL;
+  session_data->queue_tail = NULL;
+  session_data->queued_bytes = 0;
+  session_data->throttled = 0;
+
+  // the filter of this handshake decided whether we may frame ourselves.
+  session_data->raw_frames = (!is_client && context_data->handshake_wsi == wsi && context_data->handshake_raw_frames);
+  session_data->rx_held = 0;
+  context_data->handshake_wsi = NULL;
+  context_data->handshake_raw_frames = 0;
+
+  // link accepted connections into the context, for broadcasts.
+  session_data->topics = NULL;
+  session_data->prev_session = NULL;
+  session_data->next_session = NULL;
+  if (!is_client) {
+    session_data->next_session = context_data->sessions;
+    if (context_data->sessions != NULL) {
+      context_data->sessions->prev_session = session_data;
+    }
+    context_data->sessions = session_data;
+  }
+
+  // register a new command in the Tcl interpreter to represent this connection
+  // using connection_command_name and tclwebsockets_connectionCmd
+  session_data->cmdToken = NULL;
+  if (context_data->create_commands) {
+#if TCLWEBSOCKETS_NRE
+    if (tclwebsockets_have_nre) {
+      session_data->cmdToken = Tcl_NRCreateCommand(session_data->interp, session_data->connection_cmd_name, tclwebsockets_connectionCmd,
+						   tclwebsockets_connectionNRCmd, session_data, tclwebsockets_connectionDeleteProc);
+    }
+#endif
+    if (session_data->cmdToken == NULL) {
+      session_data->cmdToken = Tcl_CreateObjCommand(session_data->interp, session_data->connection_cmd_name, tclwebsockets_connectionCmd, session_data, tclwebsockets_connectionDeleteProc);
+    }
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_receive_chunk --
+ *
+ *    Account for a chunk of an incoming message, as handed to us by
+ *    libwebsockets.  Unless the handler streams, the chunks are
+ *    collected in the receive buffer of the session until the message
+ *    is complete.  A message that would exceed -maxmessage has the
+ *    connection closed before any Tcl code sees it.
+ *
+ * Results:
+ *    1 if *dataPtr and *lenPtr hold a message, or a chunk of one when
+ *    streaming, with *flagsPtr telling whether it is the first and/or
+ *    final chunk.  0 if there is nothing to deliver yet.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_receive_chunk(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data,
+			    struct libwebsocket *wsi, int streaming, unsigned char *chunk, size_t len,
+			    unsigned char **dataPtr, size_t *lenPtr, int *flagsPtr)
+{
+  size_t remaining = libwebsockets_remaining_packet_payload(wsi);
+  size_t total = session_data->rx_len + len + remaining;
+  int final = (remaining == 0 && libwebsocket_is_final_fragment(wsi));
+  int first = (session_data->rx_len == 0);
+
+  // the rest of a message that was too large.
+  if (session_data->rx_discard) {
+    return 0;
+  }
+
+  if (first) {
+    session_data->rx_binary = libwebsocket_frame_is_binary(wsi);
+  }
+
+  // the remainder of the current frame counts as well, so an oversize
+  // frame is refused with its first chunk.  A buffered message also has
+  // to fit into a Tcl object.
+  if ((userdata->maxmessage > 0 && total > userdata->maxmessage) || (!streaming && total > INT_MAX)) {
+    session_data->rx_discard = 1;
+    session_data->rx_len = 0;
+    STATS_INCR(userdata, messages_too_large);
+    tclwebsockets_defer_close(userdata, session_data, LWS_CLOSE_STATUS_MESSAGE_TOO_LARGE);
+    return 0;
+  }
+
+  *flagsPtr = (first ? RX_FIRST : 0) | (final ? RX_FINAL : 0);
+
+  // chunks are passed on as they are when streaming, and so are
+  // messages that arrived in one piece.
+  if (streaming || (first && final)) {
+    session_data->rx_len = (final ? 0 : session_data->rx_len + len);
+    *dataPtr = chunk;
+    *lenPtr = len;
+    return 1;
+  }
+
+  if (session_data->rx_len + len > session_data->rx_size) {
+    size_t size = session_data->rx_size * 2;
+    unsigned char *buffer;
+    if (size < total) {
+      size = total;
+    }
+    buffer = (unsigned char*) tclwebsockets_pool_alloc(&userdata->pool, size);
+    if (session_data->rx_buffer != NULL) {
+      memcpy(buffer, session_data->rx_buffer, session_data->rx_len);
+      tclwebsockets_pool_free(&userdata->pool, session_data->rx_buffer);
+    }
+    session_data->rx_buffer = buffer;
+    session_data->rx_size = POOL_BUFFER_SIZE(buffer);
+  }
+  memcpy(session_data->rx_buffer + session_data->rx_len, chunk, len);
+  session_data->rx_len += len;
+
+  if (!final) {
+    return 0;
+  }
+  *dataPtr = session_data->rx_buffer;
+  *lenPtr = session_data->rx_len;
+  session_data->rx_len = 0;
+  return 1;
+}
+
+
+// Once a reassembled message has been delivered, its buffer goes back to
+// the pool, so idle connections do not keep one.
+static void
+tclwebsockets_release_rx_buffer(struct context_userdata_struct *userdata, struct websocket_session_struct *session_data)
+{
+  if (session_data->rx_buffer != NULL && session_data->rx_len == 0) {
+    tclwebsockets_pool_free(&userdata->pool, session_data->rx_buffer);
+    session_data->rx_buffer = NULL;
+    session_data->rx_size = 0;
+  }
+}
+
+
+// Names of the handshake headers passed to filter-protocol-connection.
+// The order of lws_token_indexes differs between libwebsockets versions,
+// so each name is paired with its token.
+static const struct {
+  enum lws_token_indexes token;
+  const char *name;
+} header_names[] = {
+  {WSI_TOKEN_GET_URI, "uri"},
+  {WSI_TOKEN_HOST, "host"},
+  {WSI_TOKEN_CONNECTION, "connection"},
+  {WSI_TOKEN_KEY1, "key1"},
+  {WSI_TOKEN_KEY2, "key2"},
+  {WSI_TOKEN_PROTOCOL, "protocol"},
+  {WSI_TOKEN_UPGRADE, "upgrade"},
+  {WSI_TOKEN_ORIGIN, "origin"},
+  {WSI_TOKEN_DRAFT, "draft"},
+  {WSI_TOKEN_CHALLENGE, "challenge"},
+  {WSI_TOKEN_KEY, "key"},
+  {WSI_TOKEN_VERSION, "version"},
+  {WSI_TOKEN_SWORIGIN, "sworigin"},
+  {WSI_TOKEN_EXTENSIONS, "extensions"},
+  {WSI_TOKEN_ACCEPT, "accept"},
+  {WSI_TOKEN_NONCE, "nonce"},
+  {WSI_TOKEN_HTTP, "http"},
+  {WSI_TOKEN_MUXURL, "muxurl"}
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_run_filter --
+ *
+ *    Invoke the filter or http handler of a protocol, which runs
+ *    without a session: the connection argument is empty, and the
+ *    second argument is dataObj, which is freed here if the caller
+ *    holds no reference to it.  If resultPtr is not NULL, it is set
+ *    to the result of the handler with a reference added, or to NULL
+ *    if the handler failed.
+ *
+ * Results:
+ *    1 if the handler returned true (refuse the connection) or failed,
+ *    else 0.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_run_filter(struct context_userdata_struct *userdata, struct handler_dispatch_struct *dispatch, int event, Tcl_Obj *dataObj,
+			 Tcl_Obj **resultPtr)
+{
+  Tcl_Obj *objv[2 + MAX_HANDLER_ARGS];
+  int objc = 0, argi, refuse = 1;
+  struct websocket_session_struct *outer_session = userdata->interpdata->current_session;
+
+  // a lambda may not take the data at all.
+  Tcl_IncrRefCount(dataObj);
+  objv[objc++] = userdata->applyObj;
+  objv[objc++] = dispatch->lambdas[event];
+  for (argi = 0; argi < dispatch->numargs[event]; argi++) {
+    objv[objc++] = (argi == 1 ? dataObj : Tcl_NewObj());
+  }
+  for (argi = 0; argi < objc; argi++) {
+    Tcl_IncrRefCount(objv[argi]);
+  }
+
+  // there are no statevars to load without a session.
+  userdata->interpdata->current_session = NULL;
+  userdata->callback_depth++;
+  if (Tcl_EvalObjv(userdata->interp, objc, objv, TCL_EVAL_GLOBAL) == TCL_ERROR) {
+    Tcl_AddErrorInfo(userdata->interp, "\n    (websocket filter event)");
+    Tcl_BackgroundError(userdata->interp);
+    STATS_INCR(userdata, handler_errors);
+    if (resultPtr != NULL) {
+      *resultPtr = NULL;
+    }
+  } else {
+    if (Tcl_GetBooleanFromObj(NULL, Tcl_GetObjResult(userdata->interp), &refuse) != TCL_OK) {
+      refuse = 0;
+    }
+    if (resultPtr != NULL) {
+      *resultPtr = Tcl_GetObjResult(userdata->interp);
+      Tcl_IncrRefCount(*resultPtr);
+    }
+  }
+  userdata->callback_depth--;
+  userdata->interpdata->current_session = outer_session;
+  STATS_INCR(userdata, events[event]);
+
+  for (argi = 0; argi < objc; argi++) {
+    Tcl_DecrRefCount(objv[argi]);
+  }
+  Tcl_DecrRefCount(dataObj);
+  Tcl_ResetResult(userdata->interp);
+  return refuse;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_filter --
+ *
+ *    Handle the filter callbacks, which let us refuse a connection
+ *    before anything is allocated for it.
+ *
+ *    filter-network-connection comes with the accepted socket, before
+ *    the handshake: -maxconnections and -connectrate are checked, then
+ *    the handler of the first protocol is given a dictionary with the
+ *    peer address.
+ *
+ *    filter-protocol-connection comes with the headers of the
+ *    handshake, which are passed to the handler of the requested
+ *    protocol as a dictionary.  They also tell whether we may frame
+ *    the messages of the connection ourselves: it must speak version
+ *    13 and must not be able to end up with an extension.
+ *
+ * Results:
+ *    Nonzero to refuse the connection.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_filter(struct context_userdata_struct *userdata, struct libwebsocket *wsi, int reason, void *arg)
+{
+  struct handler_dispatch_struct *dispatch;
+  Tcl_Obj *dataObj;
+
+  if (reason == LWS_CALLBACK_FILTER_NETWORK_CONNECTION) {
+    int fd = (int) (long) arg;
+    unsigned char addr[16];
+    char text[INET6_ADDRSTRLEN] = "";
+    int have_addr = tclwebsockets_peer_address(fd, addr, text, sizeof(text));
+
+    if (userdata->draining) {
+      return 1;
+    }
+    if (userdata->max_connections > 0 && userdata->num_connections >= userdata->max_connections) {
+      STATS_INCR(userdata, refused_maxconnections);
+      return 1;
+    }
+    if (have_addr && userdata->connect_rate.rate > 0) {
+      Tcl_WideInt now = tclwebsockets_now_ns();
+      struct peer_entry *peer = tclwebsockets_peer_lookup(userdata, addr, now);
+      if (!tclwebsockets_take_token(&userdata->connect_rate, &peer->connect_tokens, &peer->connect_time, now)) {
+	STATS_INCR(userdata, refused_connectrate);
+	return 1;
+      }
+    }
+
+    dispatch = &userdata->dispatch[0];
+    if (dispatch->epoch != userdata->interpdata->handlerEpoch) {
+      tclwebsockets_refresh_dispatch(userdata->interp, dispatch, userdata->interpdata->handlerEpoch);
+    }
+    if (dispatch->lambdas[reason] == NULL) {
+      return 0;
+    }
+    dataObj = Tcl_NewObj();
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewStringObj("address", -1));
+    Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewStringObj(text, -1));
+
+  } else {
+    struct lws_tokens *tokens = (struct lws_tokens*) arg;
+    const struct libwebsocket_protocols *protocol = libwebsockets_get_protocol(wsi);
+    int i;
+
+    if (tokens == NULL) {
+      return 0;
+    }
+    userdata->handshake_wsi = wsi;
+    userdata->handshake_raw_frames = (!userdata->use_ssl &&
+				      tokens[WSI_TOKEN_VERSION].token_len == 2 &&
+				      memcmp(tokens[WSI_TOKEN_VERSION].token, "13", 2) == 0 &&
+				      (!userdata->has_extensions || tokens[WSI_TOKEN_EXTENSIONS].token_len == 0));
+
+    if (protocol < userdata->protocols || protocol >= userdata->protocols + userdata->num_protocols) {
+      return 0;
+    }
+    dispatch = &userdata->dispatch[protocol - userdata->protocols];
+    if (dispatch->epoch != userdata->interpdata->handlerEpoch) {
+      tclwebsockets_refresh_dispatch(userdata->interp, dispatch, userdata->interpdata->handlerEpoch);
+    }
+    if (dispatch->lambdas[reason] == NULL) {
+      return 0;
+    }
+    dataObj = Tcl_NewObj();
+    for (i = 0; i < (int) (sizeof(header_names) / sizeof(header_names[0])); i++) {
+      struct lws_tokens *token = &tokens[header_names[i].token];
+      if (token->token != NULL && token->token_len > 0) {
+	Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewStringObj(header_names[i].name, -1));
+	Tcl_ListObjAppendElement(NULL, dataObj, Tcl_NewStringObj(token->token, token->token_len));
+      }
+    }
+  }
+
+  if (tclwebsockets_run_filter(userdata, dispatch, reason, dataObj, NULL)) {
+    STATS_INCR(userdata, refused_filter);
+    return 1;
+  }
+  return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_http_write --
+ *
+ *    Write an HTTP response with one libwebsocket_write(), having grown
+ *    the send buffer of the socket to take it whole if need be.  This
+ *    libwebsockets has no writeable callback for HTTP connections and
+ *    libwebsocket_write() fails on a partial send, so a client whose
+ *    socket cannot take the response at once is dropped rather than
+ *    waited for.
+ *
+ * Results:
+ *    0, or -1 to close the connection.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_http_write(struct libwebsocket *wsi, const char *buf, size_t len)
+{
+  if (tclwebsockets_fit_write(libwebsocket_get_socket_fd(wsi), len) == 0) {
+    return -1;
+  }
+  return (libwebsocket_write(wsi, (unsigned char*) buf, len, LWS_WRITE_HTTP) < 0 ? -1 : 0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_http_respond --
+ *
+ *    Answer a request with the result of the http handler: a
+ *    dictionary with an optional status (200 by default), content-type
+ *    and body, or a file to send instead of the body.  An empty result,
+ *    or none without a handler, is a 404.
+ *
+ * Results:
+ *    0, or -1 to close the connection.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_http_respond(struct libwebsocket *wsi, Tcl_Obj *responseObj)
+{
+  static const char *keys[] = { "status", "content-type", "body", "file" };
+  Tcl_Obj *valueObjs[4] = { NULL, NULL, NULL, NULL };
+  Tcl_Obj *statusObj, *typeObj, *bodyObj, *fileObj;
+  const char *reason, *type = "text/html; charset=utf-8", *body = "";
+  int size = 0, status = 200, bodylen = 0, n;
+  Tcl_DString response;
+  char header[512];
+
+  if (responseObj == NULL || Tcl_DictObjSize(NULL, responseObj, &size) != TCL_OK || size == 0) {
+    status = (responseObj == NULL || size == 0 ? 404 : 500);
+  } else {
+    for (n = 0; n < 4; n++) {
+      Tcl_Obj *keyObj = Tcl_NewStringObj(keys[n], -1);
+      Tcl_IncrRefCount(keyObj);
+      Tcl_DictObjGet(NULL, responseObj, keyObj, &valueObjs[n]);
+      Tcl_DecrRefCount(keyObj);
+    }
+    statusObj = valueObjs[0];
+    typeObj = valueObjs[1];
+    bodyObj = valueObjs[2];
+    fileObj = valueObjs[3];
+
+    if (fileObj != NULL) {
+      const char *filename = Tcl_GetString(fileObj);
+      return (libwebsockets_serve_http_file(wsi, filename, (typeObj != NULL ? Tcl_GetString(typeObj) : tclwebsockets_content_type(filename))) ? -1 : 0);
+    }
+    if (statusObj != NULL && (Tcl_GetIntFromObj(NULL, statusObj, &status) != TCL_OK || status < 100 || status > 999)) {
+      status = 500;
+    }
+    if (typeObj != NULL) {
+      type = Tcl_GetString(typeObj);
+    }
+    if (bodyObj != NULL) {
+      body = Tcl_GetStringFromObj(bodyObj, &bodylen);
+    }
+  }
+
+  switch (status) {
+  case 200: reason = "OK"; break;
+  case 204: reason = "No Content"; break;
+  case 301: reason = "Moved Permanently"; break;
+  case 302: reason = "Found"; break;
+  case 304: reason = "Not Modified"; break;
+  case 400: reason = "Bad Request"; break;
+  case 403: reason = "Forbidden"; break;
+  case 404: reason = "Not Found"; break;
+  case 500: reason = "Internal Server Error"; break;
+  default: reason = ""; break;
+  }
+
+  snprintf(header, sizeof(header),
+	   "HTTP/1.0 %d %s\r\n"
+	   "Server: tclwebsockets\r\n"
+	   "Content-Type: %.200s\r\n"
+	   "Content-Length: %d\r\n"
+	   "Connection: close\r\n\r\n",
+	   status, reason, type, bodylen);
+  Tcl_DStringInit(&response);
+  Tcl_DStringAppend(&response, header, -1);
+  Tcl_DStringAppend(&response, body, bodylen);
+  n = tclwebsockets_http_write(wsi, Tcl_DStringValue(&response), (size_t) Tcl_DStringLength(&response));
+  Tcl_DStringFree(&response);
+  return n;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_serve_http --
+ *
+ *    Answer a plain HTTP request.  With -docroot, files are served
+ *    from the cache, and read into it when they are not there yet (or
+ *    have changed), without involving the interpreter.  Files too big
+ *    for the cache are sent from disk.  Everything else, and every
+ *    request without -docroot, goes to the http event of the first
+ *    protocol.
+ *
+ * Results:
+ *    0, or -1 to close the connection.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_serve_http(struct context_userdata_struct *userdata, struct libwebsocket *wsi, const char *uri, int len)
+{
+  struct file_cache *cache = &userdata->files;
+  struct handler_dispatch_struct *dispatch;
+  struct cache_entry *entry = NULL;
+  Tcl_Obj *resultObj = NULL;
+  char path[PATH_MAX], filename[PATH_MAX];
+  int n;
+
+  if (cache->docroot != NULL && tclwebsockets_http_path(uri, len, path, sizeof(path))) {
+    Tcl_HashEntry *hentry = Tcl_FindHashEntry(&cache->entries, path);
+    Tcl_WideInt now = tclwebsockets_now_ns();
+    struct stat st;
+
+    if (hentry != NULL) {
+      entry = (struct cache_entry*) Tcl_GetHashValue(hentry);
+    }
+
+    // look at the file itself on a miss, and now and then on a hit.
+    if ((entry == NULL || now - entry->checked >= FILE_CACHE_RECHECK_NS) &&
+	snprintf(filename, sizeof(filename), "%s%s", cache->docroot, path) < (int) sizeof(filename)) {
+      if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+	if (entry != NULL) {
+	  tclwebsockets_cache_evict(cache, entry);
+	}
+	goto handler;
+      }
+      if (entry != NULL && (entry->mtime != st.st_mtime || entry->size != st.st_size)) {
+	tclwebsockets_cache_evict(cache, entry);
+	entry = NULL;
+      }
+      if (entry == NULL) {
+	cache->misses++;
+	if ((size_t) st.st_size > cache->limit / 4 || (size_t) st.st_size > HTTP_SEND_LIMIT) {
+	  return (libwebsockets_serve_http_file(wsi, filename, tclwebsockets_content_type(path)) ? -1 : 0);
+	}
+	if ((entry = tclwebsockets_cache_load(cache, path, filename, &st, now)) == NULL) {
+	  goto handler;
+	}
+      } else {
+	cache->hits++;
+	entry->checked = now;
+      }
+    } else if (entry != NULL) {
+      cache->hits++;
+    } else {
+      goto handler;
+    }
+
+    if (entry != cache->head) {
+      tclwebsockets_cache_unlink(cache, entry);
+      tclwebsockets_cache_push(cache, entry);
+    }
+    return tclwebsockets_http_write(wsi, entry->response, entry->length);
+  }
+
+ handler:
+  dispatch = &userdata->dispatch[0];
+  if (dispatch->epoch != userdata->interpdata->handlerEpoch) {
+    tclwebsockets_refresh_dispatch(userdata->interp, dispatch, userdata->interpdata->handlerEpoch);
+  }
+  if (dispatch->lambdas[LWS_CALLBACK_HTTP] != NULL) {
+    cache->handled++;
+    tclwebsockets_run_filter(userdata, dispatch, LWS_CALLBACK_HTTP, Tcl_NewStringObj(uri, len), &resultObj);
+    if (resultObj == NULL) {
+      resultObj = Tcl_NewStringObj("status 500", -1);
+      Tcl_IncrRefCount(resultObj);
+    }
+  }
+  n = tclwebsockets_http_respond(wsi, resultObj);
+  if (resultObj != NULL) {
+    Tcl_DecrRefCount(resultObj);
+  }
+  return n;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * callback_websocket_handler --
+ *
+ *    Universal callback invoked by libwebsocket whenever an event
+ *    occurs on a connection belonging to any of our protocols.
+ *
+ * Results:
+ *    stuff
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+callback_websocket_handler(struct libwebsocket_context *context,
+		    struct libwebsocket *wsi,
+		    enum libwebsocket_callback_reasons reason,
+		    void *v_session_data, void *indata, size_t lendata)
+{
+  struct websocket_session_struct *session_data = (struct websocket_session_struct *)v_session_data;
+  struct context_userdata_struct *context_data = (struct context_userdata_struct*)libwebsockets_get_user_data(context);
+  struct handler_dispatch_struct *dispatch;
+  Tcl_Obj *lambda;               // {args body ns} for the apply command
+  int rx_flags = 0;              // RX_FIRST and RX_FINAL for receive events.
+
+  //
+  // Sockets being added to or removed from the poll set are not related to
+  // any session and arrive before the user data may have been attached.
+  //
+  switch (reason) {
+  case LWS_CALLBACK_ADD_POLL_FD:
+  case LWS_CALLBACK_DEL_POLL_FD:
+  case LWS_CALLBACK_SET_MODE_POLL_FD:
+  case LWS_CALLBACK_CLEAR_MODE_POLL_FD:
+    if (context_data == NULL) {
+      ThreadSpecificData *tsdPtr = (ThreadSpecificData *) Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+      context_data = tsdPtr->creatingContext;
+    }
+    return tclwebsockets_pollfd_callback(context_data, reason, (int) (long) v_session_data, (int) lendata);
+#if TCLWEBSOCKETS_OPENSSL
+  case LWS_CALLBACK_OPENSSL_LOAD_EXTRA_SERVER_VERIFY_CERTS:
+    // the SSL_CTX of a listener being created is passed in place of the session.
+    if (context_data == NULL) {
+      ThreadSpecificData *tsdPtr = (ThreadSpecificData *) Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+      context_data = tsdPtr->creatingContext;
+    }
+    if (context_data != NULL && context_data->tls != NULL && v_session_data != NULL) {
+      tclwebsockets_tls_configure(context_data->tls, (SSL_CTX*) v_session_data);
+    }
+    return 0;
+#endif
+  default: break;
+  }
+
+  if (reason >= NUM_CALLBACK_EVENTS) {
+    // event reason is out of range, so no handler is possible.
+    return 0;
+  }
+
+  //fprintf(stderr, "callback_websocket_handler got reason %d\n", (int) reason);
+
+  //
+  // When a connection is first established, do some extra work to
+  // intitialize the session structure.
+  //
+  if (reason == LWS_CALLBACK_ESTABLISHED) {
+    const struct libwebsocket_protocols *protocol;
+
+    // initialize session_data
+    protocol = libwebsockets_get_protocol(wsi);
+    if (protocol < context_data->protocols || protocol >= context_data->protocols + context_data->num_protocols) {
+      return -1;
+    }
+    tclwebsockets_init_session(context_data, session_data, &context_data->dispatch[protocol - context_data->protocols], wsi, 0);
+
+    // a handshake that was under way when drain was called.
+    if (context_data->draining) {
+      tclwebsockets_defer_close(context_data, session_data, LWS_CLOSE_STATUS_GOINGAWAY);
+    }
+  }
+
+  // plain HTTP requests have no session either, only their URI.
+  if (reason == LWS_CALLBACK_HTTP) {
+    if (indata == NULL) {
+      return -1;
+    }
+    return tclwebsockets_serve_http(context_data, wsi, (const char*) indata, (int) (lendata > 0 ? lendata : strlen((const char*) indata)));
+  }
+
+  // the socket or the headers are passed in place of the session.
+  if (reason == LWS_CALLBACK_FILTER_NETWORK_CONNECTION || reason == LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION) {
+    return tclwebsockets_filter(context_data, wsi, reason, v_session_data);
+  }
+  if (!session_data || !session_data->socket) {
+    //fprintf(stderr, "bailing.\n");
+    return 0;
+  }
+
+  // the timing wheel only needs to know when something arrived.
+  if (context_data->wheel != NULL) {
+    switch (reason) {
+    case LWS_CALLBACK_ESTABLISHED:
+    case LWS_CALLBACK_CLIENT_ESTABLISHED:
+      tclwebsockets_wheel_start(context_data, session_data);
+      break;
+    case LWS_CALLBACK_RECEIVE:
+    case LWS_CALLBACK_CLIENT_RECEIVE:
+      session_data->last_message = session_data->last_seen = tclwebsockets_now_ns();
+      break;
+    case LWS_CALLBACK_CLIENT_RECEIVE_PONG:
+      session_data->last_seen = tclwebsockets_now_ns();
+      break;
+    default: break;
+    }
+  }
+
+#if TCLWEBSOCKETS_STATS
+  switch (reason) {
+  case LWS_CALLBACK_ESTABLISHED: STATS_INCR(context_data, connections); break;
+  case LWS_CALLBACK_CLIENT_ESTABLISHED: STATS_INCR(context_data, client_connections); break;
+  case LWS_CALLBACK_CLIENT_CONNECTION_ERROR: STATS_INCR(context_data, connect_errors); break;
+  case LWS_CALLBACK_CLOSED: STATS_INCR(context_data, closes); break;
+  case LWS_CALLBACK_RECEIVE:
+  case LWS_CALLBACK_CLIENT_RECEIVE:
+    STATS_ADD(context_data, bytes_in, lendata);
+    STATS_ADD(session_data, bytes_in, lendata);
+    break;
+  default: break;
+  }
+#endif
+
+  //
+  // Writeable callbacks first drain the outbound queue, then run the
+  // handler's server-writeable (or client-writeable) event as before.  A
+  // throttled connection that has drained below the low watermark also
+  // gets its drained event, as a cue to resume writing.
+  //
+  if (reason == LWS_CALLBACK_SERVER_WRITEABLE || reason == LWS_CALLBACK_CLIENT_WRITEABLE) {
+    if (tclwebsockets_drain_queue(session_data) < 0) {
+      return -1;
+    }
+    if (session_data->close_when_flushed) {
+      if (session_data->queue_head == NULL) {
+	tclwebsockets_defer_close(context_data, session_data, LWS_CLOSE_STATUS_GOINGAWAY);
+      }
+      return 0;
+    }
+    // a coroutine in $wsi waitwritable goes on below the low watermark.
+    if (session_data->coro_state == CORO_WAIT_WRITABLE) {
+      if (session_data->queued_bytes <= context_data->lowwater) {
+	Tcl_Obj *objv[2];
+	objv[0] = session_data->coroutine;
+	objv[1] = Tcl_NewObj();
+	session_data->throttled = 0;
+	tclwebsockets_run_coroutine(context_data, session_data, reason, 2, objv);
+      }
+      return 0;
+    }
+    if (session_data->throttled && session_data->queued_bytes <= context_data->lowwater) {
+      session_data->throttled = 0;
+      dispatch = session_data->dispatch;
+      if (dispatch->epoch != context_data->interpdata->handlerEpoch) {
+	tclwebsockets_refresh_dispatch(session_data->interp, dispatch, context_data->interpdata->handlerEpoch);
+      }
+      if (dispatch->lambdas[EVENT_DRAINED] != NULL) {
+	tclwebsockets_run_handler(context_data, session_data, EVENT_DRAINED, dispatch->lambdas[EVENT_DRAINED], NULL, NULL);
+      }
+    }
+  }
+
+  //
+  // Find the lambda that was registered for this event, re-resolving the
+  // handler first if websockets::handler has been called since.
+  //
+  dispatch = session_data->dispatch;
+  if (dispatch->epoch != context_data->interpdata->handlerEpoch) {
+    tclwebsockets_refresh_dispatch(session_data->interp, dispatch, context_data->interpdata->handlerEpoch);
+  }
+  lambda = dispatch->lambdas[reason];
+
+  //
+  // Incoming data is delivered as whole messages, or chunk by chunk to
+  // handlers created with -streaming (and when nobody is listening).
+  //
+  if (reason == LWS_CALLBACK_RECEIVE || reason == LWS_CALLBACK_CLIENT_RECEIVE) {
+    unsigned char *data;
+    size_t len;
+
+    int batching = (dispatch->batch_maxcount > 0 && !dispatch->streaming && dispatch->lambdas[EVENT_RECEIVE_BATCH] != NULL);
+
+    if (!tclwebsockets_receive_chunk(context_data, session_data, wsi, dispatch->streaming || (lambda == NULL && !batching && !dispatch->coroutine),
+				     (unsigned char*) indata, lendata, &data, &len, &rx_flags)) {
+      return 0;
+    }
+    if (rx_flags & RX_FINAL) {
+      STATS_INCR(context_data, messages_in);
+      STATS_INCR(session_data, messages_in);
+
+      // past -messagerate, the connection is closed instead.
+      if (session_data->peer != NULL && context_data->message_rate.rate > 0 &&
+	  !tclwebsockets_take_token(&context_data->message_rate, &session_data->peer->message_tokens,
+				    &session_data->peer->message_time, tclwebsockets_now_ns())) {
+	if (!session_data->close_requested) {
+	  STATS_INCR(context_data, closed_messagerate);
+	  tclwebsockets_defer_close(context_data, session_data, LWS_CLOSE_STATUS_POLICY_VIOLATION);
+	}
+	tclwebsockets_release_rx_buffer(context_data, session_data);
+	return 0;
+      }
+    }
+    indata = data;
+    lendata = len;
+
+    // with -batch, messages are collected for the receive-batch event.
+    if (batching) {
+      Tcl_Obj *messageObj = tclwebsockets_message_obj(context_data, session_data, data, len);
+
+      tclwebsockets_release_rx_buffer(context_data, session_data);
+      if (messageObj != NULL) {
+	tclwebsockets_batch_message(context_data, session_data, messageObj);
+      }
+      return 0;
+    }
+
+    // with -coroutine, they are the results of [yield].
+    if (dispatch->coroutine) {
+      Tcl_Obj *messageObj = (session_data->coroutine != NULL ? tclwebsockets_message_obj(context_data, session_data, data, len) : NULL);
+
+      tclwebsockets_release_rx_buffer(context_data, session_data);
+      if (messageObj != NULL) {
+	tclwebsockets_coroutine_message(context_data, session_data, reason, messageObj);
+      }
+      return 0;
+    }
+  }
+
+  // a closing connection gets the rest of its messages first.
+  if ((reason == LWS_CALLBACK_CLOSED || reason == LWS_CALLBACK_CLIENT_CONNECTION_ERROR) && session_data->batch != NULL) {
+    tclwebsockets_run_batch(context_data, session_data);
+  }
+
+  if (lambda == NULL) {
+    // no handler defined for this event method.
+    if (reason == LWS_CALLBACK_CLOSED || reason == LWS_CALLBACK_CLIENT_CONNECTION_ERROR) {
+      tclwebsockets_free_session(context_data, session_data);
+    }
+    return 0;
+  }
+
+
+  //
+  // Pass the data as the second argument, if the lambda declared one.
+  // Binary frames are delivered as a byte array, without UTF-8 conversion.
+  //
+  {
+    Tcl_Obj *dataObj = NULL, *flagsObj = NULL;
+    int numargs = dispatch->numargs[reason];
+
+    if (numargs > 1 && indata != NULL) {
+      if ((reason == LWS_CALLBACK_RECEIVE || reason == LWS_CALLBACK_CLIENT_RECEIVE) && session_data->rx_binary) {
+	dataObj = Tcl_NewByteArrayObj((unsigned char*) indata, (int) lendata);
+      } else if ((reason == LWS_CALLBACK_RECEIVE || reason == LWS_CALLBACK_CLIENT_RECEIVE) && dispatch->json) {
+	// with -format json, text messages arrive parsed.
+	if ((dataObj = tclwebsockets_json_message(context_data, session_data, indata, lendata)) == NULL) {
+	  tclwebsockets_release_rx_buffer(context_data, session_data);
+	  return 0;
+	}
+      } else {
+	dataObj = Tcl_NewStringObj(indata, lendata);
+      }
+    }
+
+    // whether a streamed chunk starts and/or ends its message.
+    if (numargs > 2 && (reason == LWS_CALLBACK_RECEIVE || reason == LWS_CALLBACK_CLIENT_RECEIVE)) {
+      flagsObj = Tcl_NewObj();
+      if (rx_flags & RX_FIRST) {
+	Tcl_ListObjAppendElement(NULL, flagsObj, Tcl_NewStringObj("first", -1));
+      }
+      if (rx_flags & RX_FINAL) {
+	Tcl_ListObjAppendElement(NULL, flagsObj, Tcl_NewStringObj("final", -1));
+      }
+    }
+
+    if (dispatch->coroutine && (reason == LWS_CALLBACK_ESTABLISHED || reason == LWS_CALLBACK_CLIENT_ESTABLISHED)) {
+      tclwebsockets_start_coroutine(context_data, session_data, reason, lambda);
+    } else {
+      tclwebsockets_run_handler(context_data, session_data, reason, lambda, dataObj, flagsObj);
+    }
+  }
+
+  tclwebsockets_release_rx_buffer(context_data, session_data);
+
+  if (reason == LWS_CALLBACK_CLOSED || reason == LWS_CALLBACK_CLIENT_CONNECTION_ERROR) {
+    tclwebsockets_free_session(context_data, session_data);
+  }
+
+
+  return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_reserve_port --
+ *
+ *    Bind a socket to a free port with SO_REUSEADDR, for a listener
+ *    that is going to be rebound with tclwebsockets_rebind_reuseport()
+ *    or tclwebsockets_adopt_listener().  Keeping the socket open until
+ *    libwebsockets has listened on the port makes everyone else's
+ *    bind() fail with EADDRINUSE, while libwebsockets, which also sets
+ *    SO_REUSEADDR, may bind it and listen (the reserving socket does
+ *    not listen).
+ *
+ * Results:
+ *    The socket, to be closed once the context exists, and its port in
+ *    *portPtr; or -1 with an error message left in the interpreter.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_reserve_port(Tcl_Interp *interp, int *portPtr)
+{
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  int fd, one = 1;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    Tcl_AppendResult(interp, "unable to create socket: ", Tcl_ErrnoMsg(errno), NULL);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = 0;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+      bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+      getsockname(fd, (struct sockaddr*) &addr, &addrlen) != 0) {
+    Tcl_AppendResult(interp, "unable to reserve a port: ", Tcl_ErrnoMsg(errno), NULL);
+    close(fd);
+    return -1;
+  }
+  *portPtr = ntohs(addr.sin_port);
+  return fd;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_adopt_listener --
+ *
+ *    Make a listening socket inherited from another process (listen
+ *    -fd) the listening socket of a context.
+ *
+ * Results:
+ *    A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_adopt_listener(Tcl_Interp *interp, struct context_userdata_struct *userdata, int fd)
+{
+  if (userdata->listen_fd < 0) {
+    Tcl_AppendResult(interp, "unable to find the listening socket", NULL);
+    return TCL_ERROR;
+  }
+  return tclwebsockets_replace_listener(interp, userdata, fd);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_listener_port --
+ *
+ *    Check that an inherited fd is a listening TCP socket.
+ *
+ * Results:
+ *    The port it is bound to, or -1 with an error message left in the
+ *    interpreter.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_listener_port(Tcl_Interp *interp, int fd)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  char fdStr[TCL_INTEGER_SPACE];
+#ifdef SO_ACCEPTCONN
+  int accepting = 0;
+  socklen_t optlen = sizeof(accepting);
+#endif
+
+  sprintf(fdStr, "%d", fd);
+  if (getsockname(fd, (struct sockaddr*) &addr, &addrlen) != 0) {
+    Tcl_AppendResult(interp, "invalid value \"", fdStr, "\" for -fd: ", Tcl_ErrnoMsg(errno), NULL);
+    return -1;
+  }
+#ifdef SO_ACCEPTCONN
+  if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &optlen) != 0 || !accepting) {
+    Tcl_AppendResult(interp, "invalid value \"", fdStr, "\" for -fd: not a listening socket", NULL);
+    return -1;
+  }
+#endif
+  if (addr.ss_family == AF_INET) {
+    return ntohs(((struct sockaddr_in*) &addr)->sin_port);
+  } else if (addr.ss_family == AF_INET6) {
+    return ntohs(((struct sockaddr_in6*) &addr)->sin6_port);
+  }
+  Tcl_AppendResult(interp, "invalid value \"", fdStr, "\" for -fd: not a TCP socket", NULL);
+  return -1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_rebind_reuseport --
+ *
+ *    Replace the listening socket of a context by one bound to the same
+ *    address and the given port with SO_REUSEPORT, so that several
+ *    listeners (in other threads or processes) share the port and the
+ *    kernel spreads incoming connections between them.
+ *
+ * Results:
+ *    A standard Tcl result.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_rebind_reuseport(Tcl_Interp *interp, struct context_userdata_struct *userdata, int port)
+{
+#ifdef SO_REUSEPORT
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  int fd, one = 1;
+
+  if (userdata->listen_fd < 0 || getsockname(userdata->listen_fd, (struct sockaddr*) &addr, &addrlen) != 0) {
+    Tcl_AppendResult(interp, "unable to find the listening socket", NULL);
+    return TCL_ERROR;
+  }
+  if (addr.ss_family == AF_INET) {
+    ((struct sockaddr_in*) &addr)->sin_port = htons(port);
+  } else if (addr.ss_family == AF_INET6) {
+    ((struct sockaddr_in6*) &addr)->sin6_port = htons(port);
+  } else {
+    Tcl_AppendResult(interp, "unsupported address family for -reuseport", NULL);
+    return TCL_ERROR;
+  }
+
+  fd = socket(addr.ss_family, SOCK_STREAM, 0);
+  if (fd < 0) {
+    Tcl_AppendResult(interp, "unable to create socket: ", Tcl_ErrnoMsg(errno), NULL);
+    return TCL_ERROR;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+      bind(fd, (struct sockaddr*) &addr, addrlen) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    Tcl_AppendResult(interp, "unable to listen on port: ", Tcl_ErrnoMsg(errno), NULL);
+    close(fd);
+    return TCL_ERROR;
+  }
+
+  if (tclwebsockets_replace_listener(interp, userdata, fd) != TCL_OK) {
+    close(fd);
+    return TCL_ERROR;
+  }
+  return TCL_OK;
+#else
+  Tcl_AppendResult(interp, "-reuseport is not supported on this platform", NULL);
+  return TCL_ERROR;
+#endif
+}
+
+
+#ifdef TCL_THREADS
+
+//
+// A listener created with -threads N is run by N worker threads, each
+// with its own interpreter and libwebsockets context listening on the
+// same port with SO_REUSEPORT.  The creating thread only keeps this
+// record, behind the command returned by websockets::listen.
+//
+
+struct worker_struct {
+  struct listener_pool *pool;
+  int index;
+  Tcl_ThreadId threadId;
+  Tcl_Interp *interp;                   // only used by the worker thread itself.
+  int state;                            // 0 starting, 1 running, -1 failed.
+  int fd;                               // copy of the -fd socket its listener takes, or -1.
+  char *error;                          // startup error message, if failed.
+  int stop;                             // set by a stop event in the worker.
+  int draining;                         // 1 while drain waits for it, 0 once it is done,
+  int closed, forced;                   // with the counts its drain returned,
+  char *drain_error;                    // or the error, if it failed.
+};
+
+struct listener_pool {
+  Tcl_Interp *interp;                   // the creating interpreter.
+  Tcl_ThreadId parentThreadId;
+  Tcl_Command cmdToken;
+  int num_workers;
+  struct worker_struct *workers;
+  char *listen_args;                    // websockets::listen arguments for workers.
+  char *init_script;                    // replicated handlers and -threadinit script.
+  Tcl_Mutex mutex;                      // protects the worker states during startup.
+  Tcl_Condition cond;
+};
+
+// What a posted event asks the thread it is queued to do.
+enum post_kind { POST_SCRIPT, POST_STOP, POST_DRAIN };
+
+// Queued with Tcl_ThreadQueueEvent() to run a script in another thread.
+struct post_event {
+  Tcl_Event header;
+  struct listener_pool *pool;
+  struct worker_struct *worker;         // NULL if posted to the creating thread.
+  enum post_kind kind;
+  char *script;                         // run it, or for POST_DRAIN, drain with it.
+};
+
+
+static char *
+tclwebsockets_strdup(const char *str, int len)
+{
+  char *copy = ckalloc(len + 1);
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_worker_drain --
+ *
+ *    Run the drain script posted to a worker, in the worker, and report
+ *    its counts or its error to the thread waiting in $ctx drain.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_worker_drain(struct listener_pool *pool, struct worker_struct *worker, Tcl_Interp *interp, const char *script)
+{
+  static const char *keys[] = { "closed", "forced" };
+  Tcl_Obj *resultObj, *keyObj, *countObj;
+  int counts[2] = { 0, 0 }, code, i;
+
+  code = Tcl_EvalEx(interp, script, -1, TCL_EVAL_GLOBAL);
+  resultObj = Tcl_GetObjResult(interp);
+  for (i = 0; code == TCL_OK && i < 2; i++) {
+    keyObj = Tcl_NewStringObj(keys[i], -1);
+    Tcl_IncrRefCount(keyObj);
+    if (Tcl_DictObjGet(NULL, resultObj, keyObj, &countObj) == TCL_OK && countObj != NULL) {
+      Tcl_GetIntFromObj(NULL, countObj, &counts[i]);
+    }
+    Tcl_DecrRefCount(keyObj);
+  }
+
+  Tcl_MutexLock(&pool->mutex);
+  if (code == TCL_OK) {
+    worker->closed = counts[0];
+    worker->forced = counts[1];
+  } else {
+    const char *msg = Tcl_GetString(resultObj);
+    worker->drain_error = tclwebsockets_strdup(msg, strlen(msg));
+  }
+  worker->draining = 0;
+  Tcl_ConditionNotify(&pool->cond);
+  Tcl_MutexUnlock(&pool->mutex);
+}
 
 
-struct context_userdata_struct {
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_post_eventProc --
+ *
+ *    Runs a posted script, in the thread it was posted to.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_post_eventProc(Tcl_Event *evPtr, int flags)
+{
+  struct post_event *event = (struct post_event*) evPtr;
   Tcl_Interp *interp;
-  Tcl_Command cmdToken;
-  struct libwebsocket_context *context;
-  struct libwebsocket_protocols *protocols;
-};
 
+  if (event->kind == POST_STOP) {
+    event->worker->stop = 1;
+    return 1;
+  }
 
-struct websocket_session_struct {
-  const char *handler_name;             // pointer into protocol definition.
-  char statevar_namespace[64];
-  char connection_cmd_name[64];
-
-  Tcl_Interp *interp;
-  Tcl_Command cmdToken;
+  interp = (event->worker != NULL ? event->worker->interp : event->pool->interp);
 
-  //Tcl_Obj *queued_data;
-  struct libwebsocket *socket;
-  struct libwebsocket_context *context;
-};
+  Tcl_Preserve((ClientData) interp);
+  if (event->kind == POST_DRAIN) {
+    tclwebsockets_worker_drain(event->pool, event->worker, interp, event->script);
+  } else if (Tcl_EvalEx(interp, event->script, -1, TCL_EVAL_GLOBAL) == TCL_ERROR) {
+    Tcl_AddErrorInfo(interp, "\n    (websocket posted script)");
+    Tcl_BackgroundError(interp);
+  }
+  Tcl_ResetResult(interp);
+  Tcl_Release((ClientData) interp);
 
+  ckfree(event->script);
+  return 1;
+}
 
 
 /*
  *----------------------------------------------------------------------
  *
- * tclwebsockets_connectionCmd --
- *
- *    Allows the caller to invoke various commands against a client connection.
+ * tclwebsockets_post --
  *
- * Results:
- *    stuff
+ *    Queue a script (or a stop or drain request) for a worker thread, or
+ *    for the creating thread if worker is NULL, and wake that thread up.
  *
  *----------------------------------------------------------------------
  */
-int
-tclwebsockets_connectionCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+static void
+tclwebsockets_post(struct listener_pool *pool, struct worker_struct *worker, const char *script, int len, enum post_kind kind)
 {
-  struct websocket_session_struct *session_data = (struct websocket_session_struct*)cData;
+  struct post_event *event;
+  Tcl_ThreadId threadId = (worker != NULL ? worker->threadId : pool->parentThreadId);
+
+  event = (struct post_event*) ckalloc(sizeof(struct post_event));
+  event->header.proc = tclwebsockets_post_eventProc;
+  event->pool = pool;
+  event->worker = worker;
+  event->kind = kind;
+  event->script = (script != NULL ? tclwebsockets_strdup(script, len) : NULL);
+
+  Tcl_ThreadQueueEvent(threadId, (Tcl_Event*) event, TCL_QUEUE_TAIL);
+  Tcl_ThreadAlert(threadId);
+}
 
-  const char *commands[] = {
-    "close",
-    "write",
-    NULL
-  };
 
-  enum command_enum {
-    CMD_CLOSE,
-    CMD_WRITE
-  };
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_discard_eventProc --
+ *
+ *    Tcl_DeleteEvents() filter for scripts posted to the creating thread
+ *    by the workers of a pool that is being deleted.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_discard_eventProc(Tcl_Event *evPtr, ClientData cData)
+{
+  struct post_event *event = (struct post_event*) evPtr;
 
-  int cmdIndex;
+  if (evPtr->proc != tclwebsockets_post_eventProc || event->pool != (struct listener_pool*) cData) {
+    return 0;
+  }
+  if (event->script != NULL) {
+    ckfree(event->script);
+  }
+  return 1;
+}
 
 
-  // basic command line processing
-  if (objc < 1) {
-    Tcl_WrongNumArgs (interp, 1, objv, "missing argument");
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_workerPostCmd --
+ *
+ *    websockets::post script
+ *
+ *    Available in worker interpreters: evaluates the script in the
+ *    interpreter that created the listener, from its event loop.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_workerPostCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  struct worker_struct *worker = (struct worker_struct*) cData;
+  const char *script;
+  int len;
+
+  if (objc != 2) {
+    Tcl_WrongNumArgs (interp, 1, objv, "script");
     return TCL_ERROR;
   }
 
-  if (Tcl_GetIndexFromObj(interp, objv[1], commands, "command", TCL_EXACT, &cmdIndex) != TCL_OK) {
-    return TCL_ERROR;
+  script = Tcl_GetStringFromObj(objv[1], &len);
+  tclwebsockets_post(worker->pool, NULL, script, len, POST_SCRIPT);
+  return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_worker_main --
+ *
+ *    Body of a worker thread: set up an interpreter with the handlers
+ *    of the creating interpreter, create a listener sharing the port,
+ *    then run the event loop until asked to stop.
+ *
+ *----------------------------------------------------------------------
+ */
+static Tcl_ThreadCreateType
+tclwebsockets_worker_main(ClientData cData)
+{
+  struct worker_struct *worker = (struct worker_struct*) cData;
+  struct listener_pool *pool = worker->pool;
+  Tcl_Interp *interp;
+  Tcl_DString script;
+  int code;
+
+  interp = Tcl_CreateInterp();
+  worker->interp = interp;
+
+  // the script library is optional; handlers may not need it.
+  if (Tcl_Init(interp) != TCL_OK) {
+    Tcl_ResetResult(interp);
   }
 
-  switch (cmdIndex) {
-  case CMD_CLOSE: {
-    if (objc != 2) {
-      Tcl_WrongNumArgs (interp, 1, objv, "close takes no arguments");
-      return TCL_ERROR;
+  code = Tclwebsockets_Init(interp);
+  if (code == TCL_OK) {
+    Tcl_CreateObjCommand(interp, "websockets::post", (Tcl_ObjCmdProc *) tclwebsockets_workerPostCmd, (ClientData) worker, (Tcl_CmdDeleteProc *)NULL);
+    Tcl_SetVar2Ex(interp, "::websockets::workerIndex", NULL, Tcl_NewIntObj(worker->index), TCL_GLOBAL_ONLY);
+    code = Tcl_EvalEx(interp, pool->init_script, -1, TCL_EVAL_GLOBAL);
+  }
+  if (code == TCL_OK) {
+    Tcl_DStringInit(&script);
+    Tcl_DStringAppend(&script, "set ::websockets::context [websockets::listen ", -1);
+    Tcl_DStringAppend(&script, pool->listen_args, -1);
+    if (worker->fd >= 0) {
+      char fdStr[TCL_INTEGER_SPACE];
+      sprintf(fdStr, "%d", worker->fd);
+      Tcl_DStringAppend(&script, " -fd ", -1);
+      Tcl_DStringAppend(&script, fdStr, -1);
     }
-    libwebsocket_close_and_free_session(session_data->context, session_data->socket, LWS_CLOSE_STATUS_NORMAL);
-    
+    Tcl_DStringAppend(&script, "]", 1);
+    code = Tcl_EvalEx(interp, Tcl_DStringValue(&script), Tcl_DStringLength(&script), TCL_EVAL_GLOBAL);
+    Tcl_DStringFree(&script);
   }
 
-  case CMD_WRITE: {
-    char *p;
-    int len, nsent;
+  // report back to the thread waiting in tclwebsockets_start_pool().
+  Tcl_MutexLock(&pool->mutex);
+  if (code == TCL_OK) {
+    worker->state = 1;
+  } else {
+    const char *msg = Tcl_GetStringResult(interp);
+    worker->error = tclwebsockets_strdup(msg, strlen(msg));
+    worker->state = -1;
+  }
+  Tcl_ConditionNotify(&pool->cond);
+  Tcl_MutexUnlock(&pool->mutex);
 
-    if (objc != 3) {
-      Tcl_WrongNumArgs (interp, 1, objv, "value");
-      return TCL_ERROR;
+  if (code == TCL_OK) {
+    while (!worker->stop) {
+      Tcl_DoOneEvent(TCL_ALL_EVENTS);
     }
-
-    p = Tcl_GetStringFromObj (objv[2], &len);
-    if (len == 0) {
-      Tcl_AppendResult(interp, "invalid value", NULL);
-      return TCL_ERROR;
+    if (Tcl_EvalEx(interp, "$::websockets::context delete", -1, TCL_EVAL_GLOBAL) != TCL_OK) {
+      Tcl_BackgroundError(interp);
     }
+  }
 
-    nsent = libwebsocket_write(session_data->socket, (unsigned char*) p, (size_t) len, LWS_WRITE_TEXT);
-    if (nsent < 0) {
-      // TODO: maybe add to queued_data?
-      Tcl_AppendResult(interp, "error writing to socket ", session_data->connection_cmd_name, NULL);
-      return TCL_ERROR;
+  Tcl_DeleteInterp(interp);
+  Tcl_ExitThread(TCL_OK);
+  TCL_THREAD_CREATE_RETURN;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_stop_pool --
+ *
+ *    Ask every running worker of a pool to stop, wait for them and free
+ *    the pool.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_stop_pool(struct listener_pool *pool)
+{
+  int i, result;
+
+  for (i = 0; i < pool->num_workers; i++) {
+    if (pool->workers[i].state == 1) {
+      tclwebsockets_post(pool, &pool->workers[i], NULL, 0, POST_STOP);
     }
   }
-
-  default: break;
+  for (i = 0; i < pool->num_workers; i++) {
+    if (pool->workers[i].state != 0) {
+      Tcl_JoinThread(pool->workers[i].threadId, &result);
+    }
+    if (pool->workers[i].error != NULL) {
+      ckfree(pool->workers[i].error);
+    }
+    // a running listener owns its copy of the -fd socket.
+    if (pool->workers[i].state != 1 && pool->workers[i].fd >= 0) {
+      close(pool->workers[i].fd);
+    }
   }
 
-  return 0;
+  // scripts the workers posted to us that have not run yet.
+  Tcl_DeleteEvents(tclwebsockets_discard_eventProc, (ClientData) pool);
+
+  Tcl_MutexFinalize(&pool->mutex);
+  Tcl_ConditionFinalize(&pool->cond);
+  ckfree((char*) pool->workers);
+  ckfree(pool->listen_args);
+  ckfree(pool->init_script);
+  ckfree((char*) pool);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * tclwebsockets_contextCmd --
+ * tclwebsockets_pool_deleteProc --
  *
- *    Allows the caller to invoke various commands against a server context.
+ *    Stops the workers when the pool command goes away, whether by
+ *    $pool delete, rename or the deletion of the interpreter, so that
+ *    none of them is left running or posting to a freed interpreter.
  *
- * Results:
- *    stuff
+ *----------------------------------------------------------------------
+ */
+static void
+tclwebsockets_pool_deleteProc(ClientData cData)
+{
+  tclwebsockets_stop_pool((struct listener_pool*) cData);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_poolCmd --
+ *
+ *    The command returned by websockets::listen -threads N.
  *
  *----------------------------------------------------------------------
  */
 int
-tclwebsockets_contextCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+tclwebsockets_poolCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
-  struct context_userdata_struct *userdata = (struct context_userdata_struct*) cData;
+  struct listener_pool *pool = (struct listener_pool*) cData;
 
   const char *commands[] = {
     "service",
     "delete",
+    "broadcast",
+    "post",
+    "workers",
+    "drain",
     NULL
   };
 
   enum command_enum {
     CMD_SERVICE,
-    CMD_DELETE
+    CMD_DELETE,
+    CMD_BROADCAST,
+    CMD_POST,
+    CMD_WORKERS,
+    CMD_DRAIN
   };
 
-  int cmdIndex;
+  int cmdIndex, i;
 
 
   // basic command line processing
-  if (objc < 1) {
-    Tcl_WrongNumArgs (interp, 1, objv, "missing argument");
+  if (objc < 2) {
+    Tcl_WrongNumArgs (interp, 1, objv, "command ?arg ...?");
     return TCL_ERROR;
   }
 
@@ -163,282 +7246,274 @@ tclwebsockets_contextCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj
 
   switch (cmdIndex) {
   case CMD_SERVICE: {
-    // process pending socket events on the listener.
-    int n = libwebsocket_service(userdata->context, 50);    // block up to 50ms
-    if (n != 0) {
-      return TCL_ERROR;
+    // the workers service the sockets; just run what they posted to us.
+    Tcl_Time timeout = { 0, 50000 };    // block up to 50ms
+    Tcl_WaitForEvent(&timeout);
+    while (Tcl_DoOneEvent(TCL_ALL_EVENTS | TCL_DONT_WAIT)) {
+      // keep going.
     }
     break;
   }
   case CMD_DELETE: {
-    // stop and free the listener socket.
-    libwebsocket_context_destroy(userdata->context);
-
-    // free the memory for the protocol array.
-    ckfree((char*) userdata->protocols);
-
-    // delete the Tcl command
-    Tcl_DeleteCommandFromToken(userdata->interp, userdata->cmdToken);
-
+    // the delete proc stops the workers and frees the pool.
+    Tcl_DeleteCommandFromToken(interp, pool->cmdToken);
     break;
   }
-  default: break;
-  } // end switch
-
-  return 0;
-}
-
-/*
- *----------------------------------------------------------------------
- *
- * callback_websocket_handler --
- *
- *    Universal callback invoked by libwebsocket whenever an event
- *    occurs on a connection belonging to any of our protocols.
- *
- * Results:
- *    stuff
- *
- *----------------------------------------------------------------------
- */
-static int
-callback_websocket_handler(struct libwebsocket_context *context,
-		    struct libwebsocket *wsi,
-		    enum libwebsocket_callback_reasons reason,
-		    void *v_session_data, void *indata, size_t lendata)
-{
-  static const char *reason_strings[] = {
-    "established",                 // LWS_CALLBACK_ESTABLISHED,
-    "client-connection-error",     // LWS_CALLBACK_CLIENT_CONNECTION_ERROR,
-    "client-established",          // LWS_CALLBACK_CLIENT_ESTABLISHED,
-    "closed",                      // LWS_CALLBACK_CLOSED,
-    "receive",                     // LWS_CALLBACK_RECEIVE,
-    "client-receive",              // LWS_CALLBACK_CLIENT_RECEIVE,
-    "client-receive-pong",         // LWS_CALLBACK_CLIENT_RECEIVE_PONG,
-    "client-writeable",            // LWS_CALLBACK_CLIENT_WRITEABLE,
-    "server-writeable",            // LWS_CALLBACK_SERVER_WRITEABLE,
-    "http",                        // LWS_CALLBACK_HTTP,
-    "broadcast",                   // LWS_CALLBACK_BROADCAST,
-    "filter-network-connection",   // LWS_CALLBACK_FILTER_NETWORK_CONNECTION,
-    "filter-protocol-connection"   // LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION,
-  };
-
-  struct websocket_session_struct *session_data = (struct websocket_session_struct *)v_session_data;
-  struct context_userdata_struct *context_data = (struct context_userdata_struct*)libwebsockets_get_user_data(context);
-  Tcl_Obj *procargs = NULL;      // list of varnames
-  Tcl_Obj *procbody = NULL;      // code body
-  Tcl_Obj *statevars = NULL;     // list of varnames
-
-  if (reason >= sizeof(reason_strings) / sizeof(reason_strings[0])) {
-    // event reason is out of range, so no handler is possible.
-    return 0;
-  }
-
-  //fprintf(stderr, "callback_websocket_handler got reason %d\n", (int) reason);
-
-  //
-  // When a connection is first established, do some extra work to
-  // intitialize the session structure.
-  //
-  if (reason == LWS_CALLBACK_ESTABLISHED) {
-    const struct libwebsocket_protocols *protocol;
-    static unsigned long nextCmdIndex = 0;
-
-    // initialize session_data
-    protocol = libwebsockets_get_protocol(wsi);
-    session_data->handler_name = protocol->name;
-    session_data->interp = context_data->interp;
-    session_data->socket = wsi;
-    session_data->context = context;
-
-    //fprintf(stderr, "callback_websocket_handler initializing session_data \"%s\"\n", protocol->name);
-
-    // generate a unique session_array_name and connection_command_name.
-    snprintf(session_data->statevar_namespace, sizeof(session_data->statevar_namespace), "::websockets::statevars%lu", nextCmdIndex);
-    snprintf(session_data->connection_cmd_name, sizeof(session_data->connection_cmd_name), "websocket%lu", nextCmdIndex++);
-
-    Tcl_CreateNamespace(session_data->interp, session_data->statevar_namespace, NULL, NULL);
-
-    //session_data->queued_data = NULL;
-
-    // register a new command in the Tcl interpreter to represent this connection
-    // using connection_command_name and tclwebsockets_connectionCmd
-    // TODO: supply a delete handler instead of NULL
-    session_data->cmdToken = Tcl_CreateObjCommand(session_data->interp, session_data->connection_cmd_name, tclwebsockets_connectionCmd, session_data, NULL);
-
-  }
-
-  if (reason == LWS_CALLBACK_FILTER_NETWORK_CONNECTION || reason == LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION) {
-    //fprintf(stderr, "skipping.\n");
-    return 0;
-  }
-  if (!session_data || !session_data->socket) {
-    //fprintf(stderr, "bailing.\n");
-    return 0;
-  }
-
-  //
-  // Look up the definition from our registry array to find the list of "state variables".
-  //
-  {
-    int i, listc;
-    Tcl_Obj **listv;
-    Tcl_Obj *handlerRegistryList = NULL;   // key-value list of attributes (but currently only one possible key).
-
-    handlerRegistryList = Tcl_GetVar2Ex(session_data->interp, "::websockets::handlerRegistry", session_data->handler_name, TCL_GLOBAL_ONLY);
-    if (handlerRegistryList == NULL) {
-      fprintf(stderr, "callback_websocket_handler called for an unknown protocol \"%s\"\n", session_data->handler_name);
-      return -1;
+  case CMD_BROADCAST: {
+    // each worker broadcasts to its own connections.
+    Tcl_Obj *scriptObj;
+    const char *script;
+    int len;
+
+    if (objc < 3) {
+      Tcl_WrongNumArgs (interp, 2, objv, "?-binary|-text? ?-topic name? ?-nocompress? value");
+      return TCL_ERROR;
     }
-    if (Tcl_ListObjGetElements(session_data->interp, handlerRegistryList, &listc, &listv) == TCL_ERROR || (listc % 2) != 0) {
-      return -1;                 // not a list, or not an even-numbered list of elements.
+    scriptObj = Tcl_NewStringObj("$::websockets::context broadcast", -1);
+    for (i = 2; i < objc; i++) {
+      Tcl_AppendToObj(scriptObj, " ", 1);
+      Tcl_AppendObjToObj(scriptObj, Tcl_NewListObj(1, &objv[i]));
     }
-   
-    // walk through the key-value list and save the value associated with the "statevars" key.
-    for (i = 0; i < listc; i += 2) {
-      const char *keyName = Tcl_GetString(listv[i]);
-      if (strcmp(keyName, "statevars") == 0) {
-	statevars = listv[i+1];
-	//Tcl_IncrRefCount(statevars);
-	break;
-      }
+    Tcl_IncrRefCount(scriptObj);
+    script = Tcl_GetStringFromObj(scriptObj, &len);
+    for (i = 0; i < pool->num_workers; i++) {
+      tclwebsockets_post(pool, &pool->workers[i], script, len, POST_SCRIPT);
     }
+    Tcl_DecrRefCount(scriptObj);
+    break;
   }
+  case CMD_POST: {
+    const char *script;
+    int len, index = -1;
 
-
-  //
-  // Look up the details about the proc that was registered for this event.
-  //
-  {
-    int listc;
-    Tcl_Obj **listv;
-    Tcl_Obj *handlerMethodList;
-
-    // build the name of the array element to find.
-    int methodKeyLength = strlen(session_data->handler_name) + 1 + strlen(reason_strings[reason]) + 1;;
-    char *methodKey = ckalloc(methodKeyLength);
-    snprintf(methodKey, methodKeyLength, "%s:%s", session_data->handler_name, reason_strings[reason]);
-
-    // Fetch the array element that should contain the registered proc.
-    // Should be list of 2 elements: procargs procbody
-    handlerMethodList = Tcl_GetVar2Ex(session_data->interp, "::websockets::handlerMethods", methodKey, TCL_GLOBAL_ONLY);
-    ckfree(methodKey);
-    if (handlerMethodList == NULL) {
-      // no handler defined for this event method.
-      return 0;
-    }
-    if (Tcl_ListObjGetElements(session_data->interp, handlerMethodList, &listc, &listv) == TCL_ERROR || listc != 2) {
-      // invalid method definition.  Expecting list of: procargs procbody
-      return 0;
+    if (objc == 5 && strcmp(Tcl_GetString(objv[2]), "-worker") == 0) {
+      if (Tcl_GetIntFromObj(interp, objv[3], &index) != TCL_OK) {
+	return TCL_ERROR;
+      }
+      if (index < 0 || index >= pool->num_workers) {
+	Tcl_AppendResult(interp, "no such worker \"", Tcl_GetString(objv[3]), "\"", NULL);
+	return TCL_ERROR;
+      }
+    } else if (objc != 3) {
+      Tcl_WrongNumArgs (interp, 2, objv, "?-worker index? script");
+      return TCL_ERROR;
     }
-    procargs = listv[0];
-    procbody = listv[1];
-    //Tcl_IncrRefCount(procargs);
-    //Tcl_IncrRefCount(procbody);
-  }
 
-
-
-  //
-  // Bind all of the state vars using "namespace upvar".
-  //
-  {
-    int i, listc;
-    Tcl_Obj **listv;
-
-    if (statevars != NULL && Tcl_ListObjGetElements(session_data->interp, statevars, &listc, &listv) != TCL_ERROR && listc > 0) {
-      Tcl_Obj *cmdAry[3] = { 
-	Tcl_NewStringObj("namespace", -1), 
-	Tcl_NewStringObj("upvar", -1), 
-	Tcl_NewStringObj(session_data->statevar_namespace, -1)
-      };
-      Tcl_Obj *cmdListObj = Tcl_NewListObj(sizeof(cmdAry) / sizeof(cmdAry[0]), cmdAry);
-      Tcl_IncrRefCount(cmdListObj);
-
-      for (i = 0; i < listc; i++) {
-	Tcl_ListObjAppendElement(session_data->interp, cmdListObj, listv[i]);
-	Tcl_ListObjAppendElement(session_data->interp, cmdListObj, listv[i]);
+    script = Tcl_GetStringFromObj(objv[objc - 1], &len);
+    for (i = 0; i < pool->num_workers; i++) {
+      if (index < 0 || index == i) {
+	tclwebsockets_post(pool, &pool->workers[i], script, len, POST_SCRIPT);
       }
-
-      Tcl_EvalObjEx(session_data->interp, cmdListObj, 0);
-      Tcl_DecrRefCount(cmdListObj);
     }
+    break;
   }
-
-
-  //
-  // Set the proc arguments.
-  //
-  {
-    int listc;
-    Tcl_Obj **listv;
-    
-    if (Tcl_ListObjGetElements(session_data->interp, procargs, &listc, &listv) != TCL_ERROR) {
-      if (listc > 0) {
-	Tcl_SetVar(session_data->interp, Tcl_GetString(listv[0]), session_data->connection_cmd_name, 0);
+  case CMD_WORKERS: {
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(pool->num_workers));
+    break;
+  }
+  case CMD_DRAIN: {
+    // each worker drains its own connections, in parallel, while we
+    // wait for all of them to report back.
+    char script[64];
+    int timeout_ms = DEFAULT_DRAIN_TIMEOUT, closed = 0, forced = 0, waiting, code = TCL_OK;
+    Tcl_Obj *resultObj;
+
+    if (objc == 4 && strcmp(Tcl_GetString(objv[2]), "-timeout") == 0) {
+      if (Tcl_GetIntFromObj(interp, objv[3], &timeout_ms) != TCL_OK) {
+	return TCL_ERROR;
+      }
+      if (timeout_ms < 0) {
+	Tcl_AppendResult(interp, "-timeout must not be negative", NULL);
+	return TCL_ERROR;
+      }
+    } else if (objc != 2) {
+      Tcl_WrongNumArgs (interp, 2, objv, "?-timeout ms?");
+      return TCL_ERROR;
+    }
+    snprintf(script, sizeof(script), "$::websockets::context drain -timeout %d", timeout_ms);
+    Tcl_MutexLock(&pool->mutex);
+    for (i = 0; i < pool->num_workers; i++) {
+      pool->workers[i].closed = pool->workers[i].forced = 0;
+      if (pool->workers[i].state == 1) {
+	pool->workers[i].draining = 1;
+	tclwebsockets_post(pool, &pool->workers[i], script, strlen(script), POST_DRAIN);
+      }
+    }
+    do {
+      waiting = 0;
+      for (i = 0; i < pool->num_workers; i++) {
+	waiting += pool->workers[i].draining;
       }
-      if (listc > 1) {
-	// TODO: use binary instead of string? Tcl_NewByteArrayObj(indata, lendata)
-	Tcl_Obj *dataobj = Tcl_NewStringObj(indata, lendata);
-	Tcl_SetVar2Ex(session_data->interp, Tcl_GetString(listv[1]), NULL, dataobj, 0);
+      if (waiting > 0) {
+	Tcl_ConditionWait(&pool->cond, &pool->mutex, NULL);
       }
+    } while (waiting > 0);
+    Tcl_MutexUnlock(&pool->mutex);
+
+    // a worker that failed fails the drain, once all of them are done.
+    for (i = 0; i < pool->num_workers; i++) {
+      struct worker_struct *worker = &pool->workers[i];
+      if (worker->drain_error != NULL) {
+	if (code == TCL_OK) {
+	  Tcl_AppendResult(interp, worker->drain_error, NULL);
+	  code = TCL_ERROR;
+	}
+	ckfree(worker->drain_error);
+	worker->drain_error = NULL;
+      }
+      closed += worker->closed;
+      forced += worker->forced;
+    }
+    if (code != TCL_OK) {
+      return TCL_ERROR;
     }
+    resultObj = Tcl_NewObj();
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("closed", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(closed));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("forced", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewIntObj(forced));
+    Tcl_SetObjResult(interp, resultObj);
+    break;
   }
+  default: break;
+  } // end switch
 
-  Tcl_EvalObjEx(session_data->interp, procbody, 0);  
+  return TCL_OK;
+}
 
 
-  /*
-  switch (reason) {
-  case LWS_CALLBACK_ESTABLISHED: {
-    //"established"
-    break;
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_start_pool --
+ *
+ *    Start the worker threads of websockets::listen -threads N.  Each
+ *    worker is given the listen arguments without -threads/-threadinit
+ *    and with -eventloop 1 -reuseport 1, and its interpreter is first
+ *    given the handler definitions of this one.  With -fd, the workers
+ *    instead accept from copies of the inherited socket.
+ *
+ * Results:
+ *    A standard Tcl result; the name of the pool command on success.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+tclwebsockets_start_pool(Tcl_Interp *interp, int num_threads, Tcl_Obj *threadInitObj, int inherited_fd, int objc, Tcl_Obj *CONST objv[])
+{
+  struct interp_data_struct *interpdata = (struct interp_data_struct*) Tcl_GetAssocData(interp, "tclwebsockets", NULL);
+  struct listener_pool *pool;
+  Tcl_Obj *argsObj;
+  Tcl_DString initScript;
+  const char *str;
+  char commandName[64];
+  int i, len, failed = 0;
+
+  // the listen arguments for the workers.
+  argsObj = Tcl_NewListObj(0, NULL);
+  Tcl_IncrRefCount(argsObj);
+  for (i = 1; i + 1 < objc; i += 2) {
+    str = Tcl_GetString(objv[i]);
+    if (strcmp(str, "-threads") == 0 || strcmp(str, "-threadinit") == 0 ||
+	strcmp(str, "-eventloop") == 0 || strcmp(str, "-reuseport") == 0 || strcmp(str, "-fd") == 0) {
+      continue;
+    }
+    Tcl_ListObjAppendElement(NULL, argsObj, objv[i]);
+    Tcl_ListObjAppendElement(NULL, argsObj, objv[i + 1]);
   }
-
-  case LWS_CALLBACK_BROADCAST: {
-    //"broadcast"
-    break;
+  Tcl_ListObjAppendElement(NULL, argsObj, Tcl_NewStringObj("-eventloop", -1));
+  Tcl_ListObjAppendElement(NULL, argsObj, Tcl_NewIntObj(1));
+  if (inherited_fd < 0) {
+    Tcl_ListObjAppendElement(NULL, argsObj, Tcl_NewStringObj("-reuseport", -1));
+    Tcl_ListObjAppendElement(NULL, argsObj, Tcl_NewIntObj(1));
   }
 
-  case LWS_CALLBACK_FILTER_NETWORK_CONNECTION: {
-    //"filter-network"
-    break;
+  // the handler definitions, followed by the -threadinit script.
+  if (Tcl_EvalEx(interp, "::websockets::replicate", -1, TCL_EVAL_GLOBAL) != TCL_OK) {
+    Tcl_DecrRefCount(argsObj);
+    return TCL_ERROR;
   }
-  case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION: {
-    //"filter-protocol"
-    break;
+  Tcl_DStringInit(&initScript);
+  Tcl_DStringAppend(&initScript, Tcl_GetStringResult(interp), -1);
+  Tcl_ResetResult(interp);
+  if (threadInitObj != NULL) {
+    Tcl_DStringAppend(&initScript, "\n", 1);
+    Tcl_DStringAppend(&initScript, Tcl_GetString(threadInitObj), -1);
   }
-  case LWS_CALLBACK_HTTP: {
-    //"http"
-    break;
+
+  pool = (struct listener_pool*) ckalloc(sizeof(struct listener_pool));
+  memset(pool, 0, sizeof(struct listener_pool));
+  pool->interp = interp;
+  pool->parentThreadId = Tcl_GetCurrentThread();
+  pool->num_workers = num_threads;
+  pool->workers = (struct worker_struct*) ckalloc(sizeof(struct worker_struct) * num_threads);
+  memset(pool->workers, 0, sizeof(struct worker_struct) * num_threads);
+  for (i = 0; i < num_threads; i++) {
+    pool->workers[i].fd = -1;
   }
-  case LWS_CALLBACK_RECEIVE: {
-    //"receive"
-    // do something with in, len
-    break;
+  str = Tcl_GetStringFromObj(argsObj, &len);
+  pool->listen_args = tclwebsockets_strdup(str, len);
+  pool->init_script = tclwebsockets_strdup(Tcl_DStringValue(&initScript), Tcl_DStringLength(&initScript));
+  Tcl_DStringFree(&initScript);
+  Tcl_DecrRefCount(argsObj);
+
+  // start the workers, and wait until each has its listener or failed.
+  for (i = 0; i < num_threads; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+    if (inherited_fd >= 0 && (pool->workers[i].fd = dup(inherited_fd)) < 0) {
+      Tcl_AppendResult(interp, "unable to duplicate -fd: ", Tcl_ErrnoMsg(errno), NULL);
+      failed = 1;
+      break;
+    }
+    Tcl_MutexLock(&pool->mutex);
+    if (Tcl_CreateThread(&pool->workers[i].threadId, tclwebsockets_worker_main, (ClientData) &pool->workers[i],
+			 TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+      Tcl_MutexUnlock(&pool->mutex);
+      Tcl_AppendResult(interp, "unable to create worker thread", NULL);
+      failed = 1;
+      break;
+    }
+    while (pool->workers[i].state == 0) {
+      Tcl_ConditionWait(&pool->cond, &pool->mutex, NULL);
+    }
+    Tcl_MutexUnlock(&pool->mutex);
+    if (pool->workers[i].state < 0) {
+      char indexStr[TCL_INTEGER_SPACE];
+      sprintf(indexStr, "%d", i);
+      Tcl_AppendResult(interp, "worker ", indexStr, ": ", pool->workers[i].error, NULL);
+      failed = 1;
+      break;
+    }
   }
-  case LWS_CALLBACK_SERVER_WRITEABLE: {
-    // TODO: consider implementing queuing for sent data.
-    //if (session_data->queued_data != NULL) {
-      //...
-    //}
-    break;
+  if (failed) {
+    tclwebsockets_stop_pool(pool);
+    return TCL_ERROR;
   }
 
-  case LWS_CALLBACK_CLOSED: {
-    // delete the Tcl command for this connection.
-    // unset the session array.
-    break;
+  // the workers have their own copies now.
+  if (inherited_fd >= 0) {
+    close(inherited_fd);
   }
 
-  default: break;
-  }
-*/
-    
+  // create a Tcl command to interface with the pool.
+  snprintf(commandName, sizeof(commandName), "lwscontext%lu", interpdata->nextContextIndex++);
+  pool->cmdToken = Tcl_CreateObjCommand(interp, commandName, tclwebsockets_poolCmd, pool, tclwebsockets_pool_deleteProc);
+  Tcl_SetObjResult(interp, Tcl_NewStringObj(commandName, -1));
+  return TCL_OK;
+}
 
-  return 0;
+#else
+
+static int
+tclwebsockets_start_pool(Tcl_Interp *interp, int num_threads, Tcl_Obj *threadInitObj, int inherited_fd, int objc, Tcl_Obj *CONST objv[])
+{
+  Tcl_AppendResult(interp, "-threads requires a threaded build of Tcl", NULL);
+  return TCL_ERROR;
 }
 
+#endif /* TCL_THREADS */
+
 
 /*
  *----------------------------------------------------------------------
@@ -457,12 +7532,35 @@ tclwebsockets_listenCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj
 {
   int i;
   int suboptIndex;
-  int port = 0;
+  int port = -1;
   int use_ssl = 0;
+  int use_eventloop = 0;
+  int create_commands = 1;
+  int use_reuseport = 0;
+  int inherited_fd = -1;
+  int num_threads = 0;
+  Tcl_Obj *threadInitObj = NULL;
+  Tcl_Obj *compressionObj = NULL;
+  Tcl_WideInt maxmessage = DEFAULT_MAXMESSAGE;
+  Tcl_WideInt ping_interval = 0;
+  Tcl_WideInt idle_timeout = 0;
+  int max_connections = 0;
+  struct rate_limit connect_rate = { 0, 0 };
+  struct rate_limit message_rate = { 0, 0 };
+  char docroot[PATH_MAX] = "";
+  Tcl_WideInt filecache = FILE_CACHE_DEFAULT_BYTES;
+  Tcl_Obj *tlsObjs[6] = { NULL, NULL, NULL, NULL, NULL, NULL };   // -sessioncache ... -alpn
+  struct tls_state *tls = NULL;
+  struct compression_struct *compression = NULL;
+  struct libwebsocket_extension *extensions = libwebsocket_internal_extensions;
+  Tcl_WideInt highwater = DEFAULT_HIGHWATER;
+  Tcl_WideInt lowwater = DEFAULT_LOWWATER;
+  int lowwater_given = 0;
   char interface_name[128] = "";
   char cert_path[PATH_MAX] = "";
   char key_path[PATH_MAX] = "";
   struct libwebsocket_protocols *protocols = NULL;
+  int num_protocols = 0;
   struct libwebsocket_context *context = NULL;
   struct context_userdata_struct *userdata = NULL;
   
@@ -473,6 +7571,29 @@ tclwebsockets_listenCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj
     "-certificate",
     "-privatekey",
     "-handlers",
+    "-eventloop",
+    "-highwater",
+    "-lowwater",
+    "-commands",
+    "-reuseport",
+    "-threads",
+    "-threadinit",
+    "-compression",
+    "-maxmessage",
+    "-pinginterval",
+    "-idletimeout",
+    "-maxconnections",
+    "-connectrate",
+    "-messagerate",
+    "-docroot",
+    "-filecache",
+    "-sessioncache",
+    "-sessiontimeout",
+    "-ticketkeys",
+    "-ciphers",
+    "-curves",
+    "-alpn",
+    "-fd",
     NULL
   };
 
@@ -482,12 +7603,35 @@ tclwebsockets_listenCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj
     SUBOPT_SSL,
     SUBOPT_CERTIFICATE,
     SUBOPT_PRIVATEKEY,
-    SUBOPT_HANDLERS
+    SUBOPT_HANDLERS,
+    SUBOPT_EVENTLOOP,
+    SUBOPT_HIGHWATER,
+    SUBOPT_LOWWATER,
+    SUBOPT_COMMANDS,
+    SUBOPT_REUSEPORT,
+    SUBOPT_THREADS,
+    SUBOPT_THREADINIT,
+    SUBOPT_COMPRESSION,
+    SUBOPT_MAXMESSAGE,
+    SUBOPT_PINGINTERVAL,
+    SUBOPT_IDLETIMEOUT,
+    SUBOPT_MAXCONNECTIONS,
+    SUBOPT_CONNECTRATE,
+    SUBOPT_MESSAGERATE,
+    SUBOPT_DOCROOT,
+    SUBOPT_FILECACHE,
+    SUBOPT_SESSIONCACHE,
+    SUBOPT_SESSIONTIMEOUT,
+    SUBOPT_TICKETKEYS,
+    SUBOPT_CIPHERS,
+    SUBOPT_CURVES,
+    SUBOPT_ALPN,
+    SUBOPT_FD
   };
 
   // basic command line processing
   if (objc < 3 || (objc & 1) == 0) {
-    Tcl_WrongNumArgs (interp, 1, objv, "listen -port integer ?-interface ipaddr? ?-ssl bool? ?-certificate filename? ?-privatekey -filename? ?-handlers list?");
+    Tcl_WrongNumArgs (interp, 1, objv, "listen -port integer ?-interface ipaddr? ?-ssl bool? ?-certificate filename? ?-privatekey -filename? ?-handlers list? ?-eventloop bool? ?-highwater bytes? ?-lowwater bytes? ?-commands bool? ?-reuseport bool? ?-threads count? ?-threadinit script? ?-compression settings? ?-maxmessage bytes? ?-pinginterval ms? ?-idletimeout ms? ?-maxconnections count? ?-connectrate {rate ?burst?}? ?-messagerate {rate ?burst?}? ?-docroot directory? ?-filecache bytes? ?-sessioncache entries? ?-sessiontimeout seconds? ?-ticketkeys filename? ?-ciphers list? ?-curves list? ?-alpn protocols? ?-fd fd?");
     return TCL_ERROR;
   }
 
@@ -512,7 +7656,8 @@ tclwebsockets_listenCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj
       if (Tcl_GetLongFromObj (interp, objv[++i], &lon) == TCL_ERROR) {
 	return TCL_ERROR;
       }
-      if (lon <= 0 || lon > 0xFFFF) {
+      // 0 creates a context for outbound connections only.
+      if (lon < 0 || lon > 0xFFFF) {
 	Tcl_AppendResult(interp, "invalid value for -port", NULL);
 	return TCL_ERROR;
       }
@@ -550,117 +7695,356 @@ tclwebsockets_listenCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj
 	Tcl_WrongNumArgs (interp, 1, objv, "-ssl value");
 	return TCL_ERROR;
       }
-
-      if (Tcl_GetBooleanFromObj (interp, objv[++i], &use_ssl) == TCL_ERROR) {
+
+      if (Tcl_GetBooleanFromObj (interp, objv[++i], &use_ssl) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      break;
+    }
+    case SUBOPT_CERTIFICATE: {
+      char *value;
+      int   len;
+
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, "-certificate value");
+	return TCL_ERROR;
+      }
+
+      value = Tcl_GetStringFromObj (objv[++i], &len);
+      if (len == 0 || len >= sizeof(cert_path)) {
+	Tcl_AppendResult(interp, "invalid value \"", value, "\" for -certificate", NULL);
+	return TCL_ERROR;
+      }
+
+      // save to variable cert_path
+      strncpy(cert_path, value, sizeof(cert_path));
+      cert_path[sizeof(cert_path) - 1] = '\0';
+      break;
+    }
+    case SUBOPT_PRIVATEKEY: {
+      // save to variable key_path
+      char *value;
+      int   len;
+
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, "-privatekey value");
+	return TCL_ERROR;
+      }
+
+      value = Tcl_GetStringFromObj (objv[++i], &len);
+      if (len == 0 || len >= sizeof(key_path)) {
+	Tcl_AppendResult(interp, "invalid value \"", value, "\" for -privatekey", NULL);
+	return TCL_ERROR;
+      }
+
+      // save to variable
+      strncpy(key_path, value, sizeof(key_path));
+      key_path[sizeof(key_path) - 1] = '\0';
+      break;
+    }
+    case SUBOPT_HANDLERS: {
+      // save to variable
+      int num_handlers = 0;
+      int q;
+
+      if (protocols != NULL) {
+	Tcl_AppendResult(interp, "-handlers may only be specified once", NULL);
+	return TCL_ERROR;
+      }
+
+      // validate the length of the list of handlers.
+      if (Tcl_ListObjLength(interp, objv[++i], &num_handlers) != TCL_OK) {
+	return TCL_ERROR;
+      }
+      if (num_handlers < 1) {
+	Tcl_AppendResult(interp, "-handlers must have a non-empty list argument", NULL);
+	return TCL_ERROR;
+      }
+
+      // allocate memory for the native structure, plus the list terminator.
+      protocols = (struct libwebsocket_protocols*) ckalloc(sizeof(struct libwebsocket_protocols) * (num_handlers + 1));
+      if (protocols == NULL) {
+	return TCL_ERROR;
+      }
+      memset(protocols, 0, sizeof(struct libwebsocket_protocols) * (num_handlers + 1));
+
+      // populate the protocol structure array.
+      for (q = 0; q < num_handlers; q++) {
+	Tcl_Obj *handlerNameObj;
+	char *handlerName, *handlerNameCopy;
+	int handlerLen;
+	Tcl_Obj *handlerRegistryList;
+
+	if (Tcl_ListObjIndex(interp, objv[i], q, &handlerNameObj) != TCL_OK) {
+	  return TCL_ERROR;
+	}
+	handlerName = Tcl_GetStringFromObj(handlerNameObj, &handlerLen);
+
+	// Look up the definition from our registry array.
+	handlerRegistryList = Tcl_GetVar2Ex(interp, "::websockets::handlerRegistry", handlerName, TCL_GLOBAL_ONLY);
+	if (handlerRegistryList == NULL) {
+	  Tcl_AppendResult(interp, "-handlers specified \"", handlerName, "\" but was not defined yet", NULL);
+	  return TCL_ERROR;
+	}
+
+	// Duplicate and copy the handler name.
+	handlerNameCopy = ckalloc(handlerLen + 1);
+	if (handlerNameCopy == NULL) {
+	  return TCL_ERROR;
+	}
+	strncpy(handlerNameCopy, handlerName, handlerLen);
+	handlerNameCopy[handlerLen] = '\0';
+	protocols[q].name = handlerNameCopy;
+
+	// Set the callback and session structure size.
+	protocols[q].callback = callback_websocket_handler;
+	protocols[q].per_session_data_size = sizeof(struct websocket_session_struct);
+      }
+
+      // explicitly zero the terminating entry (even though we memset it all to zero).
+      protocols[q].name = NULL;
+      protocols[q].callback = NULL;
+      protocols[q].per_session_data_size = 0;
+      num_protocols = num_handlers;
+
+      break;
+    }
+    case SUBOPT_EVENTLOOP: {
+      // verify boolean
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, "-eventloop value");
+	return TCL_ERROR;
+      }
+
+      if (Tcl_GetBooleanFromObj (interp, objv[++i], &use_eventloop) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      break;
+    }
+    case SUBOPT_HIGHWATER: {
+      // verify byte count; 0 disables the limit.
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, "-highwater value");
+	return TCL_ERROR;
+      }
+
+      if (Tcl_GetWideIntFromObj (interp, objv[++i], &highwater) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (highwater < 0) {
+	Tcl_AppendResult(interp, "-highwater must not be negative", NULL);
+	return TCL_ERROR;
+      }
+      break;
+    }
+    case SUBOPT_LOWWATER: {
+      // verify byte count
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, "-lowwater value");
+	return TCL_ERROR;
+      }
+
+      if (Tcl_GetWideIntFromObj (interp, objv[++i], &lowwater) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (lowwater < 0) {
+	Tcl_AppendResult(interp, "-lowwater must not be negative", NULL);
+	return TCL_ERROR;
+      }
+      lowwater_given = 1;
+      break;
+    }
+    case SUBOPT_COMMANDS: {
+      // verify boolean
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, "-commands value");
+	return TCL_ERROR;
+      }
+
+      if (Tcl_GetBooleanFromObj (interp, objv[++i], &create_commands) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      break;
+    }
+    case SUBOPT_REUSEPORT: {
+      // verify boolean
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, "-reuseport value");
+	return TCL_ERROR;
+      }
+
+      if (Tcl_GetBooleanFromObj (interp, objv[++i], &use_reuseport) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      break;
+    }
+    case SUBOPT_THREADS: {
+      // verify integer; 0 services the listener in this thread.
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, "-threads value");
+	return TCL_ERROR;
+      }
+
+      if (Tcl_GetIntFromObj (interp, objv[++i], &num_threads) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (num_threads < 0) {
+	Tcl_AppendResult(interp, "-threads must not be negative", NULL);
+	return TCL_ERROR;
+      }
+      break;
+    }
+    case SUBOPT_THREADINIT: {
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, "-threadinit value");
+	return TCL_ERROR;
+      }
+      threadInitObj = objv[++i];
+      break;
+    }
+    case SUBOPT_COMPRESSION: {
+      // validated once the other options are known.
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, "-compression value");
+	return TCL_ERROR;
+      }
+      compressionObj = objv[++i];
+      break;
+    }
+    case SUBOPT_MAXMESSAGE: {
+      // verify byte count; 0 disables the limit.
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, "-maxmessage value");
+	return TCL_ERROR;
+      }
+
+      if (Tcl_GetWideIntFromObj (interp, objv[++i], &maxmessage) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (maxmessage < 0) {
+	Tcl_AppendResult(interp, "-maxmessage must not be negative", NULL);
+	return TCL_ERROR;
+      }
+      break;
+    }
+    case SUBOPT_PINGINTERVAL:
+    case SUBOPT_IDLETIMEOUT: {
+      // verify milliseconds; 0 turns it off.
+      Tcl_WideInt *valuePtr = (suboptIndex == SUBOPT_PINGINTERVAL ? &ping_interval : &idle_timeout);
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, (suboptIndex == SUBOPT_PINGINTERVAL ? "-pinginterval value" : "-idletimeout value"));
+	return TCL_ERROR;
+      }
+
+      if (Tcl_GetWideIntFromObj (interp, objv[++i], valuePtr) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (*valuePtr < 0 || *valuePtr > INT_MAX) {
+	Tcl_AppendResult(interp, Tcl_GetString(objv[i - 1]), " must be between 0 and 2147483647 milliseconds", NULL);
+	return TCL_ERROR;
+      }
+      break;
+    }
+    case SUBOPT_MAXCONNECTIONS: {
+      // verify count; 0 disables the limit.
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, "-maxconnections value");
+	return TCL_ERROR;
+      }
+
+      if (Tcl_GetIntFromObj (interp, objv[++i], &max_connections) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (max_connections < 0) {
+	Tcl_AppendResult(interp, "-maxconnections must not be negative", NULL);
 	return TCL_ERROR;
       }
       break;
     }
-    case SUBOPT_CERTIFICATE: {
-      char *value;
-      int   len;
-
+    case SUBOPT_CONNECTRATE:
+    case SUBOPT_MESSAGERATE: {
       if (i + 1 >= objc) {
-	Tcl_WrongNumArgs (interp, 1, objv, "-certificate value");
+	Tcl_WrongNumArgs (interp, 1, objv, (suboptIndex == SUBOPT_CONNECTRATE ? "-connectrate value" : "-messagerate value"));
 	return TCL_ERROR;
       }
 
-      value = Tcl_GetStringFromObj (objv[++i], &len);
-      if (len == 0 || len >= sizeof(cert_path)) {
-	Tcl_AppendResult(interp, "invalid value \"", value, "\" for -certificate", NULL);
+      if (tclwebsockets_parse_rate(interp, objv[i + 1], Tcl_GetString(objv[i]),
+				   (suboptIndex == SUBOPT_CONNECTRATE ? &connect_rate : &message_rate)) != TCL_OK) {
 	return TCL_ERROR;
       }
-
-      // save to variable cert_path
-      strncpy(cert_path, value, sizeof(cert_path));
-      cert_path[sizeof(cert_path) - 1] = '\0';
+      i++;
       break;
     }
-    case SUBOPT_PRIVATEKEY: {
-      // save to variable key_path
+    case SUBOPT_DOCROOT: {
+      // verify directory
+      struct stat st;
       char *value;
       int   len;
 
       if (i + 1 >= objc) {
-	Tcl_WrongNumArgs (interp, 1, objv, "-privatekey value");
+	Tcl_WrongNumArgs (interp, 1, objv, "-docroot value");
 	return TCL_ERROR;
       }
 
       value = Tcl_GetStringFromObj (objv[++i], &len);
-      if (len == 0 || len >= sizeof(key_path)) {
-	Tcl_AppendResult(interp, "invalid value \"", value, "\" for -privatekey", NULL);
+      if (len == 0 || len >= sizeof(docroot) || stat(value, &st) != 0 || !S_ISDIR(st.st_mode)) {
+	Tcl_AppendResult(interp, "invalid value \"", value, "\" for -docroot: not a directory", NULL);
 	return TCL_ERROR;
       }
 
-      // save to variable
-      strncpy(key_path, value, sizeof(key_path));
-      key_path[sizeof(key_path) - 1] = '\0';
+      // request paths start with a slash.
+      strcpy(docroot, value);
+      while (len > 1 && docroot[len - 1] == '/') {
+	docroot[--len] = '\0';
+      }
       break;
     }
-    case SUBOPT_HANDLERS: {
-      // save to variable
-      int num_handlers = 0;
-      int q;
-
-      if (protocols != NULL) {
-	Tcl_AppendResult(interp, "-handlers may only be specified once", NULL);
+    case SUBOPT_FILECACHE: {
+      // verify byte count; 0 sends every file from disk.
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, "-filecache value");
 	return TCL_ERROR;
       }
 
-      // validate the length of the list of handlers.
-      if (Tcl_ListObjLength(interp, objv[++i], &num_handlers) != TCL_OK) {
+      if (Tcl_GetWideIntFromObj (interp, objv[++i], &filecache) == TCL_ERROR) {
 	return TCL_ERROR;
       }
-      if (num_handlers < 1) {
-	Tcl_AppendResult(interp, "-handlers must have a non-empty list argument", NULL);
+      if (filecache < 0) {
+	Tcl_AppendResult(interp, "-filecache must not be negative", NULL);
 	return TCL_ERROR;
       }
-
-      // allocate memory for the native structure, plus the list terminator.
-      protocols = (struct libwebsocket_protocols*) ckalloc(sizeof(struct libwebsocket_protocols) * (num_handlers + 1));
-      if (protocols == NULL) {
+      break;
+    }
+    case SUBOPT_SESSIONCACHE:
+    case SUBOPT_SESSIONTIMEOUT:
+    case SUBOPT_TICKETKEYS:
+    case SUBOPT_CIPHERS:
+    case SUBOPT_CURVES:
+    case SUBOPT_ALPN: {
+      // validated once -ssl is known.
+      if (i + 1 >= objc) {
+	char usage[32];
+	snprintf(usage, sizeof(usage), "%s value", subOptions[suboptIndex]);
+	Tcl_WrongNumArgs (interp, 1, objv, usage);
 	return TCL_ERROR;
       }
-      memset(protocols, 0, sizeof(struct libwebsocket_protocols) * (num_handlers + 1));
-
-      // populate the protocol structure array.
-      for (q = 0; q < num_handlers; q++) {
-	Tcl_Obj *handlerNameObj;
-	char *handlerName, *handlerNameCopy;
-	int handlerLen;
-	Tcl_Obj *handlerRegistryList;
-
-	if (Tcl_ListObjIndex(interp, objv[i], q, &handlerNameObj) != TCL_OK) {
-	  return TCL_ERROR;
-	}
-	handlerName = Tcl_GetStringFromObj(handlerNameObj, &handlerLen);
-
-	// Look up the definition from our registry array.
-	handlerRegistryList = Tcl_GetVar2Ex(interp, "::websockets::handlerRegistry", handlerName, TCL_GLOBAL_ONLY);
-	if (handlerRegistryList == NULL) {
-	  Tcl_AppendResult(interp, "-handlers specified \"", handlerName, "\" but was not defined yet", NULL);
-	  return TCL_ERROR;
-	}
-
-	// Duplicate and copy the handler name.
-	handlerNameCopy = ckalloc(handlerLen + 1);
-	if (handlerNameCopy == NULL) {
-	  return TCL_ERROR;
-	}
-	strncpy(handlerNameCopy, handlerName, handlerLen);
-	handlerNameCopy[handlerLen] = '\0';
-	protocols[q].name = handlerNameCopy;
-
-	// Set the callback and session structure size.
-	protocols[q].callback = callback_websocket_handler;
-	protocols[q].per_session_data_size = sizeof(struct websocket_session_struct);
+      tlsObjs[suboptIndex - SUBOPT_SESSIONCACHE] = objv[++i];
+      break;
+    }
+    case SUBOPT_FD: {
+      // an inherited listening socket; checked below.
+      if (i + 1 >= objc) {
+	Tcl_WrongNumArgs (interp, 1, objv, "-fd value");
+	return TCL_ERROR;
       }
 
-      // explicitly zero the terminating entry (even though we memset it all to zero).
-      protocols[q].name = NULL;
-      protocols[q].callback = NULL;
-      protocols[q].per_session_data_size = 0;
-
+      if (Tcl_GetIntFromObj (interp, objv[++i], &inherited_fd) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (inherited_fd < 0) {
+	Tcl_AppendResult(interp, "-fd must not be negative", NULL);
+	return TCL_ERROR;
+      }
       break;
     }
     default: return TCL_ERROR;
@@ -669,8 +8053,24 @@ tclwebsockets_listenCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj
 
   }  // end for
 
+  // an inherited socket already has its port.
+  if (inherited_fd >= 0) {
+    int fd_port;
+
+    if (port == CONTEXT_PORT_NO_LISTEN || use_reuseport) {
+      Tcl_AppendResult(interp, "-fd cannot be combined with -port 0 or -reuseport", NULL);
+      if (protocols != NULL) ckfree((char*) protocols);
+      return TCL_ERROR;
+    }
+    if ((fd_port = tclwebsockets_listener_port(interp, inherited_fd)) < 0) {
+      if (protocols != NULL) ckfree((char*) protocols);
+      return TCL_ERROR;
+    }
+    port = fd_port;
+  }
+
   // require port
-  if (port == 0) {
+  if (port < 0) {
     Tcl_WrongNumArgs (interp, 1, objv, "-port is a required option");
     if (protocols != NULL) ckfree((char*) protocols);
     return TCL_ERROR;
@@ -682,6 +8082,70 @@ tclwebsockets_listenCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj
     return TCL_ERROR;
   }
 
+  // a lowered -highwater brings the default -lowwater down with it.
+  if (!lowwater_given && highwater > 0 && lowwater > highwater) {
+    lowwater = highwater / 4;
+  }
+  if (highwater > 0 && lowwater > highwater) {
+    Tcl_AppendResult(interp, "-lowwater must not exceed -highwater", NULL);
+    ckfree((char*) protocols);
+    return TCL_ERROR;
+  }
+
+  // without -compression, the extensions built into libwebsockets are offered.
+  if (compressionObj != NULL) {
+    static struct libwebsocket_extension no_extensions[1];
+
+    if (tclwebsockets_parse_compression(interp, compressionObj, &compression) != TCL_OK) {
+      ckfree((char*) protocols);
+      return TCL_ERROR;
+    }
+    extensions = (compression != NULL ? compression->extensions : no_extensions);
+  }
+
+  // the handshake counters are kept for every TLS listener.
+  for (i = 0; i < 6; i++) {
+    if (tlsObjs[i] != NULL && (!use_ssl || port == CONTEXT_PORT_NO_LISTEN)) {
+      Tcl_AppendResult(interp, subOptions[SUBOPT_SESSIONCACHE + i], " requires -ssl 1 and a port to listen on", NULL);
+      tclwebsockets_free_compression(compression);
+      ckfree((char*) protocols);
+      return TCL_ERROR;
+    }
+  }
+  if (use_ssl && port != CONTEXT_PORT_NO_LISTEN) {
+#if TCLWEBSOCKETS_OPENSSL
+    tls = tclwebsockets_new_tls(interp, tlsObjs[0], tlsObjs[1], tlsObjs[2], tlsObjs[3], tlsObjs[4], tlsObjs[5]);
+    if (tls == NULL) {
+      tclwebsockets_free_compression(compression);
+      ckfree((char*) protocols);
+      return TCL_ERROR;
+    }
+#else
+    for (i = 0; i < 6; i++) {
+      if (tlsObjs[i] != NULL) {
+	Tcl_AppendResult(interp, subOptions[SUBOPT_SESSIONCACHE + i], " needs tclwebsockets built with OpenSSL", NULL);
+	tclwebsockets_free_compression(compression);
+	ckfree((char*) protocols);
+	return TCL_ERROR;
+      }
+    }
+#endif
+  }
+
+  // worker threads create their own listeners from the same arguments.
+  if (num_threads > 0) {
+    if (port == CONTEXT_PORT_NO_LISTEN) {
+      Tcl_AppendResult(interp, "-threads requires a port to listen on", NULL);
+      tclwebsockets_free_compression(compression);
+      ckfree((char*) protocols);
+      return TCL_ERROR;
+    }
+    tclwebsockets_free_tls(tls);
+    tclwebsockets_free_compression(compression);
+    ckfree((char*) protocols);
+    return tclwebsockets_start_pool(interp, num_threads, threadInitObj, inherited_fd, objc, objv);
+  }
+
 
   // allocate a userdata structure.
   userdata = (struct context_userdata_struct*) ckalloc(sizeof(struct context_userdata_struct));
@@ -690,17 +8154,131 @@ tclwebsockets_listenCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj
     ckfree((char*) protocols);
     return TCL_ERROR;
   }
+  memset(userdata, 0, sizeof(struct context_userdata_struct));
   userdata->interp = interp;
   userdata->protocols = protocols;
+  userdata->num_protocols = num_protocols;
+  userdata->interpdata = (struct interp_data_struct*) Tcl_GetAssocData(interp, "tclwebsockets", NULL);
+
+  // resolve the lambdas of every handler now, so events need not look them up.
+  userdata->dispatch = (struct handler_dispatch_struct*) ckalloc(sizeof(struct handler_dispatch_struct) * num_protocols);
+  memset(userdata->dispatch, 0, sizeof(struct handler_dispatch_struct) * num_protocols);
+  for (i = 0; i < num_protocols; i++) {
+    userdata->dispatch[i].handler_name = protocols[i].name;
+    tclwebsockets_refresh_dispatch(interp, &userdata->dispatch[i], userdata->interpdata->handlerEpoch);
+  }
+
+  userdata->applyObj = Tcl_NewStringObj("::apply", -1);
+  Tcl_IncrRefCount(userdata->applyObj);
+  userdata->highwater = (size_t) highwater;
+  userdata->lowwater = (size_t) lowwater;
+  userdata->maxmessage = (size_t) maxmessage;
+  userdata->has_extensions = (extensions != NULL && extensions[0].name != NULL);
+  userdata->use_ssl = (use_ssl && port != CONTEXT_PORT_NO_LISTEN);
+
+  // the wheel ticks at a sixteenth of the shorter of the two intervals.
+  userdata->ping_interval_ns = ping_interval * 1000000;
+  userdata->idle_timeout_ns = idle_timeout * 1000000;
+  if (ping_interval > 0 || idle_timeout > 0) {
+    Tcl_WideInt tick_ms = (ping_interval > 0 && (idle_timeout == 0 || ping_interval < idle_timeout) ? ping_interval : idle_timeout) / 16;
+    if (tick_ms < WHEEL_MIN_TICK_MS) {
+      tick_ms = WHEEL_MIN_TICK_MS;
+    } else if (tick_ms > WHEEL_MAX_TICK_MS) {
+      tick_ms = WHEEL_MAX_TICK_MS;
+    }
+    userdata->wheel = (struct timing_wheel*) ckalloc(sizeof(struct timing_wheel));
+    memset(userdata->wheel, 0, sizeof(struct timing_wheel));
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+      userdata->wheel->slots[i].prev = userdata->wheel->slots[i].next = &userdata->wheel->slots[i];
+    }
+    userdata->wheel->tick_ns = tick_ms * 1000000;
+    userdata->wheel->current = tclwebsockets_now_ns() / userdata->wheel->tick_ns;
+  }
+
+  // the peer table is only kept when some rate is limited.
+  userdata->max_connections = max_connections;
+  userdata->connect_rate = connect_rate;
+  userdata->message_rate = message_rate;
+  if (connect_rate.rate > 0 || message_rate.rate > 0) {
+    tclwebsockets_peer_rehash(userdata, PEER_TABLE_MIN_SIZE, tclwebsockets_now_ns());
+  }
 
+  if (docroot[0] != '\0') {
+    userdata->files.docroot = ckalloc(strlen(docroot) + 1);
+    strcpy(userdata->files.docroot, docroot);
+    userdata->files.limit = (size_t) filecache;
+    Tcl_InitHashTable(&userdata->files.entries, TCL_STRING_KEYS);
+  }
+  Tcl_InitHashTable(&userdata->topics, TCL_STRING_KEYS);
+  userdata->create_commands = create_commands;
+  userdata->use_eventloop = use_eventloop;
+  userdata->compression = compression;
+  userdata->tls = tls;
+  userdata->listen_fd = -1;
+  userdata->drain_fd = -1;
+  if (use_eventloop) {
+    Tcl_InitHashTable(&userdata->pollfds, TCL_ONE_WORD_KEYS);
+  }
+
+
+  // start listening.  With -reuseport or -fd, libwebsockets first listens
+  // on a scratch port that we hold reserved, and its socket is then
+  // replaced by one bound with SO_REUSEPORT to the requested port, or by
+  // the inherited one.
+  {
+    ThreadSpecificData *tsdPtr = (ThreadSpecificData *) Tcl_GetThreadData(&dataKey, sizeof(ThreadSpecificData));
+    int bind_port = port, reserved_fd = -1;
 
-  // start listening.
-  context = libwebsocket_create_context(port, interface_name, protocols,
-					libwebsocket_internal_extensions,
-					(use_ssl ? cert_path : NULL), (use_ssl ? key_path : NULL),
-					-1, -1, 0);
+    if (inherited_fd >= 0 || port == CONTEXT_PORT_NO_LISTEN) {
+      use_reuseport = 0;
+    }
+    if (inherited_fd >= 0 || use_reuseport) {
+      reserved_fd = tclwebsockets_reserve_port(interp, &bind_port);
+    }
+    if (reserved_fd >= 0 || (inherited_fd < 0 && !use_reuseport)) {
+      // requiring client certificates gets the SSL_CTX handed to us (see
+      // tclwebsockets_tls_configure), which then stops requiring them.
+      tsdPtr->creatingContext = userdata;
+      context = libwebsocket_create_context(bind_port, interface_name, protocols, extensions,
+					    (use_ssl ? cert_path : NULL), (use_ssl ? key_path : NULL),
+					    -1, -1, (tls != NULL ? LWS_SERVER_OPTION_REQUIRE_VALID_OPENSSL_CLIENT_CERT : 0));
+      tsdPtr->creatingContext = NULL;
+    }
+    if (reserved_fd >= 0) {
+      close(reserved_fd);
+    }
+#if TCLWEBSOCKETS_OPENSSL
+    if (context != NULL && tls != NULL && (tls->ssl_ctx == NULL || tls->error[0] != '\0')) {
+      Tcl_AppendResult(interp, (tls->ssl_ctx == NULL ? "-ssl needs libwebsockets built with OpenSSL" : tls->error), NULL);
+      libwebsocket_context_destroy(context);
+      context = NULL;
+    }
+#endif
+    if (context != NULL && use_reuseport && tclwebsockets_rebind_reuseport(interp, userdata, port) != TCL_OK) {
+      libwebsocket_context_destroy(context);
+      context = NULL;
+    }
+    if (context != NULL && inherited_fd >= 0 && tclwebsockets_adopt_listener(interp, userdata, inherited_fd) != TCL_OK) {
+      libwebsocket_context_destroy(context);
+      context = NULL;
+    }
+  }
   if (context == NULL) {
-    Tcl_AppendResult(interp, "libwebsocket init failed", NULL);
+    if (*Tcl_GetStringResult(interp) == '\0') {
+      Tcl_AppendResult(interp, "libwebsocket init failed", NULL);
+    }
+    tclwebsockets_free_pollfds(userdata);
+    tclwebsockets_free_dispatch(userdata->dispatch, userdata->num_protocols);
+    Tcl_DecrRefCount(userdata->applyObj);
+    Tcl_DeleteHashTable(&userdata->topics);
+    tclwebsockets_free_compression(compression);
+    if (userdata->wheel != NULL) {
+      ckfree((char*) userdata->wheel);
+    }
+    tclwebsockets_free_file_cache(&userdata->files);
+    tclwebsockets_free_tls(tls);
+    tclwebsockets_free_peers(userdata);
+    tclwebsockets_pool_release(&userdata->pool);
     ckfree((char*) userdata);
     ckfree((char*) protocols);
     return TCL_ERROR;
@@ -712,12 +8290,10 @@ tclwebsockets_listenCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj
 
   // create a Tcl command to interface with this context.
   {
-    static unsigned long nextAutoCounter = 0;
-    char *commandName = ckalloc(64);
-    snprintf(commandName, 64, "lwscontext%lu", nextAutoCounter++);
+    char commandName[64];
+    snprintf(commandName, sizeof(commandName), "lwscontext%lu", userdata->interpdata->nextContextIndex++);
 
-    // TODO: supply a delete handler instead of NULL.
-    userdata->cmdToken = Tcl_CreateObjCommand(interp, commandName, tclwebsockets_contextCmd, userdata, NULL);
+    userdata->cmdToken = Tcl_CreateObjCommand(interp, commandName, tclwebsockets_contextCmd, userdata, tclwebsockets_context_deleteProc);
 
     Tcl_SetObjResult(interp, Tcl_NewStringObj(commandName, -1));
   }
@@ -731,6 +8307,200 @@ tclwebsockets_listenCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj
 
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_get_context --
+ *
+ *    Find the user data of a listener from the name of its command.
+ *
+ *----------------------------------------------------------------------
+ */
+static struct context_userdata_struct *
+tclwebsockets_get_context(Tcl_Interp *interp, const char *name)
+{
+  Tcl_CmdInfo info;
+
+  if (!Tcl_GetCommandInfo(interp, name, &info) || info.objProc != tclwebsockets_contextCmd) {
+    Tcl_AppendResult(interp, "invalid context \"", name, "\"", NULL);
+    return NULL;
+  }
+  return (struct context_userdata_struct*) info.objClientData;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * tclwebsockets_connectCmd --
+ *
+ *    Open an outbound connection, handled by the events of a handler.
+ *    Without -context, all connections for the same handler share a
+ *    context (in event loop mode) that is created on first use.
+ *
+ * Results:
+ *    The name of the connection.
+ *
+ *----------------------------------------------------------------------
+ */
+int
+tclwebsockets_connectCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  struct interp_data_struct *interpdata = (struct interp_data_struct*) cData;
+  struct context_userdata_struct *userdata = NULL;
+  struct websocket_session_struct *session_data;
+  struct libwebsocket *wsi;
+  const char *host = NULL, *path = "/", *origin = NULL, *handler = NULL, *contextName = NULL;
+  int port = 0, ssl = 0;
+  int i, q, suboptIndex;
+
+  static CONST char *subOptions[] = {
+    "-host",
+    "-port",
+    "-path",
+    "-handler",
+    "-origin",
+    "-ssl",
+    "-context",
+    NULL
+  };
+
+  enum suboptions {
+    SUBOPT_HOST,
+    SUBOPT_PORT,
+    SUBOPT_PATH,
+    SUBOPT_HANDLER,
+    SUBOPT_ORIGIN,
+    SUBOPT_SSL,
+    SUBOPT_CONTEXT
+  };
+
+  // basic command line processing
+  if (objc < 3 || (objc & 1) == 0) {
+    Tcl_WrongNumArgs (interp, 1, objv, "-host hostname -handler name ?-port integer? ?-path path? ?-origin origin? ?-ssl 0|1|2? ?-context context?");
+    return TCL_ERROR;
+  }
+
+  for (i = 1; i < objc; i += 2) {
+    if (Tcl_GetIndexFromObj(interp, objv[i], subOptions, "suboption", TCL_EXACT, &suboptIndex) != TCL_OK) {
+      return TCL_ERROR;
+    }
+
+    switch ((enum suboptions)suboptIndex) {
+    case SUBOPT_HOST: host = Tcl_GetString(objv[i + 1]); break;
+    case SUBOPT_PATH: path = Tcl_GetString(objv[i + 1]); break;
+    case SUBOPT_HANDLER: handler = Tcl_GetString(objv[i + 1]); break;
+    case SUBOPT_ORIGIN: origin = Tcl_GetString(objv[i + 1]); break;
+    case SUBOPT_CONTEXT: contextName = Tcl_GetString(objv[i + 1]); break;
+    case SUBOPT_PORT: {
+      if (Tcl_GetIntFromObj (interp, objv[i + 1], &port) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (port <= 0 || port > 0xFFFF) {
+	Tcl_AppendResult(interp, "invalid value for -port", NULL);
+	return TCL_ERROR;
+      }
+      break;
+    }
+    case SUBOPT_SSL: {
+      // 2 also accepts self-signed server certificates.
+      if (Tcl_GetIntFromObj (interp, objv[i + 1], &ssl) == TCL_ERROR) {
+	return TCL_ERROR;
+      }
+      if (ssl < 0 || ssl > 2) {
+	Tcl_AppendResult(interp, "invalid value for -ssl", NULL);
+	return TCL_ERROR;
+      }
+      break;
+    }
+    }
+  }
+
+  if (host == NULL || handler == NULL) {
+    Tcl_AppendResult (interp, "-host and -handler are required options", NULL);
+    return TCL_ERROR;
+  }
+  if (port == 0) {
+    port = (ssl ? 443 : 80);
+  }
+  if (origin == NULL) {
+    origin = host;
+  }
+
+  // find or create the context.
+  if (contextName != NULL) {
+    userdata = tclwebsockets_get_context(interp, contextName);
+  } else {
+    Tcl_HashEntry *entry = Tcl_FindHashEntry(&interpdata->clientContexts, handler);
+    if (entry != NULL) {
+      userdata = (struct context_userdata_struct*) Tcl_GetHashValue(entry);
+    } else {
+      Tcl_Obj *listenObjv[7];
+      int isNew, n;
+
+      listenObjv[0] = Tcl_NewStringObj("websockets::listen", -1);
+      listenObjv[1] = Tcl_NewStringObj("-port", -1);
+      listenObjv[2] = Tcl_NewIntObj(CONTEXT_PORT_NO_LISTEN);
+      listenObjv[3] = Tcl_NewStringObj("-handlers", -1);
+      listenObjv[4] = Tcl_NewListObj(1, NULL);
+      Tcl_ListObjAppendElement(NULL, listenObjv[4], Tcl_NewStringObj(handler, -1));
+      listenObjv[5] = Tcl_NewStringObj("-eventloop", -1);
+      listenObjv[6] = Tcl_NewIntObj(1);
+      for (n = 0; n < 7; n++) {
+	Tcl_IncrRefCount(listenObjv[n]);
+      }
+      if (Tcl_EvalObjv(interp, 7, listenObjv, TCL_EVAL_GLOBAL) == TCL_OK) {
+	userdata = tclwebsockets_get_context(interp, Tcl_GetStringResult(interp));
+      }
+      for (n = 0; n < 7; n++) {
+	Tcl_DecrRefCount(listenObjv[n]);
+      }
+      if (userdata != NULL) {
+	Tcl_ResetResult(interp);
+	userdata->client_entry = Tcl_CreateHashEntry(&interpdata->clientContexts, handler, &isNew);
+	Tcl_SetHashValue(userdata->client_entry, userdata);
+      }
+    }
+  }
+  if (userdata == NULL) {
+    return TCL_ERROR;
+  }
+
+  for (q = 0; q < userdata->num_protocols; q++) {
+    if (strcmp(userdata->protocols[q].name, handler) == 0) {
+      break;
+    }
+  }
+  if (q == userdata->num_protocols) {
+    Tcl_AppendResult(interp, "handler \"", handler, "\" is not used by context \"", contextName, "\"", NULL);
+    return TCL_ERROR;
+  }
+
+  // libwebsockets frees the user space of a session with free(), and is
+  // given ours so that the session is ready before the handshake.
+  session_data = (struct websocket_session_struct*) malloc(sizeof(struct websocket_session_struct));
+  if (session_data == NULL) {
+    Tcl_AppendResult(interp, "out of memory", NULL);
+    return TCL_ERROR;
+  }
+  memset(session_data, 0, sizeof(struct websocket_session_struct));
+  tclwebsockets_init_session(userdata, session_data, &userdata->dispatch[q], NULL, 1);
+
+  wsi = libwebsocket_client_connect_extended(userdata->context, host, port, ssl, path, host, origin, handler, -1, session_data);
+  if (wsi == NULL) {
+    tclwebsockets_free_session(userdata, session_data);
+    free(session_data);
+    STATS_INCR(userdata, connect_errors);
+    Tcl_AppendResult(interp, "unable to connect to ", host, NULL);
+    return TCL_ERROR;
+  }
+  session_data->socket = wsi;
+
+  Tcl_SetObjResult(interp, session_data->connection_cmd_obj);
+  return TCL_OK;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -749,9 +8519,27 @@ tclwebsockets_listenCmd(ClientData cData, Tcl_Interp *interp, int objc, Tcl_Obj
  *----------------------------------------------------------------------
  */
 
+static void
+tclwebsockets_free_interpdata(ClientData cData, Tcl_Interp *interp)
+{
+    struct interp_data_struct *interpdata = (struct interp_data_struct*) cData;
+    Tcl_HashEntry *entry;
+    Tcl_HashSearch search;
+
+    // handles still cached in objects must not point into the table.
+    for (entry = Tcl_FirstHashEntry(&interpdata->handles, &search); entry != NULL; entry = Tcl_NextHashEntry(&search)) {
+	((struct connection_handle*) Tcl_GetHashValue(entry))->entry = NULL;
+    }
+    Tcl_DeleteHashTable(&interpdata->handles);
+    Tcl_DeleteHashTable(&interpdata->clientContexts);
+    ckfree((char*) cData);
+}
+
 EXTERN int
 Tclwebsockets_Init(Tcl_Interp *interp)
 {
+    struct interp_data_struct *interpdata;
+
     /*
      * This may work with older versions of Tcl, but I've only tested against Tcl 8.5.
      */
@@ -767,9 +8555,44 @@ Tclwebsockets_Init(Tcl_Interp *interp)
 	return TCL_ERROR;
     }
 
+#if TCLWEBSOCKETS_OPENSSL
+    tclwebsockets_tls_init();
+#endif
+
     /* Create the commands */
     Tcl_CreateObjCommand(interp, "websockets::listen", (Tcl_ObjCmdProc *) tclwebsockets_listenCmd, (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
 
+    /* The coroutines of -coroutine handlers are named after their connections. */
+    if (Tcl_FindNamespace(interp, "::websockets::coroutine", NULL, 0) == NULL) {
+	Tcl_CreateNamespace(interp, "::websockets::coroutine", NULL, NULL);
+    }
+
+    /*
+     * Per-interp state.  websockets::handler increments the linked epoch
+     * whenever a definition changes, which invalidates the dispatch tables.
+     */
+    interpdata = (struct interp_data_struct*) ckalloc(sizeof(struct interp_data_struct));
+    memset(interpdata, 0, sizeof(struct interp_data_struct));
+    Tcl_InitHashTable(&interpdata->handles, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&interpdata->clientContexts, TCL_STRING_KEYS);
+    Tcl_SetAssocData(interp, "tclwebsockets", tclwebsockets_free_interpdata, (ClientData) interpdata);
+    if (Tcl_LinkVar(interp, "::websockets::handlerEpoch", (char*) &interpdata->handlerEpoch, TCL_LINK_INT) != TCL_OK) {
+	return TCL_ERROR;
+    }
+
+    Tcl_CreateObjCommand(interp, "websockets::loadstatevars", (Tcl_ObjCmdProc *) tclwebsockets_loadstatevarsCmd, (ClientData) interpdata, (Tcl_CmdDeleteProc *)NULL);
+    Tcl_CreateObjCommand(interp, "websockets::savestatevars", (Tcl_ObjCmdProc *) tclwebsockets_savestatevarsCmd, (ClientData) interpdata, (Tcl_CmdDeleteProc *)NULL);
+    Tcl_CreateObjCommand(interp, "websockets::conn", (Tcl_ObjCmdProc *) tclwebsockets_connCmd, (ClientData) interpdata, (Tcl_CmdDeleteProc *)NULL);
+#if TCLWEBSOCKETS_NRE
+    /* $wsi waitwritable needs the coroutines of Tcl 8.6. */
+    tclwebsockets_have_nre = (Tcl_PkgPresent(interp, "Tcl", "8.6", 0) != NULL);
+    Tcl_ResetResult(interp);
+    if (tclwebsockets_have_nre) {
+	Tcl_NRCreateCommand(interp, "websockets::conn", (Tcl_ObjCmdProc *) tclwebsockets_connCmd, (Tcl_ObjCmdProc *) tclwebsockets_connNRCmd, (ClientData) interpdata, (Tcl_CmdDeleteProc *)NULL);
+    }
+#endif
+    Tcl_CreateObjCommand(interp, "websockets::connect", (Tcl_ObjCmdProc *) tclwebsockets_connectCmd, (ClientData) interpdata, (Tcl_CmdDeleteProc *)NULL);
+
     return TCL_OK;
 }
 
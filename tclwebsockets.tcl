@@ -16,7 +16,12 @@ proc handler {args} {
 
 	set handlerName ""
 	set handlerStatevars ""
+	set handlerStreaming 0
+	set handlerBatch ""
+	set handlerFormat "text"
+	set handlerCoroutine 0
 	set handlerEvents 0
+	set handlerEventList {}
 	foreach {key value} $args {
 		switch -exact $key {
 			-name {
@@ -34,6 +39,54 @@ proc handler {args} {
 				}
 				set handlerStatevars $value
 			}
+			-streaming {
+				if {![string is boolean -strict $value]} {
+					error "Expected a boolean for $key: $value"
+				}
+				set handlerStreaming $value
+			}
+			-coroutine {
+				if {![string is boolean -strict $value]} {
+					error "Expected a boolean for $key: $value"
+				}
+				if {$value && ![package vsatisfies [package provide Tcl] 8.6]} {
+					error "Option $key requires Tcl 8.6"
+				}
+				set handlerCoroutine $value
+			}
+			-format {
+				if {$value ni {text json}} {
+					error "Expected text or json for $key: $value"
+				}
+				set handlerFormat $value
+			}
+			-batch {
+				if {$handlerBatch != ""} {
+					error "Already supplied: $key"
+				}
+				if {[catch {dict size $value}]} {
+					error "Expected a dict for $key: $value"
+				}
+				set handlerBatch [dict create maxcount 64 maxdelay-us 0]
+				dict for {batchKey batchValue} $value {
+					switch -exact $batchKey {
+						maxcount {
+							if {![string is integer -strict $batchValue] || $batchValue < 1} {
+								error "Expected a positive integer for $batchKey: $batchValue"
+							}
+						}
+						maxdelay-us {
+							if {![string is wideinteger -strict $batchValue] || $batchValue < 0} {
+								error "Expected a non-negative integer for $batchKey: $batchValue"
+							}
+						}
+						default {
+							error "Unrecognized key in $key: $batchKey"
+						}
+					}
+					dict set handlerBatch $batchKey $batchValue
+				}
+			}
 			-events {
 				if {$handlerEvents != 0} {
 					error "Already supplied: $key"
@@ -48,6 +101,7 @@ proc handler {args} {
 						"client-established" -
 						"closed" -
 						"receive" -
+						"receive-batch" -
 						"client-receive" -
 						"client-receive-pong" -
 						"client-writeable" -
@@ -55,9 +109,11 @@ proc handler {args} {
 						"http" -
 						"broadcast" -
 						"filter-network-connection" -
-						"filter-protocol-connection" {
+						"filter-protocol-connection" -
+						"timeout" -
+						"drained" {
 							# recognized eventName
-							set ::websockets::handlerMethods($handlerName:$eventName) [list $eventArgs $eventProc]
+							lappend handlerEventList $eventName $eventArgs $eventProc
 						}
 						default {
 							error "Unrecognized event: $eventName"
@@ -78,9 +134,102 @@ proc handler {args} {
 	if {$handlerEvents == 0} {
 		error "Require option -events was not given"
 	}
+	if {$handlerFormat eq "json" && $handlerStreaming} {
+		error "Options -format json and -streaming cannot be combined"
+	}
+	if {$handlerCoroutine} {
+		# the conversation lives in the locals of the coroutine.
+		foreach option {-statevars -streaming -batch} value [list [llength $handlerStatevars] $handlerStreaming [expr {$handlerBatch ne ""}]] {
+			if {$value} {
+				error "Options -coroutine and $option cannot be combined"
+			}
+		}
+		set startEvent 0
+		foreach {eventName eventArgs eventProc} $handlerEventList {
+			switch -exact $eventName {
+				"established" -
+				"client-established" {
+					set startEvent 1
+				}
+				"receive" -
+				"client-receive" {
+					error "Option -coroutine takes messages from yield, not a $eventName event"
+				}
+			}
+		}
+		if {!$startEvent} {
+			error "Option -coroutine requires an established or client-established event"
+		}
+	}
+	if {$handlerBatch != ""} {
+		if {$handlerStreaming} {
+			error "Options -batch and -streaming cannot be combined"
+		}
+		set batchEvent 0
+		foreach {eventName eventArgs eventProc} $handlerEventList {
+			if {$eventName eq "receive-batch"} {
+				set batchEvent 1
+			}
+		}
+		if {!$batchEvent} {
+			error "Option -batch requires a receive-batch event"
+		}
+	}
+
+	# Compile each event into a lambda that is invoked with "apply".
+	# The statevars of the connection are kept in C and set as locals
+	# of the lambda before the body runs, then captured back afterwards.
+	array unset ::websockets::handlerMethods [string map {* \\* ? \\? [ \\[ ] \\] \\ \\\\} $handlerName]:*
+	foreach {eventName eventArgs eventProc} $handlerEventList {
+		if {[llength $handlerStatevars] > 0} {
+			# any outcome of the body (error, return -code, break...)
+			# is passed on as it was, without leaving __result or
+			# __options behind among the locals.
+			set eventProc "::websockets::loadstatevars\n[list catch $eventProc __result __options]\n::websockets::savestatevars\nreturn -options \[set __options\]\[unset __options\] \[set __result\]\[unset __result\]"
+		}
+		# events pass at most three arguments (wsi, data, flags); any
+		# further ones are left empty, as they were before lambdas.
+		set lambdaArgs {}
+		foreach arg $eventArgs {
+			if {[llength $lambdaArgs] >= 3 && [llength $arg] == 1 && $arg ne "args"} {
+				set arg [list $arg {}]
+			}
+			lappend lambdaArgs $arg
+		}
+		set lambda [list $lambdaArgs $eventProc ::]
+		set ::websockets::handlerMethods($handlerName:$eventName) [list [llength $eventArgs] $lambda]
+	}
+
+	set ::websockets::handlerRegistry($handlerName) [list statevars $handlerStatevars streaming $handlerStreaming batch $handlerBatch format $handlerFormat coroutine $handlerCoroutine]
+
+	# invalidate the dispatch tables that listeners have cached in C.
+	incr ::websockets::handlerEpoch
+}
 
 
-	set ::websockets::handlerRegistry($handlerName) [list statevars $handlerStatevars]
+# Return a script that recreates the procs of this namespace and the
+# handler definitions in another interpreter, such as the worker threads
+# of websockets::listen -threads.
+proc replicate {} {
+	set script ""
+	foreach procName [info procs ::websockets::*] {
+		set procArgs {}
+		foreach arg [info args $procName] {
+			if {[info default $procName $arg default]} {
+				lappend procArgs [list $arg $default]
+			} else {
+				lappend procArgs $arg
+			}
+		}
+		append script [list proc $procName $procArgs [info body $procName]] "\n"
+	}
+	foreach arrayName {handlerMethods handlerRegistry} {
+		if {[array exists ::websockets::$arrayName]} {
+			append script [list array set ::websockets::$arrayName [array get ::websockets::$arrayName]] "\n"
+		}
+	}
+	append script "incr ::websockets::handlerEpoch\n"
+	return $script
 }
 
 
@@ -0,0 +1,148 @@
+#
+# Server side of the benchmarks run by tests/bench.tcl.
+#
+#     bench-server.tcl port ?threads? ?tlsdir?
+#
+# Prints "ready" once listening, and exits when stdin is closed.  A
+# "stats json", "stats tls" or "stats writes" line on stdin is answered
+# with those counters of the listener, as one line of JSON.  With
+# tlsdir, listens with -ssl, using the cert.pem, key.pem and
+# ticket.keys in it.
+#
+
+package require tclwebsockets 1.0
+
+lassign $argv port threads tlsdir
+if {$threads eq ""} {
+	set threads 0
+}
+set tlsOptions {}
+if {$tlsdir ne ""} {
+	set tlsOptions [list -ssl 1 -certificate [file join $tlsdir cert.pem] -privatekey [file join $tlsdir key.pem] \
+		-ticketkeys [file join $tlsdir ticket.keys]]
+}
+
+
+websockets::handler -name "bench-echo" -events {
+	receive {wsi data} {
+		$wsi write $data
+	}
+}
+
+websockets::handler -name "bench-echo-binary" -events {
+	receive {wsi data} {
+		$wsi write -binary $data
+	}
+}
+
+# four replies per message: with raw frames they go out in one send().
+websockets::handler -name "bench-echo-writev" -events {
+	receive {wsi data} {
+		$wsi writev [list $data $data $data $data]
+	}
+}
+
+websockets::handler -name "bench-statevars" -statevars {count last} -events {
+	established wsi {
+		set count 0
+		set last ""
+	}
+	receive {wsi data} {
+		incr count
+		set last $data
+		$wsi write $data
+	}
+}
+
+# a statevar that grows with every message: each lappend is only cheap
+# if the value is modified in place rather than copied.
+websockets::handler -name "bench-statevars-append" -statevars {history} -events {
+	established wsi {
+		set history {}
+	}
+	receive {wsi data} {
+		lappend history $data
+		$wsi write $data
+	}
+}
+
+# with -threads, the broadcast has to go through the pool to reach the
+# connections of every worker.
+proc broadcast {args} {
+	if {[info exists ::websockets::workerIndex]} {
+		websockets::post "\$::listener broadcast $args"
+	} else {
+		$::websockets::context broadcast {*}$args
+	}
+}
+
+websockets::handler -name "bench-broadcast" -events {
+	receive {wsi data} {
+		broadcast $data
+	}
+}
+
+websockets::handler -name "bench-broadcast-binary" -events {
+	receive {wsi data} {
+		broadcast -binary $data
+	}
+}
+
+websockets::handler -name "bench-json" -format json -events {
+	receive {wsi message} {
+		$wsi writejson {object {t string pad string}} $message
+	}
+}
+
+websockets::handler -name "bench-churn" -events {
+	established wsi {
+	}
+}
+
+
+set listener [websockets::listen -port $port -eventloop 1 -threads $threads -highwater 0 {*}$tlsOptions \
+	-threadinit [list proc broadcast {args} [info body broadcast]] \
+	-handlers {bench-echo bench-echo-binary bench-echo-writev bench-statevars bench-statevars-append bench-broadcast bench-broadcast-binary bench-json bench-churn}]
+
+# workers set this for their own listener.
+set ::websockets::context $listener
+
+# workers keep their own counters, so there are none to report with -threads.
+proc statsJson {group} {
+	if {[catch {$::listener stats} stats]} {
+		return null
+	}
+	# the write calls per message show what coalescing saves.
+	if {$group eq "writes"} {
+		set messages [dict get $stats messages-out]
+		set calls [dict get $stats write-calls]
+		return "\{\"messages_out\": $messages, \"write_calls\": $calls,\
+			\"messages_per_write\": [expr {$calls > 0 ? double($messages) / $calls : 0.0}]\}"
+	}
+	if {![dict exists $stats $group]} {
+		return null
+	}
+	set fields {}
+	dict for {key value} [dict get $stats $group] {
+		lappend fields "\"[string map {- _} $key]\": $value"
+	}
+	if {$group eq "json"} {
+		lappend fields "\"unit\": \"[dict get $stats handler-time unit]\""
+	}
+	return "\{[join $fields {, }]\}"
+}
+
+fileevent stdin readable {
+	if {[gets stdin line] < 0} {
+		$listener delete
+		exit
+	}
+	if {[lindex $line 0] eq "stats"} {
+		puts [statsJson [lindex $line 1]]
+		flush stdout
+	}
+}
+
+puts "ready"
+flush stdout
+vwait forever
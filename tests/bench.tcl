@@ -0,0 +1,179 @@
+#
+# Benchmark driver, run by "make bench".
+#
+#     bench.tcl -loadgen path ?-port n? ?-threads n? ?-clients n? ?-messages n?
+#               ?-size bytes? ?-tlstime seconds? ?-soakconns n? ?-soakgrowth kb?
+#               ?-scenarios list? ?-output file?
+#
+# For each scenario, starts tests/bench-server.tcl in a separate tclsh,
+# drives it over loopback with the loadgen program and collects its
+# results.  The tls-handshake scenario uses "openssl s_time" instead.
+# The combined results are written as one JSON document.
+#
+# The soak-churn scenario, which is not run by default, opens and closes
+# -soakconns connections while sampling the server's RSS, and fails if
+# it grows by more than -soakgrowth kB once warmed up.
+#
+
+set options {
+	-loadgen ./loadgen
+	-port 17681
+	-threads 0
+	-clients 50
+	-messages 2000
+	-size 64
+	-tlstime 5
+	-soakconns 1000000
+	-soakgrowth 4096
+	-scenarios {echo-text echo-writev echo-binary echo-statevars echo-statevars-append echo-json broadcast-text broadcast-binary churn tls-handshake}
+	-output ""
+}
+foreach {key value} $argv {
+	if {![dict exists $options $key]} {
+		puts stderr "unknown option $key, expected one of: [dict keys $options]"
+		exit 2
+	}
+	dict set options $key $value
+}
+dict with options {}
+
+set benchDir [file dirname [file normalize [info script]]]
+
+# scenario -> loadgen arguments.  Broadcast sends fewer messages, since
+# every one of them is delivered to all clients.  -writes is ours, not
+# loadgen's: those scenarios also report the server's write calls.
+set broadcastMessages [expr {max(1, ${-messages} / 10)}]
+set scenarios [dict create \
+	echo-text        [list -mode echo -protocol bench-echo -binary 0 -writes 1] \
+	echo-writev      [list -mode echo -protocol bench-echo-writev -binary 0 -writes 1] \
+	echo-binary      [list -mode echo -protocol bench-echo-binary -binary 1] \
+	echo-statevars   [list -mode echo -protocol bench-statevars -binary 0] \
+	echo-statevars-append [list -mode echo -protocol bench-statevars-append -binary 0] \
+	echo-json        [list -mode echo -protocol bench-json -binary 0 -json 1] \
+	broadcast-text   [list -mode broadcast -protocol bench-broadcast -binary 0 -messages $broadcastMessages] \
+	broadcast-binary [list -mode broadcast -protocol bench-broadcast-binary -binary 1 -messages $broadcastMessages] \
+	churn            [list -mode churn -protocol bench-churn -messages [expr {${-messages} * 5}]] \
+	soak-churn       [list -mode churn -protocol bench-churn -messages ${-soakconns} -sources 250 \
+				-samples 20 -maxgrowth ${-soakgrowth} -timeout 3600] \
+	tls-handshake    [list -mode tls] \
+]
+
+
+# The server runs in its own process, so its CPU time and RSS can be measured.
+proc startServer {{tlsdir ""}} {
+	global options benchDir
+	dict with options {}
+
+	set serverArgs [list ${-port} ${-threads}]
+	if {$tlsdir ne ""} {
+		lappend serverArgs $tlsdir
+	}
+	set server [open |[list [info nameofexecutable] [file join $benchDir bench-server.tcl] {*}$serverArgs 2>@ stderr] r+]
+	if {[gets $server line] < 0 || $line ne "ready"} {
+		error "bench server did not start"
+	}
+	return $server
+}
+
+proc serverStats {server group} {
+	puts $server "stats $group"
+	flush $server
+	gets $server result
+	return $result
+}
+
+proc runScenario {name loadgenArgs} {
+	global options
+	dict with options {}
+
+	if {[dict get $loadgenArgs -mode] eq "tls"} {
+		return [runTlsScenario $name]
+	}
+	set server [startServer]
+
+	set args [list -port ${-port} -clients ${-clients} -messages ${-messages} -size ${-size} \
+		-pid [pid $server] -scenario $name]
+	# later values override the defaults above.
+	lappend args {*}[dict remove $loadgenArgs -writes]
+	set code [catch {exec ${-loadgen} {*}$args 2>@ stderr} result]
+
+	# JSON scenarios also report the time the server spent parsing and writing.
+	if {!$code && [dict exists $loadgenArgs -json]} {
+		set result "[string range $result 0 end-1], \"server_json\": [serverStats $server json]\}"
+	}
+	if {!$code && [dict exists $loadgenArgs -writes]} {
+		set result "[string range $result 0 end-1], \"server_writes\": [serverStats $server writes]\}"
+	}
+
+	close $server
+	if {$code} {
+		error "scenario $name failed: $result"
+	}
+	return $result
+}
+
+# Handshakes per second with a throwaway self-signed certificate: full
+# handshakes first, then ones that resume the session of the first.
+proc runTlsScenario {name} {
+	global options
+	dict with options {}
+
+	if {[auto_execok openssl] eq ""} {
+		puts stderr "skipping $name: no openssl command"
+		return ""
+	}
+	set tlsdir [file join [expr {[info exists ::env(TMPDIR)] ? $::env(TMPDIR) : "/tmp"}] bench-tls-[pid]]
+	file mkdir $tlsdir
+	exec openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=localhost -days 1 \
+		-keyout [file join $tlsdir key.pem] -out [file join $tlsdir cert.pem] 2>@1
+	set f [open [file join $tlsdir ticket.keys] w]
+	puts $f [exec openssl rand -hex 48]
+	close $f
+
+	set server [startServer $tlsdir]
+	set result "\{\"scenario\": \"$name\", \"seconds\": ${-tlstime}"
+	set code [catch {
+		foreach {mode field} {-new full_per_sec -reuse resumed_per_sec} {
+			set start [clock milliseconds]
+			set output [exec -ignorestderr openssl s_time -connect 127.0.0.1:${-port} $mode -time ${-tlstime}]
+			set elapsed [expr {max(1, [clock milliseconds] - $start) / 1000.0}]
+			if {![regexp {(\d+) connections in \d+ real seconds} $output -> count]} {
+				error "unexpected openssl s_time output: $output"
+			}
+			append result ", \"$field\": [format %.1f [expr {$count / $elapsed}]]"
+		}
+		append result ", \"server_tls\": [serverStats $server tls]\}"
+	} message]
+
+	close $server
+	file delete -force $tlsdir
+	if {$code} {
+		error "scenario $name failed: $message"
+	}
+	return $result
+}
+
+
+set results {}
+foreach name ${-scenarios} {
+	if {![dict exists $scenarios $name]} {
+		puts stderr "unknown scenario $name, expected one of: [dict keys $scenarios]"
+		exit 2
+	}
+	puts stderr "running $name..."
+	set result [runScenario $name [dict get $scenarios $name]]
+	if {$result ne ""} {
+		lappend results $result
+	}
+}
+
+set json "\{\"package\": \"tclwebsockets\", \"version\": \"[package require tclwebsockets]\", "
+append json "\"tcl\": \"[info patchlevel]\", \"threads\": ${-threads}, \"results\": \[\n  "
+append json [join $results ",\n  "] "\n\]\}"
+
+if {${-output} ne ""} {
+	set f [open ${-output} w]
+	puts $f $json
+	close $f
+}
+puts $json
@@ -0,0 +1,685 @@
+/*
+ * loadgen
+ *
+ * Load generator for the tclwebsockets benchmarks (see tests/bench.tcl).
+ * Opens a number of websocket client connections over loopback and
+ * drives them in one of these modes:
+ *
+ *   echo       every client sends a message, waits for it to come back
+ *              and sends the next one.
+ *   broadcast  the first client sends a message, which the server
+ *              broadcasts to every client; the next one is sent once
+ *              all of them have received it.
+ *   churn      connections are opened, upgraded and closed again.
+ *
+ * The round-trip latency of every message is taken from the timestamp
+ * that starts its payload.  The results are printed as one JSON object,
+ * including the CPU time and RSS of the server process if its pid is
+ * given.  With -samples, the RSS is also sampled that many times over
+ * the run, and -maxgrowth fails the run if it grew by more than that
+ * many kB after the first quarter (a soak test for leaks).
+ *
+ * Freely redistributable under the BSD license.  See LICENSE
+ * for details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+
+enum mode_enum { MODE_ECHO, MODE_BROADCAST, MODE_CHURN };
+
+enum client_state {
+  STATE_IDLE,                           // not connected (churn mode only).
+  STATE_CONNECTING,
+  STATE_HANDSHAKE,                      // upgrade request sent.
+  STATE_OPEN
+};
+
+struct client {
+  int fd;
+  enum client_state state;
+  unsigned char *in;                    // received bytes not yet consumed.
+  size_t inlen, insize;
+  unsigned char *out;                   // bytes waiting to be sent.
+  size_t outlen, outoff, outsize;
+  long sent, received;
+};
+
+struct options {
+  const char *host;
+  int port;
+  const char *protocol;
+  const char *scenario;
+  enum mode_enum mode;
+  int clients;
+  long messages;                        // per client (echo), in total (broadcast, churn).
+  size_t size;
+  int binary;
+  int json;                             // text payloads are JSON objects.
+  int pid;                              // server process, 0 if unknown.
+  int timeout;                          // seconds.
+  int sources;                          // loopback source addresses to spread connections over.
+  int samples;                          // RSS samples taken over the run.
+  long maxgrowth;                       // kB of RSS growth allowed after warming up, -1 for any.
+};
+
+static struct options opt = {
+  "127.0.0.1", 7681, "bench-echo", "echo", MODE_ECHO, 10, 1000, 64, 0, 0, 0, 60, 1, 0, -1
+};
+
+// {"t":" + 16 hex digits + ","pad":" + "}
+#define JSON_TS_OFFSET 6
+#define JSON_MIN_SIZE (JSON_TS_OFFSET + 16 + 9 + 2)
+
+static uint64_t *latencies;
+static size_t num_latencies, max_latencies;
+static long errors;
+static long connects;                   // for picking the next source address.
+
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+fail(const char *what)
+{
+  fprintf(stderr, "loadgen: %s: %s\n", what, strerror(errno));
+  exit(1);
+}
+
+static void
+buffer_append(unsigned char **buf, size_t *len, size_t *size, const unsigned char *data, size_t n)
+{
+  if (*len + n > *size) {
+    *size = (*len + n) * 2;
+    *buf = realloc(*buf, *size);
+    if (*buf == NULL) {
+      fail("realloc");
+    }
+  }
+  memcpy(*buf + *len, data, n);
+  *len += n;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * server_usage --
+ *
+ *    Read the CPU time (in microseconds) and the current and peak RSS
+ *    (in kB) of the server process from /proc.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+server_usage(double *cpu_us, long *rss_kb, long *hwm_kb)
+{
+  char path[64], line[1024];
+  unsigned long utime = 0, stime = 0;
+  FILE *f;
+
+  *cpu_us = 0;
+  *rss_kb = *hwm_kb = 0;
+  if (opt.pid <= 0) {
+    return;
+  }
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", opt.pid);
+  if ((f = fopen(path, "r")) != NULL) {
+    if (fgets(line, sizeof(line), f) != NULL) {
+      // the fields after the parenthesized command name; utime and stime are 14 and 15.
+      char *p = strrchr(line, ')');
+      if (p != NULL && sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) == 2) {
+	*cpu_us = (double) (utime + stime) * 1e6 / sysconf(_SC_CLK_TCK);
+      }
+    }
+    fclose(f);
+  }
+
+  snprintf(path, sizeof(path), "/proc/%d/status", opt.pid);
+  if ((f = fopen(path, "r")) != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      sscanf(line, "VmRSS: %ld", rss_kb);
+      sscanf(line, "VmHWM: %ld", hwm_kb);
+    }
+    fclose(f);
+  }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * client_connect --
+ *
+ *    Start a non-blocking connect and queue the upgrade request.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+client_connect(struct client *c)
+{
+  struct sockaddr_in addr;
+  char request[512];
+  int n, one = 1;
+
+  c->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (c->fd < 0) {
+    fail("socket");
+  }
+  fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  // a long churn run would run out of ephemeral ports on one address
+  // while the closed ones sit in TIME_WAIT, so it cycles through
+  // 127.0.1.1, 127.0.1.2 and so on.
+  if (opt.sources > 1) {
+    long k = connects++ % opt.sources;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x7f000000 | (1 + k / 250) << 8 | (1 + k % 250));
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+#endif
+    if (bind(c->fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+      fail("bind");
+    }
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(opt.port);
+  if (inet_pton(AF_INET, opt.host, &addr.sin_addr) != 1) {
+    fprintf(stderr, "loadgen: invalid address %s\n", opt.host);
+    exit(1);
+  }
+  if (connect(c->fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 && errno != EINPROGRESS) {
+    fail("connect");
+  }
+
+  n = snprintf(request, sizeof(request),
+	       "GET / HTTP/1.1\r\n"
+	       "Host: %s:%d\r\n"
+	       "Upgrade: websocket\r\n"
+	       "Connection: Upgrade\r\n"
+	       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	       "Sec-WebSocket-Protocol: %s\r\n"
+	       "Sec-WebSocket-Version: 13\r\n"
+	       "Origin: http://%s\r\n"
+	       "\r\n", opt.host, opt.port, opt.protocol, opt.host);
+  c->inlen = c->outlen = c->outoff = 0;
+  buffer_append(&c->out, &c->outlen, &c->outsize, (unsigned char*) request, n);
+  c->state = STATE_CONNECTING;
+}
+
+static void
+client_close(struct client *c)
+{
+  if (c->fd >= 0) {
+    close(c->fd);
+  }
+  c->fd = -1;
+  c->state = STATE_IDLE;
+  c->inlen = c->outlen = c->outoff = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * client_send_message --
+ *
+ *    Queue one masked frame whose payload starts with the current time.
+ *    Text payloads carry it as 16 hex digits, binary ones as 8 bytes.
+ *    With -json, text payloads are {"t":"<hex digits>","pad":"xx..."}.
+ *
+ *----------------------------------------------------------------------
+ */
+static void
+client_send_message(struct client *c)
+{
+  static const unsigned char mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+  unsigned char header[14], *payload;
+  size_t hlen = 0, i, size = opt.size;
+  uint64_t ts = now_ns();
+
+  if (opt.json && size < JSON_MIN_SIZE) {
+    size = JSON_MIN_SIZE;
+  } else if (size < 16) {
+    size = 16;
+  }
+  payload = malloc(size);
+  if (opt.binary) {
+    for (i = 0; i < 8; i++) {
+      payload[i] = (unsigned char) (ts >> (8 * i));
+    }
+    for (i = 8; i < size; i++) {
+      payload[i] = (unsigned char) i;
+    }
+  } else if (opt.json) {
+    char head[JSON_TS_OFFSET + 16 + 10];
+    snprintf(head, sizeof(head), "{\"t\":\"%016llx\",\"pad\":\"", (unsigned long long) ts);
+    memcpy(payload, head, JSON_MIN_SIZE - 2);
+    memset(payload + JSON_MIN_SIZE - 2, 'x', size - JSON_MIN_SIZE);
+    memcpy(payload + size - 2, "\"}", 2);
+  } else {
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) ts);
+    memcpy(payload, hex, 16);
+    memset(payload + 16, 'x', size - 16);
+  }
+
+  header[hlen++] = 0x80 | (opt.binary ? 0x2 : 0x1);
+  if (size < 126) {
+    header[hlen++] = 0x80 | size;
+  } else if (size < 65536) {
+    header[hlen++] = 0x80 | 126;
+    header[hlen++] = size >> 8;
+    header[hlen++] = size & 0xff;
+  } else {
+    header[hlen++] = 0x80 | 127;
+    for (i = 0; i < 8; i++) {
+      header[hlen++] = (unsigned char) ((uint64_t) size >> (56 - 8 * i));
+    }
+  }
+  memcpy(header + hlen, mask, 4);
+  hlen += 4;
+  for (i = 0; i < size; i++) {
+    payload[i] ^= mask[i & 3];
+  }
+
+  buffer_append(&c->out, &c->outlen, &c->outsize, header, hlen);
+  buffer_append(&c->out, &c->outlen, &c->outsize, payload, size);
+  free(payload);
+  c->sent++;
+}
+
+
+static void
+record_latency(const unsigned char *payload, size_t len)
+{
+  uint64_t ts = 0;
+  size_t i;
+
+  if (len < (opt.json ? JSON_MIN_SIZE : 16)) {
+    errors++;
+    return;
+  }
+  if (opt.json) {
+    payload += JSON_TS_OFFSET;
+  }
+  if (opt.binary) {
+    for (i = 0; i < 8; i++) {
+      ts |= (uint64_t) payload[i] << (8 * i);
+    }
+  } else {
+    char hex[17];
+    memcpy(hex, payload, 16);
+    hex[16] = '\0';
+    ts = strtoull(hex, NULL, 16);
+  }
+
+  if (num_latencies == max_latencies) {
+    max_latencies = (max_latencies ? max_latencies * 2 : 65536);
+    latencies = realloc(latencies, max_latencies * sizeof(uint64_t));
+    if (latencies == NULL) {
+      fail("realloc");
+    }
+  }
+  latencies[num_latencies++] = now_ns() - ts;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * client_parse --
+ *
+ *    Consume the handshake response or complete frames from the input
+ *    buffer of a client.
+ *
+ * Results:
+ *    The number of data messages received.
+ *
+ *----------------------------------------------------------------------
+ */
+static int
+client_parse(struct client *c)
+{
+  size_t off = 0;
+  int messages = 0;
+
+  if (c->state == STATE_HANDSHAKE) {
+    unsigned char *end = NULL;
+    size_t i;
+    for (i = 3; i < c->inlen; i++) {
+      if (memcmp(c->in + i - 3, "\r\n\r\n", 4) == 0) {
+	end = c->in + i + 1;
+	break;
+      }
+    }
+    if (end == NULL) {
+      return 0;
+    }
+    if (c->inlen < 12 || memcmp(c->in + 9, "101", 3) != 0) {
+      fprintf(stderr, "loadgen: upgrade refused: %.*s\n", (int) (end - c->in), c->in);
+      exit(1);
+    }
+    off = end - c->in;
+    c->state = STATE_OPEN;
+  }
+
+  while (c->state == STATE_OPEN && c->inlen - off >= 2) {
+    unsigned char *p = c->in + off;
+    int opcode = p[0] & 0x0f;
+    uint64_t len = p[1] & 0x7f;
+    size_t hlen = 2, i;
+
+    if (len == 126) {
+      if (c->inlen - off < 4) break;
+      len = ((uint64_t) p[2] << 8) | p[3];
+      hlen = 4;
+    } else if (len == 127) {
+      if (c->inlen - off < 10) break;
+      for (len = 0, i = 0; i < 8; i++) {
+	len = (len << 8) | p[2 + i];
+      }
+      hlen = 10;
+    }
+    if (p[1] & 0x80) {
+      hlen += 4;                        // servers do not mask, but skip it anyway.
+    }
+    if (c->inlen - off < hlen + len) {
+      break;
+    }
+
+    if (opcode == 0x1 || opcode == 0x2 || opcode == 0x0) {
+      record_latency(p + hlen, (size_t) len);
+      c->received++;
+      messages++;
+    } else if (opcode == 0x8) {
+      errors++;
+      client_close(c);
+      return messages;
+    }
+    off += hlen + len;
+  }
+
+  memmove(c->in, c->in + off, c->inlen - off);
+  c->inlen -= off;
+  return messages;
+}
+
+
+static int
+compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return (x > y) - (x < y);
+}
+
+static double
+percentile_us(double p)
+{
+  size_t i;
+
+  if (num_latencies == 0) {
+    return 0;
+  }
+  i = (size_t) (p * (num_latencies - 1));
+  return latencies[i] / 1000.0;
+}
+
+
+static void
+usage(void)
+{
+  fprintf(stderr,
+	  "usage: loadgen ?-host addr? ?-port n? ?-protocol name? ?-mode echo|broadcast|churn?\n"
+	  "               ?-clients n? ?-messages n? ?-size bytes? ?-binary 0|1? ?-json 0|1?\n"
+	  "               ?-pid serverpid? ?-scenario name? ?-timeout seconds?\n"
+	  "               ?-sources n? ?-samples n? ?-maxgrowth kb?\n");
+  exit(2);
+}
+
+
+int
+main(int argc, char **argv)
+{
+  struct client *clients;
+  struct pollfd *pfds;
+  uint64_t start, elapsed, deadline;
+  long target, done = 0, opened = 0, broadcast_received = 0;
+  double cpu_before, cpu_after;
+  long rss_kb, hwm_kb, *rss_samples = NULL, growth = 0;
+  int i, num_samples = 0;
+
+  for (i = 1; i + 1 < argc; i += 2) {
+    const char *o = argv[i], *v = argv[i + 1];
+    if (!strcmp(o, "-host")) opt.host = v;
+    else if (!strcmp(o, "-port")) opt.port = atoi(v);
+    else if (!strcmp(o, "-protocol")) opt.protocol = v;
+    else if (!strcmp(o, "-scenario")) opt.scenario = v;
+    else if (!strcmp(o, "-clients")) opt.clients = atoi(v);
+    else if (!strcmp(o, "-messages")) opt.messages = atol(v);
+    else if (!strcmp(o, "-size")) opt.size = (size_t) atol(v);
+    else if (!strcmp(o, "-binary")) opt.binary = atoi(v);
+    else if (!strcmp(o, "-json")) opt.json = atoi(v);
+    else if (!strcmp(o, "-pid")) opt.pid = atoi(v);
+    else if (!strcmp(o, "-timeout")) opt.timeout = atoi(v);
+    else if (!strcmp(o, "-sources")) opt.sources = atoi(v);
+    else if (!strcmp(o, "-samples")) opt.samples = atoi(v);
+    else if (!strcmp(o, "-maxgrowth")) opt.maxgrowth = atol(v);
+    else if (!strcmp(o, "-mode")) {
+      if (!strcmp(v, "echo")) opt.mode = MODE_ECHO;
+      else if (!strcmp(v, "broadcast")) opt.mode = MODE_BROADCAST;
+      else if (!strcmp(v, "churn")) opt.mode = MODE_CHURN;
+      else usage();
+    } else usage();
+  }
+  if (i != argc || opt.clients <= 0 || opt.messages <= 0 || opt.sources <= 0 || opt.sources > 250 * 250 || opt.samples < 0) {
+    usage();
+  }
+  if (opt.samples > 0 && (rss_samples = calloc(opt.samples, sizeof(long))) == NULL) {
+    fail("calloc");
+  }
+
+  clients = calloc(opt.clients, sizeof(struct client));
+  pfds = calloc(opt.clients, sizeof(struct pollfd));
+  if (clients == NULL || pfds == NULL) {
+    fail("calloc");
+  }
+  for (i = 0; i < opt.clients; i++) {
+    clients[i].fd = -1;
+  }
+
+  // echo counts every reply, broadcast every delivery, churn every upgrade.
+  switch (opt.mode) {
+  case MODE_ECHO: target = opt.messages * opt.clients; break;
+  case MODE_BROADCAST: target = opt.messages * opt.clients; break;
+  default: target = opt.messages; break;
+  }
+
+  server_usage(&cpu_before, &rss_kb, &hwm_kb);
+  start = now_ns();
+  deadline = start + (uint64_t) opt.timeout * 1000000000ull;
+
+  for (i = 0; i < opt.clients; i++) {
+    client_connect(&clients[i]);
+    opened++;
+  }
+
+  while (done < target) {
+    // sample i is taken once (i + 1) / samples of the run is done.
+    while (num_samples < opt.samples && done >= target / opt.samples * (num_samples + 1)) {
+      double cpu;
+      server_usage(&cpu, &rss_samples[num_samples++], &hwm_kb);
+    }
+    if (now_ns() > deadline) {
+      fprintf(stderr, "loadgen: timed out after %ld of %ld\n", done, target);
+      errors++;
+      break;
+    }
+
+    for (i = 0; i < opt.clients; i++) {
+      struct client *c = &clients[i];
+      pfds[i].fd = c->fd;
+      pfds[i].events = (c->state == STATE_CONNECTING || c->outoff < c->outlen ? POLLOUT : 0) | POLLIN;
+      pfds[i].revents = 0;
+    }
+    if (poll(pfds, opt.clients, 100) < 0) {
+      if (errno == EINTR) continue;
+      fail("poll");
+    }
+
+    for (i = 0; i < opt.clients; i++) {
+      struct client *c = &clients[i];
+      unsigned char buf[65536];
+      ssize_t n;
+      int messages;
+
+      if (c->fd < 0 || pfds[i].revents == 0) {
+	continue;
+      }
+      if (pfds[i].revents & (POLLERR | POLLHUP) && !(pfds[i].revents & POLLIN)) {
+	fprintf(stderr, "loadgen: connection %d failed\n", i);
+	exit(1);
+      }
+      if (c->state == STATE_CONNECTING && (pfds[i].revents & POLLOUT)) {
+	c->state = STATE_HANDSHAKE;
+      }
+
+      if ((pfds[i].revents & POLLOUT) && c->outoff < c->outlen) {
+	n = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL);
+	if (n < 0 && errno != EAGAIN) {
+	  fail("send");
+	}
+	if (n > 0) {
+	  c->outoff += n;
+	  if (c->outoff == c->outlen) {
+	    c->outoff = c->outlen = 0;
+	  }
+	}
+      }
+
+      if (!(pfds[i].revents & POLLIN)) {
+	continue;
+      }
+      n = recv(c->fd, buf, sizeof(buf), 0);
+      if (n == 0) {
+	fprintf(stderr, "loadgen: server closed connection %d\n", i);
+	exit(1);
+      }
+      if (n < 0) {
+	if (errno == EAGAIN) continue;
+	fail("recv");
+      }
+      buffer_append(&c->in, &c->inlen, &c->insize, buf, n);
+
+      if (c->state == STATE_HANDSHAKE) {
+	client_parse(c);
+	if (c->state != STATE_OPEN) {
+	  continue;
+	}
+	switch (opt.mode) {
+	case MODE_ECHO:
+	  client_send_message(c);
+	  break;
+	case MODE_BROADCAST:
+	  // the first message goes out once every client is subscribed.
+	  {
+	    int j, all_open = 1;
+	    for (j = 0; j < opt.clients; j++) {
+	      if (clients[j].state != STATE_OPEN) all_open = 0;
+	    }
+	    if (all_open) client_send_message(&clients[0]);
+	  }
+	  break;
+	case MODE_CHURN:
+	  done++;
+	  client_close(c);
+	  if (opened < opt.messages) {
+	    client_connect(c);
+	    opened++;
+	  }
+	  continue;
+	}
+      }
+
+      messages = client_parse(c);
+      done += messages;
+      if (opt.mode == MODE_ECHO && messages > 0 && c->sent < opt.messages) {
+	client_send_message(c);
+      }
+      if (opt.mode == MODE_BROADCAST && messages > 0) {
+	broadcast_received += messages;
+	if (broadcast_received == (long) opt.clients * clients[0].sent && clients[0].sent < opt.messages) {
+	  client_send_message(&clients[0]);
+	}
+      }
+    }
+  }
+
+  elapsed = now_ns() - start;
+  server_usage(&cpu_after, &rss_kb, &hwm_kb);
+  qsort(latencies, num_latencies, sizeof(uint64_t), compare_u64);
+  if (num_samples < opt.samples && done >= target) {
+    rss_samples[num_samples++] = rss_kb;
+  }
+
+  // growth after the first quarter, once pools and caches have filled.
+  if (num_samples >= 4) {
+    long warm = rss_samples[num_samples / 4 - 1];
+    for (i = num_samples / 4; i < num_samples; i++) {
+      if (rss_samples[i] - warm > growth) {
+	growth = rss_samples[i] - warm;
+      }
+    }
+    if (opt.maxgrowth >= 0 && growth > opt.maxgrowth) {
+      fprintf(stderr, "loadgen: server RSS grew by %ld kB after warming up, more than %ld kB\n", growth, opt.maxgrowth);
+      errors++;
+    }
+  }
+
+  printf("{\"scenario\": \"%s\", \"mode\": \"%s\", \"protocol\": \"%s\", "
+	 "\"clients\": %d, \"messages\": %ld, \"size\": %lu, \"binary\": %s, "
+	 "\"completed\": %ld, \"errors\": %ld, \"elapsed_s\": %.3f, \"%s_per_sec\": %.1f, "
+	 "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}, "
+	 "\"server_cpu_us_per_%s\": %.2f, \"server_rss_kb\": %ld, \"server_peak_rss_kb\": %ld",
+	 opt.scenario,
+	 opt.mode == MODE_ECHO ? "echo" : opt.mode == MODE_BROADCAST ? "broadcast" : "churn",
+	 opt.protocol, opt.clients, opt.messages, (unsigned long) opt.size, opt.binary ? "true" : "false",
+	 done, errors, elapsed / 1e9, opt.mode == MODE_CHURN ? "conns" : "msgs", done / (elapsed / 1e9),
+	 percentile_us(0.50), percentile_us(0.99), percentile_us(0.999), percentile_us(1.0),
+	 opt.mode == MODE_CHURN ? "conn" : "msg", done > 0 ? (cpu_after - cpu_before) / done : 0.0,
+	 rss_kb, hwm_kb);
+  if (opt.samples > 0) {
+    printf(", \"server_rss_samples_kb\": [");
+    for (i = 0; i < num_samples; i++) {
+      printf("%s%ld", i > 0 ? ", " : "", rss_samples[i]);
+    }
+    printf("], \"server_rss_growth_kb\": %ld", growth);
+  }
+  printf("}\n");
+
+  return errors ? 1 : 0;
+}
@@ -18,8 +18,8 @@ websockets::handler \
 		receive {wsi data} {
 			puts "got $data"
 		}
-		filter-network-connection {wsi - headers} {
-			parray headers
+		filter-network-connection {wsi peer} {
+			puts "connection from [dict get $peer address]"
 			return 0
 		}
 		client-writeable {wsi} {
@@ -50,7 +50,7 @@ websockets::handler \
 
 
 
-set l [websockets::listen -port 7681 -interface "127.0.0.1" \
+set l [websockets::listen -port 7681 -interface "127.0.0.1" -eventloop 1 \
 		   -handlers [list "dumb-increment-protocol" "lws-mirror-protocol"]]
 
 puts $l
@@ -61,13 +61,15 @@ puts $l
 #	-handlers [list "dumb-increment-protocol"]
 
 
-proc idle_service_sock {sock} {
-	$sock service
-	after idle "idle_service_sock $sock"
-}
+# With -eventloop the sockets are serviced by the Tcl notifier, so just
+# enter the event loop.  Without it, the listener must be polled:
+#proc idle_service_sock {sock} {
+#	$sock service
+#	after idle "idle_service_sock $sock"
+#}
+#idle_service_sock $l
 
 puts "now servicing listener..."
-idle_service_sock $l
 vwait forever
 
 